@@ -45,11 +45,68 @@ MDJVU_FUNCTION int32 mdjvu_multipage_classify_patterns
      int32 *result, int32 *dpi, mdjvu_matcher_options_t,
      void (*report)(void *, int), void *param);
 
+/* Same, but pages are cut into nshards ranges that are classified
+ * in parallel (if minidjvu is built with pthreads), and then their classes
+ * are merged. This is much faster on long books, but the result differs
+ * from the one of mdjvu_multipage_classify_patterns():
+ * patterns from different ranges are only compared through their classes.
+ */
+MDJVU_FUNCTION int32 mdjvu_multipage_classify_patterns_in_shards
+    (int32 npages, int32 total_npatterns, int32 *npatterns, mdjvu_pattern_t **,
+     int32 *result, int32 *dpi, mdjvu_matcher_options_t,
+     void (*report)(void *, int), void *param, int nshards);
+
 MDJVU_FUNCTION int32 mdjvu_multipage_classify_bitmaps
     (int32 npages, int32 total_npatterns, mdjvu_image_t *,
      int32 *result, mdjvu_matcher_options_t,
      void (*report)(void *, int), void *param, int centers_needed);
 
+/* Same, but patterns are created in up to nthreads threads
+ * (if minidjvu is built with pthreads).
+ */
+MDJVU_FUNCTION int32 mdjvu_multipage_classify_bitmaps_in_threads
+    (int32 npages, int32 total_npatterns, mdjvu_image_t *,
+     int32 *result, mdjvu_matcher_options_t,
+     void (*report)(void *, int), void *param, int centers_needed,
+     int nthreads);
+
+/* Same, and classification is done in nshards shards
+ * (see mdjvu_multipage_classify_patterns_in_shards()).
+ *
+ * With a single shard, patterns are created page by page and destroyed
+ * when their classes can't be met any more, so memory is mostly taken
+ * by patterns of letters that occur on every page.
+ * If max_patterns_per_class is positive, then a class keeps no more
+ * patterns than that (roughly), and new patterns are compared only with them.
+ * This saves a lot of memory, but changes the result.
+ * With several shards, patterns of all pages are kept at once.
+ *
+ * If peak_memory is not NULL, the maximal number of bytes taken by
+ * patterns at once is stored there.
+ *
+ * If originals is not NULL (see mdjvu_multipage_find_duplicates()),
+ * exact duplicates are put into the classes of equal letters
+ * without creating patterns and matching.
+ * Matcher options may be NULL, then only exact duplicates are classified
+ * together (this needs no patterns at all), except for specks of less
+ * than 5 pixels, which are cheaper to code again than to copy.
+ */
+MDJVU_FUNCTION int32 mdjvu_multipage_classify_bitmaps_in_shards
+    (int32 npages, int32 total_npatterns, mdjvu_image_t *,
+     int32 *result, mdjvu_matcher_options_t,
+     void (*report)(void *, int), void *param, int centers_needed,
+     int nthreads, int nshards, int32 max_patterns_per_class,
+     double *peak_memory, const int32 *originals);
+
+/* Find letters that are bit-for-bit equal to earlier letters (by hashing).
+ * Bitmaps are numbered through all pages, as in result above.
+ * originals[i] is the number of the first letter equal to the i-th bitmap
+ * (i itself for the first one), or -1 if the bitmap is not a letter.
+ * Returns the number of duplicates, that is, letters with originals[i] != i.
+ */
+MDJVU_FUNCTION int32 mdjvu_multipage_find_duplicates
+    (int32 npages, mdjvu_image_t *, int32 *originals);
+
 
 /* Decide what bitmaps will be put into the dictionary (by tag).
  * This implementation simply chooses tags which occur more than in one page.
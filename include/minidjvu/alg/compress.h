@@ -27,5 +27,47 @@ MDJVU_FUNCTION void mdjvu_set_report(mdjvu_compression_options_t, int);
 MDJVU_FUNCTION void mdjvu_set_report_start_page(mdjvu_compression_options_t, int);
 MDJVU_FUNCTION void mdjvu_set_report_total_pages(mdjvu_compression_options_t, int);
 
+/* Number of threads to use in multipage compression (default 1). */
+MDJVU_FUNCTION void mdjvu_set_threads(mdjvu_compression_options_t, int);
+
+/* Classify ranges of pages in parallel, one range per thread (default 0).
+ * This is faster, but a bit less thorough than the serial classification.
+ */
+MDJVU_FUNCTION void mdjvu_set_sharded_classification(mdjvu_compression_options_t, int);
+
+/* Keep patterns of at most that many letters in each class
+ * when classifying (default 0, no limit).
+ * This bounds memory consumption, but new letters are compared
+ * only with those kept. Not used with sharded classification.
+ */
+MDJVU_FUNCTION void mdjvu_set_max_patterns_per_class(mdjvu_compression_options_t, int);
+
+/* Substitute letters with equal ones in mdjvu_compress_image()
+ * when no matcher options are given (default 0).
+ * Duplicates are found by hashing, so this is fast and lossless.
+ * Specks of less than 5 pixels are not substituted.
+ * (mdjvu_compress_multipage() without matcher options always does that.)
+ */
+MDJVU_FUNCTION void mdjvu_set_exact_substitution(mdjvu_compression_options_t, int);
+
+/* Classify letters that are equal to earlier ones without matching them,
+ * by hashing (default 0). This saves most of the matching time on typeset
+ * pages, but the classes may differ a bit: a duplicate no longer joins
+ * classes that the matcher would have merged through it.
+ * Without matcher options, duplicates are classified that way anyway.
+ */
+MDJVU_FUNCTION void mdjvu_set_classify_duplicates(mdjvu_compression_options_t, int);
+
+/* Peak number of bytes taken by patterns while classifying
+ * in the last mdjvu_compress_multipage() call with these options.
+ */
+MDJVU_FUNCTION double mdjvu_get_peak_pattern_memory(mdjvu_compression_options_t);
+
+/* Number of letters that were exact duplicates of other letters
+ * in the last compression (they are classified without matching).
+ * Duplicates are only looked for as described above, otherwise it's 0.
+ */
+MDJVU_FUNCTION int32 mdjvu_get_duplicate_count(mdjvu_compression_options_t);
+
 MDJVU_FUNCTION void mdjvu_compress_image(mdjvu_image_t, mdjvu_compression_options_t);
 MDJVU_FUNCTION mdjvu_image_t mdjvu_compress_multipage(int n, mdjvu_image_t *pages, mdjvu_compression_options_t);
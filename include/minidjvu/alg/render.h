@@ -3,3 +3,13 @@
  */
 
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_render(mdjvu_image_t);
+
+/* Render rows y0 to y1 - 1 of the image a band at a time,
+ * so that only a few hundred rows are in memory at once.
+ * The callback gets every row, top to bottom, in packed form
+ * (see mdjvu_bitmap_access_packed_row()); the row is valid only during the call.
+ * If the callback returns 0, rendering stops and the function returns 0;
+ * otherwise it returns 1.
+ */
+MDJVU_FUNCTION int mdjvu_render_band(mdjvu_image_t, int32 y0, int32 y1,
+    int (*callback)(void *param, int32 y, unsigned char *row), void *param);
@@ -11,3 +11,18 @@
  */
 
 MDJVU_FUNCTION void mdjvu_smooth(mdjvu_bitmap_t b);
+
+/*
+ * The same filter applied to packed rows fed from top to bottom,
+ * so that a page can be smoothed while it is being split.
+ * Push every row, then NULL past the bottom. Each push but the first
+ * writes the previous row, smoothed and packed, into `result'
+ * and returns 1; the first push returns 0.
+ */
+
+typedef struct MinidjvuSmoother *mdjvu_smoother_t;
+
+MDJVU_FUNCTION mdjvu_smoother_t mdjvu_smoother_create(int32 width);
+MDJVU_FUNCTION void mdjvu_smoother_destroy(mdjvu_smoother_t);
+MDJVU_FUNCTION int mdjvu_smoother_push_row(mdjvu_smoother_t,
+    const unsigned char *row, unsigned char *result);
@@ -10,8 +10,32 @@ MDJVU_FUNCTION mdjvu_split_options_t mdjvu_split_options_create(void);
  * This is only a recomendation, nothing is guaranteed.
  */
 MDJVU_FUNCTION void mdjvu_split_options_set_maximum_shape_size(mdjvu_split_options_t, int32 s);
+/*
+ * Split the page in horizontal bands in n threads (default 1).
+ * Shapes and holes crossing the cuts are stitched together afterwards,
+ * so the result is the same. The shapes inside a hole crossing a cut
+ * (text in a frame) are drawn while stitching, in one thread.
+ */
+MDJVU_FUNCTION void mdjvu_split_options_set_threads(mdjvu_split_options_t, int n);
+/*
+ * Smooth the bitmap as mdjvu_smooth() does while splitting it (default 0).
+ * The bitmap itself is not changed.
+ */
+MDJVU_FUNCTION void mdjvu_split_options_set_smooth(mdjvu_split_options_t, int);
 MDJVU_FUNCTION void mdjvu_split_options_destroy(mdjvu_split_options_t);
 
 
 MDJVU_FUNCTION mdjvu_image_t
     mdjvu_split(mdjvu_bitmap_t, int32 dpi, mdjvu_split_options_t);
+
+/*
+ * Same as mdjvu_split(), but the bitmap rows are pulled one by one
+ * from top to bottom by get_row(), so the whole page needs not exist.
+ * get_row() fills a packed row (as mdjvu_bitmap_access_packed_row() gives)
+ * and returns 0 on failure; then NULL is returned.
+ * The threads option is ignored: bands need the whole bitmap.
+ * With smoothing, a row is smoothed once the row below it is pulled.
+ */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_split_stream(int32 width, int32 height,
+    int32 dpi, mdjvu_split_options_t,
+    int (*get_row)(void *param, int32 y, unsigned char *row), void *param);
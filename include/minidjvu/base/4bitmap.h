@@ -89,10 +89,49 @@ MDJVU_FUNCTION void mdjvu_bitmap_remove_margins
     (mdjvu_bitmap_t, int32 *x, int32 *y);
 
 /* Count the number of black pixels in the bitmap.
- * The results are not cached, so it uses O(width * height) time each call.
+ * The results are not cached, but packed rows are counted a word at a time.
  */
 MDJVU_FUNCTION int32 mdjvu_bitmap_get_mass(mdjvu_bitmap_t);
 
+/* Get a hash of the bitmap's dimensions and pixels.
+ * Equal bitmaps (see below) have equal hashes.
+ */
+MDJVU_FUNCTION uint32 mdjvu_bitmap_get_hash(mdjvu_bitmap_t);
+
+/* Returns 1 if the bitmaps have the same size and pixels, 0 otherwise. */
+MDJVU_FUNCTION int mdjvu_bitmap_equal(mdjvu_bitmap_t, mdjvu_bitmap_t);
+
+/* Operations on packed rows, done several pixels at once.
+ * Rows are packed as in mdjvu_bitmap_access_packed_row(),
+ * pixels are counted from the leftmost bit of the first byte.
+ */
+
+/* operations for combining pixels */
+#define MDJVU_BITMAP_COPY 0
+#define MDJVU_BITMAP_OR   1
+#define MDJVU_BITMAP_AND  2
+#define MDJVU_BITMAP_XOR  3
+
+/* Combine n pixels of dst starting from dst_x with n pixels of src
+ * starting from src_x. Other pixels of dst are not changed.
+ */
+MDJVU_FUNCTION void mdjvu_packed_row_combine(unsigned char *dst, int32 dst_x,
+    const unsigned char *src, int32 src_x, int32 n, int op);
+
+/* Count black pixels among the first n ones. */
+MDJVU_FUNCTION int32 mdjvu_packed_row_get_mass(const unsigned char *, int32 n);
+
+/* Find the leftmost and the rightmost black pixels among the first n ones.
+ * Returns 0 if there are none.
+ */
+MDJVU_FUNCTION int mdjvu_packed_row_get_extent
+    (const unsigned char *, int32 n, int32 *left, int32 *right);
+
+/* Combine the first bitmap with src put at (x, y) (parts outside are ignored).
+ */
+MDJVU_FUNCTION void mdjvu_bitmap_combine
+    (mdjvu_bitmap_t, mdjvu_bitmap_t src, int32 x, int32 y, int op);
+
 #ifdef MINIDJVU_WRAPPERS
     struct MinidjvuBitmap
     {
@@ -148,5 +187,14 @@ MDJVU_FUNCTION int32 mdjvu_bitmap_get_mass(mdjvu_bitmap_t);
 
         inline int32 get_mass()
             { return mdjvu_bitmap_get_mass(this); }
+
+        inline uint32 get_hash()
+            { return mdjvu_bitmap_get_hash(this); }
+
+        inline int equal(mdjvu_bitmap_t other)
+            { return mdjvu_bitmap_equal(this, other); }
+
+        inline void combine(mdjvu_bitmap_t src, int32 x, int32 y, int op)
+            { mdjvu_bitmap_combine(this, src, x, y, op); }
     };
 #endif
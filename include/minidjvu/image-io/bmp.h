@@ -13,3 +13,11 @@ MDJVU_FUNCTION int mdjvu_file_save_bmp(mdjvu_bitmap_t, mdjvu_file_t, int32 resol
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_load_bmp(const char *path, mdjvu_error_t *);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t, mdjvu_error_t *);
+
+/*
+ * Split the bitmap into letters as mdjvu_split() does, while reading it.
+ * BMP rows go from the bottom, so the file must be seekable.
+ * NULL if failed.
+ */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_split_bmp(const char *path, int32 dpi, mdjvu_split_options_t, mdjvu_error_t *);
+MDJVU_FUNCTION mdjvu_image_t mdjvu_file_split_bmp(mdjvu_file_t, int32 dpi, mdjvu_split_options_t, mdjvu_error_t *);
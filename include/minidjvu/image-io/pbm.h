@@ -8,8 +8,22 @@
 MDJVU_FUNCTION int mdjvu_save_pbm(mdjvu_bitmap_t, const char *path, mdjvu_error_t *);
 MDJVU_FUNCTION int mdjvu_file_save_pbm(mdjvu_bitmap_t, mdjvu_file_t, mdjvu_error_t *);
 
+/*
+ * Save what mdjvu_render() would give without rendering the whole page at once.
+ * 1 - success, 0 - failure
+ */
+MDJVU_FUNCTION int mdjvu_save_rendered_pbm(mdjvu_image_t, const char *path, mdjvu_error_t *);
+MDJVU_FUNCTION int mdjvu_file_save_rendered_pbm(mdjvu_image_t, mdjvu_file_t, mdjvu_error_t *);
+
 /*
  * These functions return NULL if failed
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t, mdjvu_error_t *);
+
+/*
+ * Split the bitmap into letters as mdjvu_split() does, while reading it.
+ * NULL if failed.
+ */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_split_pbm(const char *path, int32 dpi, mdjvu_split_options_t, mdjvu_error_t *);
+MDJVU_FUNCTION mdjvu_image_t mdjvu_file_split_pbm(mdjvu_file_t, int32 dpi, mdjvu_split_options_t, mdjvu_error_t *);
@@ -7,6 +7,9 @@
 
 MDJVU_FUNCTION int mdjvu_save_tiff(mdjvu_bitmap_t, const char *path, mdjvu_error_t *);
 
+/* Save what mdjvu_render() would give, rendering the image band by band. */
+MDJVU_FUNCTION int mdjvu_save_rendered_tiff(mdjvu_image_t, const char *path, mdjvu_error_t *);
+
 
 /* If the TIFF file has no resolution information,
  * then `resolution' will be unchanged.
@@ -14,6 +17,13 @@ MDJVU_FUNCTION int mdjvu_save_tiff(mdjvu_bitmap_t, const char *path, mdjvu_error
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_load_tiff(const char *path, int32 *resolution, mdjvu_error_t *, uint32 idx);
 
+/* Split the page into letters as mdjvu_split() does, while reading it.
+ * `resolution' works as in mdjvu_load_tiff(); the page is split
+ * at *resolution dpi, or at `dpi' if `resolution' is NULL.
+ * NULL if failed.
+ */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_split_tiff(const char *path, int32 *resolution, int32 dpi, mdjvu_split_options_t, mdjvu_error_t *, uint32 idx);
+
 MDJVU_FUNCTION int mdjvu_have_tiff_support(void);
 
 MDJVU_FUNCTION void mdjvu_disable_tiff_warnings(void);
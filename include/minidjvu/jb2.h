@@ -36,3 +36,12 @@ MDJVU_FUNCTION void mdjvu_find_prototypes(mdjvu_image_t);
 MDJVU_FUNCTION void mdjvu_multipage_find_prototypes
     (mdjvu_image_t dict, int32 npages, mdjvu_image_t *pages,
      void (*report)(void *param, int page), void *param);
+
+/*
+ * Same, but pages are searched in up to nthreads threads
+ * (if minidjvu is built with pthreads).
+ * report() is still called in page order, from the calling thread.
+ */
+MDJVU_FUNCTION void mdjvu_multipage_find_prototypes_in_threads
+    (mdjvu_image_t dict, int32 npages, mdjvu_image_t *pages,
+     void (*report)(void *param, int page), void *param, int nthreads);
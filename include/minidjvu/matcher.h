@@ -33,7 +33,9 @@ typedef struct MinidjvuPattern *mdjvu_pattern_t;
 
 
 /* Allocate a pattern and calculate all necessary information.
- * Memory consumption is byte per pixel + constant (with default matcher).
+ * Memory consumption is byte per pixel + constant (with default matcher),
+ * MDJVU_MATCHER_PITH_2 adds about two bits per pixel
+ * (see mdjvu_pattern_get_memory_size()).
  * The pattern would be independent on the bitmap given.
  *     (that is, you can destroy the bitmap immediately)
  */
@@ -41,6 +43,33 @@ typedef struct MinidjvuPattern *mdjvu_pattern_t;
 MDJVU_FUNCTION mdjvu_pattern_t mdjvu_pattern_create(mdjvu_matcher_options_t, mdjvu_bitmap_t);
 #endif
 
+/* A pattern cache keeps patterns of the bitmaps seen so far,
+ * so that a pattern of an equal bitmap is not prepared again.
+ * It may be shared by several matcher options (and threads)
+ * and outlive them, e.g. to reuse patterns across dictionary groups.
+ * Patterns from the cache are created and destroyed as usual.
+ */
+
+typedef struct MinidjvuPatternCache *mdjvu_pattern_cache_t;
+
+#ifndef NO_MINIDJVU
+/* Create a cache that holds about max_memory bytes, dropping oldest patterns. */
+MDJVU_FUNCTION mdjvu_pattern_cache_t mdjvu_pattern_cache_create(double max_memory);
+
+/* Patterns taken from the cache remain valid. */
+MDJVU_FUNCTION void mdjvu_pattern_cache_destroy(mdjvu_pattern_cache_t);
+
+/* Get the number of patterns found in the cache and prepared anew. */
+MDJVU_FUNCTION void mdjvu_pattern_cache_get_statistics(mdjvu_pattern_cache_t,
+    int32 *hits, int32 *misses);
+
+/* Make mdjvu_pattern_create() use the cache (NULL to stop).
+ * The cache is not destroyed with the options.
+ */
+MDJVU_FUNCTION void mdjvu_set_pattern_cache(mdjvu_matcher_options_t,
+                                            mdjvu_pattern_cache_t);
+#endif
+
 /* Same, but create from two-dimensional array.
  */
 
@@ -52,10 +81,33 @@ MDJVU_FUNCTION mdjvu_pattern_t mdjvu_pattern_create_from_array
 
 MDJVU_FUNCTION void mdjvu_pattern_destroy(mdjvu_pattern_t);
 
+/* Get the number of bytes allocated for the pattern. */
+
+MDJVU_FUNCTION int32 mdjvu_pattern_get_memory_size(mdjvu_pattern_t);
+
 
 /* get a center (in 1/MDJVU_CENTER_QUANT pixels; defined in the header for image) */
 MDJVU_FUNCTION void mdjvu_pattern_get_center(mdjvu_pattern_t, int32 *cx, int32 *cy);
 
+/* get width, height and the number of black pixels */
+MDJVU_FUNCTION void mdjvu_pattern_get_dimensions(mdjvu_pattern_t,
+    int32 *w, int32 *h, int32 *mass);
+
+/* Returns 0 if a pattern of the given dimensions is vetoed by the simple
+ * size and mass tests of mdjvu_match_patterns() when compared to this one.
+ * Each of the tests accepts an interval of values, so if patterns with
+ * dimensions (w1, h1, mass1) and (w2, h2, mass2) both fit, then any pattern
+ * with dimensions between them fits as well.
+ */
+MDJVU_FUNCTION int mdjvu_pattern_dimensions_fit(mdjvu_pattern_t,
+    int32 w, int32 h, int32 mass);
+
+/* Get the range of widths that pass the width test
+ * of mdjvu_pattern_dimensions_fit() against this pattern.
+ */
+MDJVU_FUNCTION void mdjvu_pattern_get_fitting_widths(mdjvu_pattern_t,
+    int32 *min_w, int32 *max_w);
+
 /* Compare patterns.
  * Returns
  * +1 if images are considered equivalent,
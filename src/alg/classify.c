@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef HAVE_LIBPTHREAD
+    #include <pthread.h>
+#endif
 
 
 /* Stuff for not using malloc in C++
@@ -27,201 +30,372 @@
 #endif
 
 
-/* Classes are single-linked lists with an additional pointer to the last node.
- * This is an class item.
+/* Patterns being classified are called nodes here.
+ * They are numbered in the order of classification.
+ *
+ * Classes are numbered in the order of creation and kept in an array.
+ * Merging a class into another leaves it dead, with `parent' pointing
+ * to the class it was merged into (a union-find forest), so the final class
+ * of a node is found from the class it was put into first.
+ * Living classes, from newer to older ones, form what was the list of classes.
  */
-typedef struct ClassNode
-{
-    mdjvu_pattern_t ptr;
-    struct ClassNode *next;        /* NULL if this node is the last one */
-    struct ClassNode *global_next; /* next among all nodes to classify  */
-    int32 tag;                     /* filled before the final dumping   */
-} ClassNode;
-
-/* Classes themselves are composed in double-linked list. */
-typedef struct Class
+typedef struct
 {
-    ClassNode *first, *last;
-    struct Class *prev_class;
-    struct Class *next_class;
+    int32 *members;  /* nodes of the class, in no particular order */
+    int32 member_count, members_capacity;
+    int32 parent;    /* itself if the class is alive */
     int32 last_page; /* last page on which this class was met */
+    int32 tag;       /* filled before the final dumping;
+                      * until then, -1 if the patterns are destroyed */
+
+    /* ranges of dimensions of the class members */
+    int32 min_w, max_w, min_h, max_h, min_mass, max_mass;
+
+    /* the class is in a double-linked list in buckets[max_w], -1 is none */
+    int32 prev_in_bucket;
+    int32 next_in_bucket;
 } Class;
 
 
+/* Classes are also kept in buckets by their maximal width.
+ * A pattern can only join a class whose every member passes
+ * the simple size and mass tests against it, so only a few buckets
+ * are looked into, and classes whose ranges of dimensions don't fit
+ * are not compared to the pattern at all.
+ */
 typedef struct Classification
 {
-    Class *first_class;
-    ClassNode *first_node, *last_node;
+    Class *classes;
+    int32 class_count, classes_capacity;
+
+    mdjvu_pattern_t *nodes;
+    int32 *node_classes; /* the class each node was put into */
+    int32 node_count, nodes_capacity;
+
+    int32 *buckets;
+    int32 bucket_count;
+
+    int32 *candidates; /* classes to compare with the current pattern */
+    int32 candidates_capacity;
 } Classification;
 
-/* Creates an empty class and links it to the list of classes. */
-static Class *new_class(Classification *cl)
+static void remove_from_bucket(Classification *cl, int32 c)
 {
-    Class *c = MALLOC(Class);
-    c->first = c->last = NULL;
-    c->prev_class = NULL;
-    c->next_class = cl->first_class;
-    c->last_page = 0;
-    if (cl->first_class) cl->first_class->prev_class = c;
-    cl->first_class = c;
-    return c;
+    Class *k = &cl->classes[c];
+
+    if (k->max_w < 0) return; /* the class is empty and not in a bucket */
+
+    if (k->prev_in_bucket >= 0)
+        cl->classes[k->prev_in_bucket].next_in_bucket = k->next_in_bucket;
+    else
+        cl->buckets[k->max_w] = k->next_in_bucket;
+
+    if (k->next_in_bucket >= 0)
+        cl->classes[k->next_in_bucket].prev_in_bucket = k->prev_in_bucket;
 }
 
-/* Unlinks a class and deletes it. Its nodes are not deleted. */
-static void delete_class(Classification *cl, Class *c)
+static void put_into_bucket(Classification *cl, int32 c)
 {
-    Class *prev = c->prev_class, *next = c->next_class;
+    Class *k = &cl->classes[c];
 
-    if (prev)
-        prev->next_class = next;
-    else
-        cl->first_class = next;
+    if (k->max_w >= cl->bucket_count)
+    {
+        int32 i, new_count = cl->bucket_count * 2;
+        if (new_count <= k->max_w) new_count = k->max_w + 1;
+        cl->buckets = (int32 *) realloc(cl->buckets, new_count * sizeof(int32));
+        for (i = cl->bucket_count; i < new_count; i++)
+            cl->buckets[i] = -1;
+        cl->bucket_count = new_count;
+    }
 
-    if (next)
-        next->prev_class = prev;
+    k->prev_in_bucket = -1;
+    k->next_in_bucket = cl->buckets[k->max_w];
+    if (k->next_in_bucket >= 0)
+        cl->classes[k->next_in_bucket].prev_in_bucket = c;
+    cl->buckets[k->max_w] = c;
+}
 
-    FREE(c);
+/* Extends the class ranges by the given ones and moves it to its new bucket. */
+static void extend_ranges(Classification *cl, int32 c,
+                          int32 min_w, int32 max_w,
+                          int32 min_h, int32 max_h,
+                          int32 min_mass, int32 max_mass)
+{
+    Class *k = &cl->classes[c];
+
+    remove_from_bucket(cl, c);
+    if (min_w < k->min_w) k->min_w = min_w;
+    if (max_w > k->max_w) k->max_w = max_w;
+    if (min_h < k->min_h) k->min_h = min_h;
+    if (max_h > k->max_h) k->max_h = max_h;
+    if (min_mass < k->min_mass) k->min_mass = min_mass;
+    if (max_mass > k->max_mass) k->max_mass = max_mass;
+    put_into_bucket(cl, c);
 }
 
-/* Creates a new node and adds it to the given class. */
-static ClassNode *new_node(Classification *cl, Class *c, mdjvu_pattern_t ptr)
+/* Creates an empty class. */
+static int32 new_class(Classification *cl)
 {
-    ClassNode *n = MALLOC(ClassNode);
-    n->ptr = ptr;
-    n->next = c->first;
-    c->first = n;
-    if (!c->last) c->last = n;
-    n->global_next = NULL;
+    int32 c = cl->class_count++;
+    Class *k;
 
-    if (cl->last_node)
-        cl->last_node->global_next = n;
-    else
-        cl->first_node = n;
+    if (c == cl->classes_capacity)
+    {
+        cl->classes_capacity = c ? c * 2 : 64;
+        cl->classes = (Class *) realloc(cl->classes,
+            cl->classes_capacity * sizeof(Class));
+    }
 
-    cl->last_node = n;
-    return n;
+    k = &cl->classes[c];
+    k->members = NULL;
+    k->member_count = k->members_capacity = 0;
+    k->parent = c;
+    k->last_page = 0;
+    k->tag = 0;
+    k->min_w = k->min_h = k->min_mass = INT32_MAX;
+    k->max_w = k->max_h = k->max_mass = -1;
+    return c;
+}
+
+static void add_member(Class *k, int32 node)
+{
+    if (k->member_count == k->members_capacity)
+    {
+        k->members_capacity = k->members_capacity ? k->members_capacity * 2 : 4;
+        k->members = (int32 *) realloc(k->members,
+            k->members_capacity * sizeof(int32));
+    }
+    k->members[k->member_count++] = node;
+}
+
+/* Creates a new node and adds it to the given class.
+ * The pattern is NULL for an exact duplicate of a member.
+ */
+static void new_node(Classification *cl, int32 c, mdjvu_pattern_t ptr)
+{
+    int32 node = cl->node_count++;
+    int32 w, h, mass;
+
+    if (node == cl->nodes_capacity)
+    {
+        cl->nodes_capacity = node ? node * 2 : 64;
+        cl->nodes = (mdjvu_pattern_t *) realloc(cl->nodes,
+            cl->nodes_capacity * sizeof(mdjvu_pattern_t));
+        cl->node_classes = (int32 *) realloc(cl->node_classes,
+            cl->nodes_capacity * sizeof(int32));
+    }
+    cl->nodes[node] = ptr;
+    cl->node_classes[node] = c;
+
+    add_member(&cl->classes[c], node);
+    if (!ptr) return;
+    mdjvu_pattern_get_dimensions(ptr, &w, &h, &mass);
+    extend_ranges(cl, c, w, w, h, h, mass, mass);
 }
 
-/* Merge two classes and delete one of them. */
-static Class *merge(Classification *cl, Class *c1, Class *c2)
+/* Merges c2 into c1; c2 becomes dead. */
+static void merge(Classification *cl, int32 c1, int32 c2)
 {
-    if (!c1->first)
+    Class *k1 = &cl->classes[c1], *k2 = &cl->classes[c2];
+    int32 i;
+
+    /* append the shorter member list to the longer one */
+    if (k1->member_count < k2->member_count)
     {
-        delete_class(cl, c1);
-        return c2;
+        int32 *t = k1->members;
+        int32 count = k1->member_count, capacity = k1->members_capacity;
+        k1->members = k2->members;
+        k1->member_count = k2->member_count;
+        k1->members_capacity = k2->members_capacity;
+        k2->members = t;
+        k2->member_count = count;
+        k2->members_capacity = capacity;
     }
-    if (c2->first)
+    for (i = 0; i < k2->member_count; i++)
+        add_member(k1, k2->members[i]);
+
+    extend_ranges(cl, c1, k2->min_w, k2->max_w, k2->min_h, k2->max_h,
+                          k2->min_mass, k2->max_mass);
+
+    remove_from_bucket(cl, c2);
+    free(k2->members);
+    k2->members = NULL;
+    k2->member_count = k2->members_capacity = 0;
+    k2->parent = c1;
+}
+
+static int32 find_class(Classification *cl, int32 c)
+{
+    int32 root = c;
+    while (cl->classes[root].parent != root)
+        root = cl->classes[root].parent;
+
+    /* compress the path */
+    while (cl->classes[c].parent != root)
     {
-        c1->last->next = c2->first;
-        c1->last = c2->last;
+        int32 next = cl->classes[c].parent;
+        cl->classes[c].parent = root;
+        c = next;
     }
-    delete_class(cl, c2);
-    return c1;
+    return root;
 }
 
-/* Puts a tag on each node corresponding to its class. */
-static unsigned put_tags(Classification *cl)
+/* Puts a tag on each living class, newer classes first. */
+static int32 put_tags(Classification *cl)
 {
     int32 tag = 1;
-    Class *c = cl->first_class;
-    while (c)
+    int32 c;
+    for (c = cl->class_count - 1; c >= 0; c--)
     {
-        ClassNode *n = c->first;
-        while (n)
-        {
-            n->tag = tag;
-            n = n->next;
-        }
-        c = c->next_class;
-        tag++;
+        if (cl->classes[c].parent == c)
+            cl->classes[c].tag = tag++;
     }
     return tag - 1;
 }
 
-/* Deletes all classes; nodes are untouched. */
-static void delete_all_classes(Classification *cl)
+/* Compares p with members of c until a meaningful result.
+ * Members whose patterns were destroyed are skipped.
+ */
+static int compare_to_class(Classification *cl, mdjvu_pattern_t p, int32 c,
+                            int32 dpi, mdjvu_matcher_options_t options,
+                            int flag)
 {
-    Class *c = cl->first_class;
-    while (c)
+    Class *k = &cl->classes[c];
+    int32 i;
+    for (i = 0; i < k->member_count; i++)
     {
-        Class *t = c;
-        c = c->next_class;
-        FREE(t);
+        mdjvu_pattern_t member = cl->nodes[k->members[i]];
+        if (member && mdjvu_match_patterns(p, member, dpi, options) == flag)
+            return 1;
     }
+    return 0;
+}
+
+static int compare_classes_downward(const void *p1, const void *p2)
+{
+    int32 c1 = *(const int32 *) p1;
+    int32 c2 = *(const int32 *) p2;
+    return c1 > c2 ? -1 : c1 < c2;
 }
 
-/* Compares p with nodes from c until a meaningful result. */
-static int compare_to_class(mdjvu_pattern_t p, Class *c, int32 dpi,
-                            mdjvu_matcher_options_t options, int flag)
+/* Fills cl->candidates with classes that p may join,
+ * newer classes first. Returns their number.
+ */
+static int32 find_candidates(Classification *cl, mdjvu_pattern_t p,
+                             int32 page)
 {
-    int r = 0;
-    ClassNode *n = c->first;
-    while(n)
+    int32 min_fit, max_fit, max_w, n = 0;
+
+    /* A class fits only if the width of its widest member fits. */
+    mdjvu_pattern_get_fitting_widths(p, &min_fit, &max_fit);
+    for (max_w = min_fit; max_w <= max_fit && max_w < cl->bucket_count; max_w++)
     {
-        r = mdjvu_match_patterns(p, n->ptr, dpi, options);
-        if (r == flag) return 1;
-        n = n->next;
+        int32 c;
+        for (c = cl->buckets[max_w]; c >= 0; c = cl->classes[c].next_in_bucket)
+        {
+            Class *k = &cl->classes[c];
+            if (k->last_page < page - 1) continue; /* multipage optimization */
+            if (!mdjvu_pattern_dimensions_fit(p, k->min_w, k->min_h, k->min_mass)
+             || !mdjvu_pattern_dimensions_fit(p, k->max_w, k->max_h, k->max_mass))
+                continue; /* some member would veto */
+
+            if (n == cl->candidates_capacity)
+            {
+                cl->candidates_capacity = n ? n * 2 : 16;
+                cl->candidates = (int32 *) realloc(cl->candidates,
+                    cl->candidates_capacity * sizeof(int32));
+            }
+            cl->candidates[n++] = c;
+        }
     }
-    return 0;
+
+    if (n > 1)
+        qsort(cl->candidates, n, sizeof(int32), &compare_classes_downward);
+    return n;
 }
 
 static void classify(Classification *cl, mdjvu_pattern_t p,
                      int32 dpi, mdjvu_matcher_options_t options,
                      int32 page /* of current pattern */)
 {
-    Class *class_of_this = NULL;
-    Class *c, *next_c = NULL;
-    for (c = cl->first_class; c; c = next_c)
+    int32 class_of_this = -1;
+    int32 i, n = find_candidates(cl, p, page);
+
+    /* Merging only kills candidates that were already looked at,
+     * and doesn't change ranges of the others.
+     */
+    for (i = 0; i < n; i++)
     {
-        next_c = c->next_class; /* That's because c may be deleted in merging */
+        int32 c = cl->candidates[i];
 
-        if (class_of_this == c) continue;
-        if (c->last_page < page - 1) continue; /* multipage optimization */
-        if (compare_to_class(p, c, dpi, options, -1) ||
-            !compare_to_class(p, c, dpi, options, 1)) continue;
+        if (compare_to_class(cl, p, c, dpi, options, -1) ||
+            !compare_to_class(cl, p, c, dpi, options, 1)) continue;
 
-        if (class_of_this)
-            class_of_this = merge(cl, class_of_this, c);
+        if (class_of_this >= 0)
+            merge(cl, class_of_this, c);
         else
             class_of_this = c;
     }
-    if (!class_of_this) class_of_this = new_class(cl);
-    if (page > class_of_this->last_page)
-        class_of_this->last_page = page;
+    if (class_of_this < 0) class_of_this = new_class(cl);
+    if (page > cl->classes[class_of_this].last_page)
+        cl->classes[class_of_this].last_page = page;
     new_node(cl, class_of_this, p);
 }
 
-static int32 get_tags_from_classification(mdjvu_pattern_t *b, int32 *r, int32 n, Classification *cl)
+/* these arrays are realloc'ed, so they are freed with free() */
+static void destroy_classification(Classification *cl)
 {
     int32 i;
-    int32 max_tag = put_tags(cl);
-    ClassNode *node;
+    for (i = 0; i < cl->class_count; i++)
+        free(cl->classes[i].members);
+    free(cl->classes);
+    free(cl->nodes);
+    free(cl->node_classes);
+    free(cl->buckets);
+    free(cl->candidates);
+}
 
-    delete_all_classes(cl);
+/* put_tags() must be called before */
+static int32 get_node_tag(Classification *cl, int32 node)
+{
+    return cl->classes[find_class(cl, cl->node_classes[node])].tag;
+}
+
+static int32 get_tags_from_classification(mdjvu_pattern_t *b, int32 *r, int32 n, Classification *cl)
+{
+    int32 i, node;
+    int32 max_tag = put_tags(cl);
 
     i = 0;
-    node = cl->first_node;
-    while (node)
+    for (node = 0; node < cl->node_count; node++)
     {
-        ClassNode *t;
         while (!b[i])
         {
             r[i++] = 0;
             assert(i < n); /* because we have a node */
         }
-        r[i++] = node->tag;
-        t = node;
-        node = node->global_next;
-        FREE(t);
+        r[i++] = get_node_tag(cl, node);
     }
     if (i < n) while (i < n) r[i++] = 0;
+
+    destroy_classification(cl);
     return max_tag;
 }
 
-static void init_classification(Classification *c)
+/* expected_nodes is only a hint to allocate memory at once */
+static void init_classification(Classification *c, int32 expected_nodes)
 {
-    c->first_class = NULL;
-    c->first_node = c->last_node = NULL;
+    c->classes = NULL;
+    c->class_count = c->classes_capacity = 0;
+    c->nodes_capacity = expected_nodes > 0 ? expected_nodes : 0;
+    c->nodes = (mdjvu_pattern_t *)
+        malloc((c->nodes_capacity + 1) * sizeof(mdjvu_pattern_t));
+    c->node_classes = (int32 *) malloc((c->nodes_capacity + 1) * sizeof(int32));
+    c->node_count = 0;
+    c->buckets = NULL;
+    c->bucket_count = 0;
+    c->candidates = NULL;
+    c->candidates_capacity = 0;
 }
 
 MDJVU_IMPLEMENT int32 mdjvu_classify_patterns
@@ -230,7 +404,7 @@ MDJVU_IMPLEMENT int32 mdjvu_classify_patterns
 {
     int32 i;
     Classification cl;
-    init_classification(&cl);
+    init_classification(&cl, n);
 
     for (i = 0; i < n; i++) if (b[i]) classify(&cl, b[i], dpi, options, 1);
 
@@ -307,7 +481,7 @@ MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_patterns
     int32 max_tag;
 
     Classification cl;
-    init_classification(&cl);
+    init_classification(&cl, total_patterns_count);
 
     patterns_gathered = 0;
     for (page = 0; page < npages; page++)
@@ -333,20 +507,717 @@ MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_patterns
 }
 
 
+/* Classifying in shards {{{ */
+
+/* Pages are cut into contiguous ranges (shards), which are classified
+ * independently, each in its own thread. Then the shards are merged in order:
+ * a class of a shard joins the classes of the previous shards that accept
+ * its representative, just like a pattern would join them in classify().
+ * Since A ~ B and B ~ C lets us assume A ~ C, comparing one member
+ * of a class stands for comparing all of them.
+ *
+ * The result is not the same as of the serial classification: a pattern
+ * is not compared to patterns of other shards, only its class is.
+ */
+typedef struct
+{
+    Classification cl;
+    int32 first_page, npages;
+    int32 *npatterns;
+    mdjvu_pattern_t **patterns;
+    int32 *dpi;
+    mdjvu_matcher_options_t options;
+} Shard;
+
+static void *classify_shard(void *param)
+{
+    Shard *s = (Shard *) param;
+    int32 page;
+
+    for (page = s->first_page; page < s->first_page + s->npages; page++)
+    {
+        int32 n = s->npatterns[page];
+        int32 d = s->dpi[page];
+        mdjvu_pattern_t *p = s->patterns[page];
+        int32 i;
+
+        for (i = 0; i < n; i++)
+            if (p[i]) classify(&s->cl, p[i], d, s->options, page);
+    }
+    return NULL;
+}
+
+/* Moves nodes and classes of the shard into cl, destroys the shard. */
+static void merge_shard(Classification *cl, Shard *s)
+{
+    Classification *sh = &s->cl;
+    int32 offset = cl->node_count;
+    int32 classes_before = cl->class_count;
+    int32 i, c;
+
+    assert(offset + sh->node_count <= cl->nodes_capacity);
+    for (i = 0; i < sh->node_count; i++)
+        cl->nodes[offset + i] = sh->nodes[i];
+    cl->node_count += sh->node_count;
+
+    for (c = 0; c < sh->class_count; c++)
+    {
+        Class *k = &sh->classes[c];
+        mdjvu_pattern_t p;
+        int32 d, n, g, target = -1;
+
+        if (k->parent != c) continue; /* dead */
+
+        p = sh->nodes[k->members[0]];
+        d = s->dpi[k->last_page];
+
+        /* page 0 turns off the multipage optimization */
+        n = find_candidates(cl, p, 0);
+        for (i = 0; i < n; i++)
+        {
+            int32 t = cl->candidates[i];
+
+            /* classes of this shard were compared already */
+            if (t >= classes_before) continue;
+
+            if (compare_to_class(cl, p, t, d, s->options, -1) ||
+                !compare_to_class(cl, p, t, d, s->options, 1)) continue;
+
+            if (target >= 0)
+                merge(cl, target, t);
+            else
+                target = t;
+        }
+
+        g = new_class(cl);
+        for (i = 0; i < k->member_count; i++)
+        {
+            int32 node = offset + k->members[i];
+            add_member(&cl->classes[g], node);
+            cl->node_classes[node] = g;
+        }
+        extend_ranges(cl, g, k->min_w, k->max_w, k->min_h, k->max_h,
+                             k->min_mass, k->max_mass);
+        cl->classes[g].last_page = k->last_page;
+
+        if (target >= 0)
+        {
+            merge(cl, target, g);
+            if (k->last_page > cl->classes[target].last_page)
+                cl->classes[target].last_page = k->last_page;
+        }
+    }
+
+    destroy_classification(sh);
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_patterns_in_shards
+    (int32 npages, int32 total_patterns_count, int32 *npatterns,
+     mdjvu_pattern_t **patterns, int32 *result,
+     int32 *dpi, mdjvu_matcher_options_t options,
+     void (*report)(void *, int), void *param, int nshards)
+{
+    mdjvu_pattern_t *all_patterns;
+    Shard *shards;
+    int32 patterns_gathered, page, max_tag;
+    int i;
+    Classification cl;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t *threads;
+    char *started;
+#endif
+
+    if (nshards > npages) nshards = npages;
+    if (nshards <= 1)
+    {
+        return mdjvu_multipage_classify_patterns
+            (npages, total_patterns_count, npatterns, patterns, result,
+             dpi, options, report, param);
+    }
+
+    shards = (Shard *) malloc(nshards * sizeof(Shard));
+    for (i = 0; i < nshards; i++)
+    {
+        Shard *s = &shards[i];
+        int32 count = 0;
+
+        s->first_page = npages * i / nshards;
+        s->npages = npages * (i + 1) / nshards - s->first_page;
+        for (page = s->first_page; page < s->first_page + s->npages; page++)
+            count += npatterns[page];
+        init_classification(&s->cl, count);
+        s->npatterns = npatterns;
+        s->patterns = patterns;
+        s->dpi = dpi;
+        s->options = options;
+    }
+
+    /* The calling thread takes the first shard. */
+#ifdef HAVE_LIBPTHREAD
+    threads = (pthread_t *) malloc(nshards * sizeof(pthread_t));
+    started = (char *) malloc(nshards);
+    for (i = 1; i < nshards; i++)
+    {
+        started[i] = !pthread_create(&threads[i], NULL,
+                                     classify_shard, &shards[i]);
+    }
+    classify_shard(&shards[0]);
+    for (i = 1; i < nshards; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            classify_shard(&shards[i]);
+    }
+    free(threads);
+    free(started);
+#else
+    for (i = 0; i < nshards; i++)
+        classify_shard(&shards[i]);
+#endif
+
+    for (page = 0; page < npages; page++)
+        report(param, page);
+
+    init_classification(&cl, total_patterns_count);
+    for (i = 0; i < nshards; i++)
+        merge_shard(&cl, &shards[i]);
+    free(shards);
+
+    /* a kluge for NULL patterns, as in the serial version */
+    all_patterns = MDJVU_MALLOCV(mdjvu_pattern_t, total_patterns_count);
+    patterns_gathered = 0;
+    for (page = 0; page < npages; page++)
+    {
+        int32 k;
+        for (k = 0; k < npatterns[page]; k++)
+            all_patterns[patterns_gathered++] = patterns[page][k];
+    }
+
+    max_tag = get_tags_from_classification
+        (all_patterns, result, total_patterns_count, &cl);
+
+    MDJVU_FREEV(all_patterns);
+    return max_tag;
+}
+
+/* Classifying in shards }}} */
+
+
+/* Creating patterns {{{ */
+
+/* Patterns are independent of each other, so they may be created
+ * in several threads. Threads take bitmaps in small portions.
+ */
+#define PATTERNS_PER_TAKE 64
+
+typedef struct
+{
+    mdjvu_bitmap_t *bitmaps; /* NULL if the pattern is not needed */
+    mdjvu_pattern_t *patterns;
+    int32 count;
+    int32 next;
+    mdjvu_matcher_options_t options;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t mutex;
+#endif
+} PatternFactory;
+
+static void *pattern_factory_thread(void *param)
+{
+    PatternFactory *f = (PatternFactory *) param;
+
+    while (1)
+    {
+        int32 i, from, to;
+
+        #ifdef HAVE_LIBPTHREAD
+            pthread_mutex_lock(&f->mutex);
+        #endif
+        from = f->next;
+        f->next += PATTERNS_PER_TAKE;
+        #ifdef HAVE_LIBPTHREAD
+            pthread_mutex_unlock(&f->mutex);
+        #endif
+
+        if (from >= f->count) break;
+        to = from + PATTERNS_PER_TAKE;
+        if (to > f->count) to = f->count;
+
+        for (i = from; i < to; i++)
+        {
+            if (f->bitmaps[i])
+                f->patterns[i] = mdjvu_pattern_create(f->options, f->bitmaps[i]);
+            else
+                f->patterns[i] = NULL;
+        }
+    }
+    return NULL;
+}
+
+/* The calling thread works too, so nthreads - 1 threads are started. */
+static void create_patterns(PatternFactory *f, int nthreads)
+{
+#ifdef HAVE_LIBPTHREAD
+    pthread_t *threads = NULL;
+    int i, started = 0;
+
+    pthread_mutex_init(&f->mutex, NULL);
+    if (nthreads > 1)
+    {
+        threads = (pthread_t *) malloc((nthreads - 1) * sizeof(pthread_t));
+        while (started < nthreads - 1
+            && !pthread_create(&threads[started], NULL,
+                               pattern_factory_thread, f))
+        {
+            started++;
+        }
+    }
+#endif
+
+    pattern_factory_thread(f);
+
+#ifdef HAVE_LIBPTHREAD
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (threads) free(threads);
+    pthread_mutex_destroy(&f->mutex);
+#endif
+}
+
+/* Creating patterns }}} */
+
 MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_bitmaps
     (int32 npages, int32 total_patterns_count, mdjvu_image_t *pages,
      int32 *result, mdjvu_matcher_options_t options,
      void (*report)(void *, int), void *param, int centers_needed)
 {
+    return mdjvu_multipage_classify_bitmaps_in_threads
+        (npages, total_patterns_count, pages, result, options,
+         report, param, centers_needed, 1);
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_bitmaps_in_threads
+    (int32 npages, int32 total_patterns_count, mdjvu_image_t *pages,
+     int32 *result, mdjvu_matcher_options_t options,
+     void (*report)(void *, int), void *param, int centers_needed,
+     int nthreads)
+{
+    return mdjvu_multipage_classify_bitmaps_in_shards
+        (npages, total_patterns_count, pages, result, options,
+         report, param, centers_needed, nthreads, 1, 0, NULL, NULL);
+}
+
+/* With originals given, duplicates take the centers of their originals
+ * (equal bitmaps have equal centers, but duplicates may have no patterns),
+ * so centers are also stored in cx and cy by the global bitmap index.
+ * patterns may be NULL, then the centers are cheap.
+ */
+static void set_centers(mdjvu_image_t image, mdjvu_pattern_t *patterns,
+                        const int32 *originals, int32 first,
+                        int32 *cx, int32 *cy)
+{
+    int32 i, n = mdjvu_image_get_bitmap_count(image);
+
+    mdjvu_image_enable_centers(image);
+    for (i = 0; i < n; i++)
+    {
+        int32 x, y, k = first + i;
+        mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(image, i);
+        if (originals && originals[k] >= 0 && originals[k] != k)
+        {
+            x = cx[originals[k]];
+            y = cy[originals[k]];
+        }
+        else if (patterns && patterns[i])
+            mdjvu_pattern_get_center(patterns[i], &x, &y);
+        else
+            get_cheap_center(bitmap, &x, &y);
+        if (originals)
+        {
+            cx[k] = x;
+            cy[k] = y;
+        }
+        mdjvu_image_set_center(image, bitmap, x, y);
+    }
+}
+
+/* Exact duplicates {{{ */
+
+MDJVU_IMPLEMENT int32 mdjvu_multipage_find_duplicates
+    (int32 npages, mdjvu_image_t *pages, int32 *originals)
+{
+    int32 page, k = 0, total = 0, nchains = 1, duplicates = 0;
+    int32 *chains, *next;
+    uint32 *hashes;
+    mdjvu_bitmap_t *bitmaps;
+
+    for (page = 0; page < npages; page++)
+        total += mdjvu_image_get_bitmap_count(pages[page]);
+    while (nchains < total) nchains <<= 1;
+
+    /* chains of letters with equal hashes modulo nchains */
+    chains = (int32 *) malloc(nchains * sizeof(int32));
+    next = (int32 *) malloc((total + 1) * sizeof(int32));
+    hashes = (uint32 *) malloc((total + 1) * sizeof(uint32));
+    bitmaps = (mdjvu_bitmap_t *) malloc((total + 1) * sizeof(mdjvu_bitmap_t));
+    for (k = 0; k < nchains; k++) chains[k] = -1;
+
+    k = 0;
+    for (page = 0; page < npages; page++)
+    {
+        mdjvu_image_t image = pages[page];
+        int32 i, n = mdjvu_image_get_bitmap_count(image);
+
+        for (i = 0; i < n; i++, k++)
+        {
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(image, i);
+            int32 j, *chain;
+
+            if (mdjvu_image_get_not_a_letter_flag(image, bitmap))
+            {
+                originals[k] = -1;
+                continue;
+            }
+
+            bitmaps[k] = bitmap;
+            hashes[k] = mdjvu_bitmap_get_hash(bitmap);
+            chain = &chains[hashes[k] & (nchains - 1)];
+            for (j = *chain; j >= 0; j = next[j])
+            {
+                if (hashes[j] == hashes[k] && mdjvu_bitmap_equal(bitmaps[j], bitmap))
+                    break;
+            }
+
+            if (j >= 0)
+            {
+                originals[k] = j;
+                duplicates++;
+            }
+            else
+            {
+                originals[k] = k;
+                next[k] = *chain;
+                *chain = k;
+            }
+        }
+    }
+
+    free(chains);
+    free(next);
+    free(hashes);
+    free(bitmaps);
+    return duplicates;
+}
+
+/* Without a matcher, specks smaller than this (width times height)
+ * are not put together: a JB2 copy of such a speck, with its library index,
+ * costs more than coding it directly. mdjvu_find_prototypes() doesn't
+ * substitute them either.
+ */
+#define MIN_UNIFIED_AREA 5
+
+/* Without matcher options, only equal bitmaps are put into one class. */
+static int32 classify_duplicates_only
+    (int32 npages, int32 total_patterns_count, mdjvu_image_t *pages,
+     int32 *result, void (*report)(void *, int), void *param,
+     int centers_needed, const int32 *originals)
+{
+    int32 page, k = 0, tag = 0;
+
+    for (page = 0; page < npages; page++)
+    {
+        mdjvu_image_t image = pages[page];
+        int32 i, n = mdjvu_image_get_bitmap_count(image);
+
+        for (i = 0; i < n; i++, k++)
+        {
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(image, i);
+            if (mdjvu_image_get_not_a_letter_flag(image, bitmap))
+                result[k] = 0;
+            else if (originals && originals[k] != k
+                  && mdjvu_bitmap_get_width(bitmap)
+                   * mdjvu_bitmap_get_height(bitmap) >= MIN_UNIFIED_AREA)
+                result[k] = result[originals[k]];
+            else
+                result[k] = ++tag;
+        }
+        if (centers_needed) set_centers(image, NULL, NULL, 0, NULL, NULL);
+        report(param, page);
+    }
+    while (k < total_patterns_count) result[k++] = 0;
+    return tag;
+}
+
+/* Exact duplicates }}} */
+
+/* Classifying page by page {{{ */
+
+/* A class that was not met on the last two pages is never compared again
+ * (that's the multipage optimization in find_candidates()).
+ * So patterns are created for one page at a time, and patterns of a class
+ * are destroyed as soon as it becomes such. Only the patterns of classes
+ * that keep being met stay in memory.
+ *
+ * That doesn't change the result. To save more memory, the number
+ * of patterns kept in a class may be limited: a pattern joining a class
+ * that has enough members is destroyed right after the classification.
+ * Then new patterns are compared only with a few representatives of a class.
+ *
+ * An exact duplicate of a letter that is still compared gets no pattern
+ * and simply joins the class of that letter.
+ */
+
+/* Destroys patterns of classes that won't be compared with page next_page
+ * and that have members among the given nodes. Returns the bytes freed.
+ */
+static double destroy_patterns_of_old_classes(Classification *cl,
+                                              int32 from_node, int32 to_node,
+                                              int32 next_page)
+{
+    double freed = 0;
+    int32 node;
+
+    for (node = from_node; node < to_node; node++)
+    {
+        int32 i, c = find_class(cl, cl->node_classes[node]);
+        Class *k = &cl->classes[c];
+
+        if (k->last_page >= next_page - 1) continue; /* still compared */
+        if (k->tag < 0) continue; /* destroyed already */
+        k->tag = -1;
+
+        for (i = 0; i < k->member_count; i++)
+        {
+            mdjvu_pattern_t p = cl->nodes[k->members[i]];
+            if (!p) continue;
+            freed += mdjvu_pattern_get_memory_size(p);
+            mdjvu_pattern_destroy(p);
+            cl->nodes[k->members[i]] = NULL;
+        }
+    }
+    return freed;
+}
+
+/* Returns 1 if the letter k is a duplicate that needs no pattern on the page.
+ * last_node[o] is the last node of the letters equal to o,
+ * pattern_page[o] is the last page on which one of them got a pattern.
+ */
+static int skip_duplicate(Classification *cl, const int32 *originals, int32 k,
+                          int32 *last_node, int32 *pattern_page, int32 page)
+{
+    int32 o = originals[k];
+
+    if (o != k)
+    {
+        if (pattern_page[o] == page) return 1; /* classified earlier on the page */
+        if (cl->classes[find_class(cl, cl->node_classes[last_node[o]])].last_page
+                >= page - 1)
+            return 1;
+    }
+    pattern_page[o] = page;
+    return 0;
+}
+
+/* Puts a duplicate into the class of the given node. */
+static void add_duplicate(Classification *cl, int32 node, int32 page)
+{
+    int32 c = find_class(cl, cl->node_classes[node]);
+    if (page > cl->classes[c].last_page)
+        cl->classes[c].last_page = page;
+    new_node(cl, c, NULL);
+}
+
+static int32 classify_bitmaps_page_by_page
+    (int32 npages, int32 total_patterns_count, mdjvu_image_t *pages,
+     int32 *result, mdjvu_matcher_options_t options,
+     void (*report)(void *, int), void *param, int centers_needed,
+     int nthreads, int32 max_patterns_per_class, double *peak_memory,
+     const int32 *originals)
+{
+    int32 max_tag, page, max_count = 0, k = 0, node = 0;
+    int32 *first_node = (int32 *) malloc((npages + 1) * sizeof(int32));
+    int32 *last_node = NULL, *pattern_page = NULL, *cx = NULL, *cy = NULL;
+    mdjvu_bitmap_t *bitmaps;
+    mdjvu_pattern_t *patterns;
+    double memory = 0;
+    PatternFactory factory;
+    Classification cl;
+
+    for (page = 0; page < npages; page++)
+    {
+        int32 n = mdjvu_image_get_bitmap_count(pages[page]);
+        if (n > max_count) max_count = n;
+    }
+    bitmaps = (mdjvu_bitmap_t *) malloc((max_count + 1) * sizeof(mdjvu_bitmap_t));
+    patterns = (mdjvu_pattern_t *) malloc((max_count + 1) * sizeof(mdjvu_pattern_t));
+    if (originals)
+    {
+        last_node = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
+        pattern_page = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
+        for (k = 0; k < total_patterns_count; k++) pattern_page[k] = -1;
+        if (centers_needed)
+        {
+            cx = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
+            cy = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
+        }
+    }
+
+    *peak_memory = 0;
+    init_classification(&cl, total_patterns_count);
+    first_node[0] = 0;
+    k = 0; /* index of the first bitmap on the page */
+    for (page = 0; page < npages; page++)
+    {
+        mdjvu_image_t image = pages[page];
+        int32 i, n = mdjvu_image_get_bitmap_count(image);
+        int32 dpi = mdjvu_image_get_resolution(image);
+
+        for (i = 0; i < n; i++)
+        {
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(image, i);
+            if (mdjvu_image_get_not_a_letter_flag(image, bitmap))
+                bitmaps[i] = NULL;
+            else if (originals && skip_duplicate(&cl, originals, k + i,
+                                                 last_node, pattern_page, page))
+                bitmaps[i] = NULL;
+            else
+                bitmaps[i] = bitmap;
+        }
+
+        factory.bitmaps = bitmaps;
+        factory.patterns = patterns;
+        factory.count = n;
+        factory.next = 0;
+        factory.options = options;
+        create_patterns(&factory, nthreads);
+
+        if (centers_needed) set_centers(image, patterns, originals, k, cx, cy);
+
+        for (i = 0; i < n; i++)
+        {
+            if (patterns[i])
+                memory += mdjvu_pattern_get_memory_size(patterns[i]);
+        }
+        if (memory > *peak_memory) *peak_memory = memory;
+
+        for (i = 0; i < n; i++)
+        {
+            int32 c;
+            if (!patterns[i])
+            {
+                if (originals && originals[k + i] >= 0)
+                    add_duplicate(&cl, last_node[originals[k + i]], page);
+                continue;
+            }
+            classify(&cl, patterns[i], dpi, options, page);
+            if (originals)
+                last_node[originals[k + i]] = cl.node_count - 1;
+
+            c = find_class(&cl, cl.node_classes[cl.node_count - 1]);
+            if (max_patterns_per_class > 0
+             && cl.classes[c].member_count > max_patterns_per_class)
+            {
+                memory -= mdjvu_pattern_get_memory_size(patterns[i]);
+                mdjvu_pattern_destroy(patterns[i]);
+                cl.nodes[cl.node_count - 1] = NULL;
+            }
+        }
+        first_node[page + 1] = cl.node_count;
+        k += n;
+        report(param, page);
+
+        /* classes met last on the previous page are not compared any more */
+        if (page > 0)
+        {
+            memory -= destroy_patterns_of_old_classes(&cl,
+                first_node[page - 1], first_node[page], page + 1);
+        }
+    }
+
+    max_tag = put_tags(&cl);
+    k = 0;
+    for (page = 0; page < npages; page++)
+    {
+        mdjvu_image_t image = pages[page];
+        int32 i, n = mdjvu_image_get_bitmap_count(image);
+
+        for (i = 0; i < n; i++)
+        {
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(image, i);
+            if (mdjvu_image_get_not_a_letter_flag(image, bitmap))
+                result[k++] = 0;
+            else
+                result[k++] = get_node_tag(&cl, node++);
+        }
+    }
+    while (k < total_patterns_count) result[k++] = 0;
+
+    for (k = 0; k < cl.node_count; k++)
+    {
+        if (cl.nodes[k])
+            mdjvu_pattern_destroy(cl.nodes[k]);
+    }
+    destroy_classification(&cl);
+
+    free(bitmaps);
+    free(patterns);
+    free(first_node);
+    if (last_node) free(last_node);
+    if (pattern_page) free(pattern_page);
+    if (cx) free(cx);
+    if (cy) free(cy);
+    return max_tag;
+}
+
+/* Classifying page by page }}} */
+
+MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_bitmaps_in_shards
+    (int32 npages, int32 total_patterns_count, mdjvu_image_t *pages,
+     int32 *result, mdjvu_matcher_options_t options,
+     void (*report)(void *, int), void *param, int centers_needed,
+     int nthreads, int nshards, int32 max_patterns_per_class,
+     double *peak_memory, const int32 *originals)
+{
+    double memory = 0, unused_peak;
     int32 max_tag, k, page;
-    int32 *npatterns = (int32 *) malloc(npages * sizeof(int32));
-    int32 *dpi = (int32 *) malloc(npages * sizeof(int32));
-    mdjvu_pattern_t *patterns = (mdjvu_pattern_t *)
+    int32 *npatterns, *dpi, *cx = NULL, *cy = NULL;
+    mdjvu_pattern_t *patterns, **pointers;
+    mdjvu_bitmap_t *bitmaps;
+    PatternFactory factory;
+    int32 patterns_created = 0;
+
+    if (!peak_memory) peak_memory = &unused_peak;
+
+    if (!options)
+    {
+        *peak_memory = 0;
+        return classify_duplicates_only
+            (npages, total_patterns_count, pages, result,
+             report, param, centers_needed, originals);
+    }
+
+    if (nshards <= 1)
+    {
+        return classify_bitmaps_page_by_page
+            (npages, total_patterns_count, pages, result, options,
+             report, param, centers_needed, nthreads,
+             max_patterns_per_class, peak_memory, originals);
+    }
+
+    /* Shards are merged by comparing with all members of classes,
+     * so all patterns are kept until the end.
+     * Exact duplicates get no patterns and take the tags of their originals.
+     */
+    npatterns = (int32 *) malloc(npages * sizeof(int32));
+    dpi = (int32 *) malloc(npages * sizeof(int32));
+    patterns = (mdjvu_pattern_t *)
         malloc(total_patterns_count * sizeof(mdjvu_pattern_t));
-    mdjvu_pattern_t **pointers = (mdjvu_pattern_t **)
+    pointers = (mdjvu_pattern_t **)
         malloc(npages * sizeof(mdjvu_pattern_t *));
+    bitmaps = (mdjvu_bitmap_t *)
+        malloc(total_patterns_count * sizeof(mdjvu_bitmap_t));
 
-    int32 patterns_created = 0;
     for (page = 0; page < npages; page++)
     {
         mdjvu_image_t current_image = pages[page];
@@ -357,44 +1228,56 @@ MDJVU_IMPLEMENT int32 mdjvu_multipage_classify_bitmaps
         pointers[page] = patterns + patterns_created;
         for (i = 0; i < c; i++)
         {
-            if (mdjvu_image_get_not_a_letter_flag(current_image, mdjvu_image_get_bitmap(current_image, i)))
-                patterns[patterns_created++] = NULL;
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(current_image, i);
+            if (mdjvu_image_get_not_a_letter_flag(current_image, bitmap))
+                bitmaps[patterns_created] = NULL;
+            else if (originals && originals[patterns_created] != patterns_created)
+                bitmaps[patterns_created] = NULL;
             else
-            {
-                patterns[patterns_created++] = mdjvu_pattern_create(
-                    options,
-                    mdjvu_image_get_bitmap(current_image, i)
-                );
-            }
+                bitmaps[patterns_created] = bitmap;
+            patterns_created++;
         }
     }
 
-    max_tag = mdjvu_multipage_classify_patterns
+    factory.bitmaps = bitmaps;
+    factory.patterns = patterns;
+    factory.count = patterns_created;
+    factory.next = 0;
+    factory.options = options;
+    create_patterns(&factory, nthreads);
+    free(bitmaps);
+
+    for (k = 0; k < patterns_created; k++)
+    {
+        if (patterns[k])
+            memory += mdjvu_pattern_get_memory_size(patterns[k]);
+    }
+    *peak_memory = memory;
+
+    max_tag = mdjvu_multipage_classify_patterns_in_shards
         (npages, total_patterns_count, npatterns,
-         pointers, result, dpi, options, report, param);
+         pointers, result, dpi, options, report, param, nshards);
+
+    if (originals)
+    {
+        for (k = 0; k < patterns_created; k++)
+        {
+            if (originals[k] >= 0)
+                result[k] = result[originals[k]];
+        }
+    }
 
     if (centers_needed)
     {
-        int32 patterns_processed = 0;
-        
-        for (page = 0; page < npages; page++)
+        if (originals)
         {
-            mdjvu_image_t current_image = pages[page];
-            int32 n = mdjvu_image_get_bitmap_count(current_image);
-            int32 i;
-            mdjvu_image_enable_centers(current_image);
-            for (i = 0; i < n; i++)
-            {
-                int32 cx, cy;
-                mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(current_image, i);
-                if (patterns[patterns_processed])
-                    mdjvu_pattern_get_center(patterns[patterns_processed], &cx, &cy);
-                else
-                    get_cheap_center(bitmap, &cx, &cy);
-                patterns_processed++;
-                mdjvu_image_set_center(current_image, bitmap, cx, cy); 
-            }
+            cx = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
+            cy = (int32 *) malloc((total_patterns_count + 1) * sizeof(int32));
         }
+        for (page = 0, k = 0; page < npages; k += npatterns[page++])
+            set_centers(pages[page], pointers[page], originals, k, cx, cy);
+        if (cx) free(cx);
+        if (cy) free(cy);
     }
 
     for (k = 0; k < total_patterns_count; k++)
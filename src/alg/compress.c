@@ -18,6 +18,13 @@ struct MinidjvuCompressionOptions
     int report;
     int report_start_page;
     int report_total_pages;
+    int threads;
+    int sharded_classification;
+    int max_patterns_per_class;
+    int exact_substitution;
+    int classify_duplicates;
+    double peak_pattern_memory; /* in the last mdjvu_compress_multipage() */
+    int32 duplicates;           /* in the last compression */
     mdjvu_matcher_options_t matcher_options;
 };
 
@@ -31,6 +38,13 @@ MDJVU_IMPLEMENT mdjvu_compression_options_t mdjvu_compression_options_create()
     opt->report = 0;
     opt->averaging = 0;
     opt->no_prototypes = 0;
+    opt->threads = 1;
+    opt->sharded_classification = 0;
+    opt->max_patterns_per_class = 0;
+    opt->exact_substitution = 0;
+    opt->classify_duplicates = 0;
+    opt->peak_pattern_memory = 0;
+    opt->duplicates = 0;
     opt->matcher_options = NULL;
     return opt;
 }
@@ -62,14 +76,54 @@ MDJVU_IMPLEMENT void mdjvu_set_report_start_page(mdjvu_compression_options_t opt
     {opt->report_start_page = v;}
 MDJVU_IMPLEMENT void mdjvu_set_report_total_pages(mdjvu_compression_options_t opt, int v)
     {opt->report_total_pages = v;}
+MDJVU_IMPLEMENT void mdjvu_set_threads(mdjvu_compression_options_t opt, int v)
+    {opt->threads = v;}
+MDJVU_IMPLEMENT void mdjvu_set_sharded_classification(mdjvu_compression_options_t opt, int v)
+    {opt->sharded_classification = v;}
+MDJVU_IMPLEMENT void mdjvu_set_max_patterns_per_class(mdjvu_compression_options_t opt, int v)
+    {opt->max_patterns_per_class = v;}
+MDJVU_IMPLEMENT void mdjvu_set_exact_substitution(mdjvu_compression_options_t opt, int v)
+    {opt->exact_substitution = v;}
+MDJVU_IMPLEMENT void mdjvu_set_classify_duplicates(mdjvu_compression_options_t opt, int v)
+    {opt->classify_duplicates = v;}
+MDJVU_IMPLEMENT double mdjvu_get_peak_pattern_memory(mdjvu_compression_options_t opt)
+    {return opt->peak_pattern_memory;}
+MDJVU_IMPLEMENT int32 mdjvu_get_duplicate_count(mdjvu_compression_options_t opt)
+    {return opt->duplicates;}
+
+static void report_nothing(void *param, int page_completed)
+{
+}
+
+/* Finds exact duplicates of letters in the pages (see classify.h).
+ * Returns NULL if all letters are to be matched.
+ */
+static int32 *find_duplicates(int n, mdjvu_image_t *pages, int32 total,
+                              struct MinidjvuCompressionOptions *opt)
+{
+    int32 *originals;
+
+    opt->duplicates = 0;
+    if (opt->matcher_options && !opt->classify_duplicates)
+        return NULL;
+    originals = (int32 *) malloc((total + 1) * sizeof(int32));
+    opt->duplicates = mdjvu_multipage_find_duplicates(n, pages, originals);
+    if (opt->verbose)
+        printf(_("%d letters are exact duplicates\n"), (int) opt->duplicates);
+    return originals;
+}
 
 static void find_substitutions(mdjvu_image_t image,
                                               struct MinidjvuCompressionOptions *opt)
 {
     mdjvu_matcher_options_t m_opt = opt->matcher_options;
+    int averaging = opt->averaging && m_opt; /* equal letters need none */
     int32 i, n = mdjvu_image_get_bitmap_count(image);
-    int32 *tags = (int32 *) malloc(n * sizeof(int32));
-    int32 max_tag = mdjvu_classify_bitmaps(image, tags, m_opt, /* centers_needed: */ opt->averaging);
+    int32 *tags = (int32 *) malloc((n + 1) * sizeof(int32));
+    int32 *originals = find_duplicates(1, &image, n, opt);
+    int32 max_tag = mdjvu_multipage_classify_bitmaps_in_shards
+        (1, n, &image, tags, m_opt, report_nothing, NULL,
+         /* centers_needed: */ averaging, 1, 1, 0, NULL, originals);
     mdjvu_bitmap_t *representatives = (mdjvu_bitmap_t *)
         calloc(max_tag + 1 /* cause starts with 1 */, sizeof(mdjvu_bitmap_t));
     int32 *cx = (int32 *) malloc(n * sizeof(int32));
@@ -77,7 +131,7 @@ static void find_substitutions(mdjvu_image_t image,
 
     if (!mdjvu_image_has_substitutions(image))
        mdjvu_image_enable_substitutions(image);
-    if (!opt->averaging)
+    if (!averaging)
     {
         for (i = 0; i < n; i++)
         {
@@ -126,6 +180,7 @@ static void find_substitutions(mdjvu_image_t image,
     }
 
     free(representatives);
+    free(originals);
     free(tags);
 }
 
@@ -159,7 +214,8 @@ MDJVU_IMPLEMENT void mdjvu_compress_image(mdjvu_image_t image, mdjvu_compression
     if (options->verbose) puts(_("sorting bitmaps"));
     mdjvu_image_sort_bitmaps(image);
 
-    if (options->matcher_options)
+    /* without matcher options, only exact duplicates are substituted */
+    if (options->matcher_options || options->exact_substitution)
     {
         if (options->verbose) puts(_("matching patterns"));
         find_substitutions(image, options);
@@ -176,7 +232,7 @@ MDJVU_IMPLEMENT void mdjvu_compress_image(mdjvu_image_t image, mdjvu_compression
                    mdjvu_image_get_bitmap_count(image));
         }
         
-        if (options->averaging)
+        if (options->averaging && options->matcher_options)
         {
            if (options->verbose) puts(_("sorting bitmaps (again)"));
            mdjvu_image_sort_bitmaps(image);
@@ -304,11 +360,11 @@ static void report_prototypes(void *param, int page_completed)
 MDJVU_FUNCTION mdjvu_image_t mdjvu_compress_multipage(int n, mdjvu_image_t *pages, mdjvu_compression_options_t options)
 {
     mdjvu_image_t dictionary = NULL;
-    int i;
+    int i, averaging = options->averaging && options->matcher_options;
     int32 total_bitmaps_count, max_tag;
     mdjvu_bitmap_t *representatives;
     int32 *tags;
-    int32 *npatterns;
+    int32 *npatterns, *originals;
     unsigned char *dictionary_flags;
 
     total_bitmaps_count = 0;
@@ -328,12 +384,20 @@ MDJVU_FUNCTION mdjvu_image_t mdjvu_compress_multipage(int n, mdjvu_image_t *page
     }
 
     tags = MDJVU_MALLOCV(int32, total_bitmaps_count);
+    originals = find_duplicates(n, pages, total_bitmaps_count, options);
     if (options->report) printf(_("started classification\n"));
-    max_tag = mdjvu_multipage_classify_bitmaps
+    max_tag = mdjvu_multipage_classify_bitmaps_in_shards
         (n, total_bitmaps_count, pages, tags,
          ((struct MinidjvuCompressionOptions *) options)->matcher_options,
-         report_classify, options, options->averaging);
+         report_classify, options, averaging, options->threads,
+         options->sharded_classification ? options->threads : 1,
+         options->max_patterns_per_class, &options->peak_pattern_memory,
+         originals);
+    free(originals);
     if (options->report) printf(_("finished classification\n"));
+    if (options->verbose)
+        printf(_("patterns took at most %.0f KB of memory\n"),
+               options->peak_pattern_memory / 1024);
 
     dictionary_flags = (unsigned char *) malloc((max_tag + 1));
     representatives = (mdjvu_bitmap_t *)
@@ -348,7 +412,7 @@ MDJVU_FUNCTION mdjvu_image_t mdjvu_compress_multipage(int n, mdjvu_image_t *page
                                max_tag, tags, dictionary_flags);
     MDJVU_FREEV(npatterns);
 
-    if (!options->averaging)
+    if (!averaging)
     {
         mdjvu_multipage_choose_representatives(n, pages, max_tag, tags, representatives);
         dictionary = get_dictionary(max_tag, representatives, dictionary_flags);
@@ -367,8 +431,9 @@ MDJVU_FUNCTION mdjvu_image_t mdjvu_compress_multipage(int n, mdjvu_image_t *page
     for (i = 0; i < n; i++)
         mdjvu_image_remove_unused_bitmaps(pages[i]);
     if (options->report) printf(_("started prototype search\n"));
-    mdjvu_multipage_find_prototypes(dictionary, n, pages,
-                                    report_prototypes, options);
+    mdjvu_multipage_find_prototypes_in_threads(dictionary, n, pages,
+                                               report_prototypes, options,
+                                               options->threads);
     if (options->report) printf(_("finished prototype search\n"));
     free(dictionary_flags);
     free(representatives);
@@ -5,6 +5,7 @@
 
 #include "../base/mdjvucfg.h"
 #include <minidjvu/minidjvu.h>
+#include "words.h"
 #include <stdlib.h>
 
 
@@ -26,60 +27,67 @@
  */
 
 
-/* all input rows must be 0-or-1 unpacked */
+/* Exactly two of the four bits are set: either one pair is set
+ * and the other is clear, or each pair has one bit set.
+ */
+static uint32 two_of_four(uint32 a, uint32 b, uint32 c, uint32 d)
+{
+    return (a & b & ~(c | d)) | (c & d & ~(a | b)) | ((a ^ b) & (c ^ d));
+}
+
 static void get_erosion_candidates_in_a_row(
-                       unsigned char *r, /* result    */
-                       unsigned char *u, /* upper row */
-                       unsigned char *t, /* this row */
-                       unsigned char *l, /* lower row */
-                       int32 n)
+                       uint32 *r,       /* result    */
+                       const uint32 *u, /* upper row */
+                       const uint32 *t, /* this row  */
+                       const uint32 *l, /* lower row */
+                       int32 width)
 {
-    int32 i;
-    n--;
-    r[0] = 0;
-    r[n] = 0;
-    for (i = 1; i < n; i++)
+    int32 n = (width + 31) >> 5, i;
+    for (i = 0; i < n; i++)
     {
-        int score_4 = u[i] + l[i] + t[i-1] + t[i+1] - 2;
-        int score_d = u[i-1] + l[i-1] + u[i+1] + l[i+1] - 2;
-
-        r[i] = !score_4 && !score_d ? 1 : 0;
+        r[i] = two_of_four(u[i], l[i], LEFT(t, i), RIGHT(t, i))
+             & two_of_four(LEFT(u, i), LEFT(l, i), RIGHT(u, i), RIGHT(l, i));
     }
+
+    /* clear the border pixels (and the bits past the row end) */
+    r[0] &= 0x7FFFFFFF;
+    r[(width - 1) >> 5] &= ~(0xFFFFFFFF >> ((width - 1) & 31));
 }
 
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_get_erosion_mask(mdjvu_bitmap_t bmp)
 {
     int32 w = mdjvu_bitmap_get_width(bmp);
     int32 h = mdjvu_bitmap_get_height(bmp);
+    int32 n = (w + 31) >> 5;
     mdjvu_bitmap_t result = mdjvu_bitmap_create(w, h);
     int32 i;
-    unsigned char *u, *t, *l, *r;
+    uint32 *u, *t, *l, *r;
 
-    if (h < 3) return result;
+    if (h < 3 || w < 3) return result; /* no pixels off the border */
 
-    u = (unsigned char *) malloc(w); /* upper row */
-    t = (unsigned char *) malloc(w); /* this row */
-    l = (unsigned char *) malloc(w); /* lower row */
-    r = (unsigned char *) malloc(w); /* result */
+    u = (uint32 *) calloc(n + 2, sizeof(uint32)) + 1; /* upper row */
+    t = (uint32 *) calloc(n + 2, sizeof(uint32)) + 1; /* this row */
+    l = (uint32 *) calloc(n + 2, sizeof(uint32)) + 1; /* lower row */
+    r = (uint32 *) malloc(n * sizeof(uint32)); /* result */
 
-    mdjvu_bitmap_unpack_row_0_or_1(bmp, t, 0);
-    mdjvu_bitmap_unpack_row_0_or_1(bmp, l, 1);
+    load_words(t, mdjvu_bitmap_access_packed_row(bmp, 0), w);
+    load_words(l, mdjvu_bitmap_access_packed_row(bmp, 1), w);
     for (i = 1; i < h - 1; i++)
     {
-        unsigned char *tmp = u;
+        uint32 *tmp = u;
         u = t;
         t = l;
         l = tmp;
 
-        mdjvu_bitmap_unpack_row_0_or_1(bmp, l, i + 1);
+        load_words(l, mdjvu_bitmap_access_packed_row(bmp, i + 1), w);
 
         get_erosion_candidates_in_a_row(r, u, t, l, w);
-        mdjvu_bitmap_pack_row(result, r, i);
+        store_words(r, mdjvu_bitmap_access_packed_row(result, i), w);
     }
 
-    free(u);
-    free(t);
-    free(l);
+    free(u - 1);
+    free(t - 1);
+    free(l - 1);
     free(r);
 
     return result;
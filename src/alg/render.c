@@ -5,58 +5,127 @@
 #include "../base/mdjvucfg.h"
 #include <minidjvu/minidjvu.h>
 #include <stdlib.h>
-#include <string.h>
 
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_render(mdjvu_image_t img)
 {
     int32 width  = mdjvu_image_get_width (img);
     int32 height = mdjvu_image_get_height(img);
-    unsigned char **b = mdjvu_create_2d_array(width, height);
-    unsigned char *row_buffer = (unsigned char *) malloc(width);
     int32 blit_count = mdjvu_image_get_blit_count(img);
     int32 i;
     mdjvu_bitmap_t result = mdjvu_bitmap_create(width, height);
 
-    /* Fill the canvas with white */
-    for (i = 0; i < height; i++)
-        memset(b[i], 0, width);
+    /* Fill the page with white */
+    mdjvu_bitmap_clear(result);
 
-    /* Render the split image blit by blit */
+    /* Render the split image blit by blit.
+     * The shapes are ORed in packed form, 8 pixels at a time;
+     * mdjvu_bitmap_combine() clips the blits that stick out of the page.
+     */
     for (i = 0; i < blit_count; i++)
     {
-        int32 x = mdjvu_image_get_blit_x(img, i);
-        int32 y = mdjvu_image_get_blit_y(img, i);
-        mdjvu_bitmap_t current_bitmap = mdjvu_image_get_blit_bitmap(img, i);
-        int32 w = mdjvu_bitmap_get_width(current_bitmap);
-        int32 h = mdjvu_bitmap_get_height(current_bitmap);
+        mdjvu_bitmap_combine(result, mdjvu_image_get_blit_bitmap(img, i),
+                             mdjvu_image_get_blit_x(img, i),
+                             mdjvu_image_get_blit_y(img, i),
+                             MDJVU_BITMAP_OR);
+    }
+
+    return result;
+}
+
+/* ____________________________   banded render   __________________________ */
+
+/* Rendering a band of rows takes a bitmap of this many rows at most. */
+#define BAND_HEIGHT 256
+
+typedef struct
+{
+    int32 top, index;
+} BlitTop;
 
-        /* Now w and h are dimensions of the current shape,
-         * and width and height are dimensions of the whole image.
-         */
+static int compare_tops(const void *p1, const void *p2)
+{
+    const BlitTop *b1 = (const BlitTop *) p1;
+    const BlitTop *b2 = (const BlitTop *) p2;
+    int32 d = b1->top - b2->top;
+    if (d) return d > 0 ? 1 : -1;
+    d = b1->index - b2->index;
+    return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
 
-        int32 min_col = x >= 0 ? 0 : - x;
-        int32 max_col_plus_one = x + w <= width ? w : width - x;
+MDJVU_IMPLEMENT int mdjvu_render_band(mdjvu_image_t img, int32 y0, int32 y1,
+    int (*callback)(void *param, int32 y, unsigned char *row), void *param)
+{
+    int32 width  = mdjvu_image_get_width (img);
+    int32 height = mdjvu_image_get_height(img);
+    int32 blit_count = mdjvu_image_get_blit_count(img);
+    int32 band_height, next = 0, active_count = 0, i, y;
+    BlitTop *tops;
+    int32 *active; /* blits that may reach the current band */
+    mdjvu_bitmap_t band;
+    int result = 1;
 
-        int32 min_row = y >= 0 ? 0 : - y;
-        int32 max_row_plus_one = y + h <= height ? h : height - y;
+    if (y0 < 0) y0 = 0;
+    if (y1 > height) y1 = height;
+    if (y0 >= y1) return 1;
 
-        int32 row;
+    band_height = y1 - y0 < BAND_HEIGHT ? y1 - y0 : BAND_HEIGHT;
+    band = mdjvu_bitmap_create(width, band_height);
 
-        /* Render the current blit row by row */
-        for (row = min_row; row < max_row_plus_one; row++)
+    /* Sort the blits by their top edges, keeping only those in [y0, y1) */
+    tops = (BlitTop *) malloc((blit_count + 1) * sizeof(BlitTop));
+    active = (int32 *) malloc((blit_count + 1) * sizeof(int32));
+    for (i = 0; i < blit_count; i++)
+    {
+        mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(img, i);
+        int32 top = mdjvu_image_get_blit_y(img, i);
+        if (top >= y1 || top + mdjvu_bitmap_get_height(bitmap) <= y0)
+            continue;
+        tops[next].top = top;
+        tops[next].index = i;
+        next++;
+    }
+    qsort(tops, next, sizeof(BlitTop), &compare_tops);
+    blit_count = next;
+    next = 0;
+
+    for (y = y0; y < y1 && result; y += band_height)
+    {
+        int32 h = y1 - y < band_height ? y1 - y : band_height;
+        int32 kept = 0;
+
+        /* Pick up the blits starting above the band's bottom edge */
+        while (next < blit_count && tops[next].top < y + h)
+            active[active_count++] = tops[next++].index;
+
+        mdjvu_bitmap_clear(band);
+        for (i = 0; i < active_count; i++)
         {
-            int32 col;
-            unsigned char *target = b[y + row] + x;
-            mdjvu_bitmap_unpack_row(current_bitmap, row_buffer, row);
-            for (col = min_col; col < max_col_plus_one; col++)
-                target[col] |= row_buffer[col];
+            int32 k = active[i];
+            mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(img, k);
+            int32 top = mdjvu_image_get_blit_y(img, k);
+
+            mdjvu_bitmap_combine(band, bitmap,
+                                 mdjvu_image_get_blit_x(img, k), top - y,
+                                 MDJVU_BITMAP_OR);
+
+            /* Drop the blits that end within this band */
+            if (top + mdjvu_bitmap_get_height(bitmap) > y + h)
+                active[kept++] = k;
         }
-    }
+        active_count = kept;
 
-    free(row_buffer);
+        for (i = 0; i < h; i++)
+        {
+            if (!callback(param, y + i, mdjvu_bitmap_access_packed_row(band, i)))
+            {
+                result = 0;
+                break;
+            }
+        }
+    }
 
-    /* Convert 2D array to a Bitmap and return it */
-    mdjvu_bitmap_pack_all(result, b);
-    mdjvu_destroy_2d_array(b);
+    free(active);
+    free(tops);
+    mdjvu_bitmap_destroy(band);
     return result;
 }
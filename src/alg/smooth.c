@@ -4,82 +4,123 @@
 
 #include "../base/mdjvucfg.h"
 #include <minidjvu/minidjvu.h>
+#include "words.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-/* all input rows must be 0-or-1 unpacked */
-static void smooth_row(unsigned char *r, /* result    */
-                       unsigned char *u, /* upper row */
-                       unsigned char *t, /* this row - must have margin 1 */
-                       unsigned char *l, /* lower row */
-                       int32 n)
+/* Smooth row t into r; a pixel is decided by its 3x3 neighborhood.
+ * The rows have a zero word on both sides (r does not need it).
+ */
+static void smooth_row(uint32 *r, /* result    */
+                       const uint32 *u, /* upper row */
+                       const uint32 *t, /* this row  */
+                       const uint32 *l, /* lower row */
+                       int32 n)         /* number of words */
 {
     int32 i;
     for (i = 0; i < n; i++)
     {
-	int score = u[i] + l[i] + t[i-1] + t[i+1];
-
-	if (t[i] == 0)
-	{
-	    /* Only turn white into black for a good reason. */
-	    r[i] = (score == 4);
-	}
-	else if (score == 0)
-	{
-	    /* Good reason to clear the pixel. */
-	    r[i] = 0;
-	}
-	else if (score == 1)
-	{
-	    /* Check for weak horizontal or vertical linking. */
-	    if (u[i] | l[i])
-		r[i] = (u[i-1] & l[i-1]) | (u[i+1] & l[i+1]);
-	    else
-		r[i] = (u[i-1] & u[i+1]) | (l[i-1] & l[i+1]);
-	}
-	else
-	{
-	    /* Keep it black. */
-	    r[i] = 1;
-	}
+        uint32 tl = LEFT(t, i), tr = RIGHT(t, i);
+        uint32 ul = LEFT(u, i), ur = RIGHT(u, i);
+        uint32 ll = LEFT(l, i), lr = RIGHT(l, i);
+        uint32 vertical = u[i] | l[i], horizontal = tl | tr;
+
+        /* the 4 edge neighbors: at least one, at least two, all four */
+        uint32 any = vertical | horizontal;
+        uint32 two = (u[i] & l[i]) | (tl & tr) | (vertical & horizontal);
+        uint32 all = u[i] & l[i] & tl & tr;
+
+        /* With only one black neighbor, check for weak horizontal
+         * or vertical linking.
+         */
+        uint32 linked = (vertical & ((ul & ll) | (ur & lr)))
+                      | (~vertical & ((ul & ur) | (ll & lr)));
+
+        /* Only turn white into black for a good reason (all four);
+         * clear a black pixel if it is alone or weakly linked.
+         */
+        r[i] = (~t[i] & all) | (t[i] & (two | (any & linked)));
     }
 }
 
+/* ______________________   smoothing row by row   ________________________ */
+
+typedef struct
+{
+    int32 width;
+    int32 words;          /* words per row */
+    int32 rows;           /* rows pushed so far */
+    uint32 *u;            /* upper row (with a zero word on both sides) */
+    uint32 *t;            /* this row */
+    uint32 *l;            /* lower row */
+    uint32 *r;            /* result */
+} Smoother;
+
+MDJVU_IMPLEMENT mdjvu_smoother_t mdjvu_smoother_create(int32 width)
+{
+    Smoother *sm = (Smoother *) malloc(sizeof(Smoother));
+    sm->width = width;
+    sm->words = (width + 31) >> 5;
+    sm->rows = 0;
+    sm->u = (uint32 *) calloc(sm->words + 2, sizeof(uint32)) + 1;
+    sm->t = (uint32 *) calloc(sm->words + 2, sizeof(uint32)) + 1;
+    sm->l = (uint32 *) calloc(sm->words + 2, sizeof(uint32)) + 1;
+    sm->r = (uint32 *) malloc((sm->words + 1) * sizeof(uint32));
+    return (mdjvu_smoother_t) sm;
+}
+
+MDJVU_IMPLEMENT void mdjvu_smoother_destroy(mdjvu_smoother_t p)
+{
+    Smoother *sm = (Smoother *) p;
+    free(sm->u - 1);
+    free(sm->t - 1);
+    free(sm->l - 1);
+    free(sm->r);
+    free(sm);
+}
+
+MDJVU_IMPLEMENT int mdjvu_smoother_push_row(mdjvu_smoother_t p,
+                                            const unsigned char *row,
+                                            unsigned char *result)
+{
+    Smoother *sm = (Smoother *) p;
+    uint32 *tmp = sm->u;
+    sm->u = sm->t;
+    sm->t = sm->l;
+    sm->l = tmp;
+
+    if (row)
+        load_words(sm->l, row, sm->width);
+    else
+        memset(sm->l, 0, sm->words * sizeof(uint32));
+
+    if (!sm->rows++) return 0; /* the first row has nothing above it yet */
+
+    smooth_row(sm->r, sm->u, sm->t, sm->l, sm->words);
+    store_words(sm->r, result, sm->width);
+    return 1;
+}
+
+/* ___________________________   the whole bitmap   ________________________ */
 
 MDJVU_IMPLEMENT void mdjvu_smooth(mdjvu_bitmap_t b)
 {
     int32 w = mdjvu_bitmap_get_width(b);
     int32 h = mdjvu_bitmap_get_height(b);
     int32 i;
-    unsigned char *u, *t, *l, *r;
+    mdjvu_smoother_t sm;
 
     if (h < 3) return;
 
-    u = (unsigned char *) calloc(w + 2, 1) + 1; /* upper row */
-    t = (unsigned char *) calloc(w + 2, 1) + 1; /* this row */
-    l = (unsigned char *) calloc(w + 2, 1) + 1; /* lower row */
-    r = (unsigned char *) malloc(w); /* result */
-
-    mdjvu_bitmap_unpack_row_0_or_1(b, l, 0);
+    /* A row is written back only after the one below it has been read. */
+    sm = mdjvu_smoother_create(w);
     for (i = 0; i < h; i++)
     {
-        unsigned char *tmp = u;
-        u = t;
-        t = l;
-        l = tmp;
-
-        if (i + 1 < h)
-            mdjvu_bitmap_unpack_row_0_or_1(b, l, i + 1);
-        else
-            memset(l, 0, w);
-
-        smooth_row(r, u, t, l, w);
-        mdjvu_bitmap_pack_row(b, r, i);
+        mdjvu_smoother_push_row(sm, mdjvu_bitmap_access_packed_row(b, i),
+                                i ? mdjvu_bitmap_access_packed_row(b, i - 1)
+                                  : NULL);
     }
-
-    free(u - 1);
-    free(t - 1);
-    free(l - 1);
-    free(r);
+    mdjvu_smoother_push_row(sm, NULL, mdjvu_bitmap_access_packed_row(b, h - 1));
+    mdjvu_smoother_destroy(sm);
 }
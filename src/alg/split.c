@@ -8,20 +8,43 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_LIBPTHREAD
+    #include <pthread.h>
+#endif
+
 /* _______________________   managing splitter options   ___________________ */
 
+typedef struct
+{
+    int32 max_shape_size; /* 0 means dpi */
+    int nthreads;
+    int smooth;
+} Options;
+
 mdjvu_split_options_t mdjvu_split_options_create(void)
 {
-    int32 *p = (int32 *) malloc(sizeof(int32));
+    Options *p = (Options *) malloc(sizeof(Options));
     mdjvu_init();
-    *p = 0;
+    p->max_shape_size = 0;
+    p->nthreads = 1;
+    p->smooth = 0;
     return (mdjvu_split_options_t) p;
 }
 
 void mdjvu_split_options_set_maximum_shape_size(mdjvu_split_options_t opt, int32 size)
 {
     assert(size > 0);
-    * (int32 *) opt = size;
+    ((Options *) opt)->max_shape_size = size;
+}
+
+void mdjvu_split_options_set_threads(mdjvu_split_options_t opt, int n)
+{
+    ((Options *) opt)->nthreads = n;
+}
+
+void mdjvu_split_options_set_smooth(mdjvu_split_options_t opt, int smooth)
+{
+    ((Options *) opt)->smooth = smooth;
 }
 
 void mdjvu_split_options_destroy(mdjvu_split_options_t opt)
@@ -29,189 +52,1083 @@ void mdjvu_split_options_destroy(mdjvu_split_options_t opt)
     free(opt);
 }
 
-/* _________________________   interpreting runs   _________________________ */
+/* ___________________________   finding runs   ____________________________ */
 
-/* Runs are stored in a "map".
- * A map entry may be 0 (same-as-prev), BLACK_RUN(1) and WHITE_RUN(2).
- * Each run is started by BLACK_RUN or WHITE_RUN and continues with zeros.
- * First run is white.
- *
- * Here's an example:
- *
- *               map: 001002001000210
- *  interpreted line: 001110001111011
+/* A run of pixels of one color in a row: x0..x1-1. */
+typedef struct
+{
+    int32 x0, x1;
+    int32 label; /* index of the shape or the white area it belongs to */
+} Segment;
+
+/* Find the first pixel of the given color at x or after it, n if none.
+ * Works on a packed row; bits past the row end are never trusted.
  */
-#define BLACK_RUN 1
-#define WHITE_RUN 2
+static int32 find_pixel(const unsigned char *row, int32 x, int32 n, int black)
+{
+    int32 i = x >> 3, end = (n + 7) >> 3;
+    int invert = black ? 0 : 0xFF;
+    int b = (row[i] ^ invert) & (0xFF >> (x & 7));
 
-/* This function does three things simultaneously:
- *    1) renders `map' into `result_line' and applies AND with line
- *    2) deletes black pixels in `line'
- *    3) clears `map' including the last (max_x + 1) column
- *
- * Indices in `map'         are min_x..max_x.
- * Indices in `line'        are min_x..max_x.
- * Indices in `result_line' are 0..max_x-min_x.
- *
+    while (!b)
+    {
+        if (++i >= end) return n;
+        b = row[i] ^ invert;
+    }
+
+    x = i << 3;
+    if (!(b & 0xF0)) { b <<= 4; x += 4; }
+    if (!(b & 0xC0)) { b <<= 2; x += 2; }
+    if (!(b & 0x80)) x++;
+    return x < n ? x : n;
+}
+
+/* Cut a packed row into black and white segments.
+ * Returns the number of black segments; the white ones are counted in *nw.
  */
-static void interpret_runs_in_a_line(int32 min_x, int32 max_x,
-                                     unsigned char *map,
-                                     unsigned char *result_line,
-                                     unsigned char *line)
+static int32 find_segments(const unsigned char *row, int32 width,
+                           Segment *black, Segment *white, int32 *nw)
 {
-    int32 i = min_x;
-    memset(result_line, 0, max_x - min_x + 1);
-    map[max_x + 1] = 0;
-    while (1)
+    int32 x = 0, nb = 0;
+    *nw = 0;
+    while (x < width)
     {
-        /* white run */
-        while (map[i] != BLACK_RUN)
+        int32 b = find_pixel(row, x, width, 1);
+        if (b > x)
         {
-            if (++i > max_x) return;
+            white[*nw].x0 = x;
+            white[(*nw)++].x1 = b;
         }
+        if (b >= width) break;
+        x = find_pixel(row, b, width, 0);
+        black[nb].x0 = b;
+        black[nb++].x1 = x;
+    }
+    return nb;
+}
 
-        map[i] = 0;
+/* Set pixels x0..x1-1 in a packed row. */
+static void fill_segment(unsigned char *row, int32 x0, int32 x1)
+{
+    int32 i = x0 >> 3, last = (x1 - 1) >> 3;
+    unsigned char left = (unsigned char) (0xFF >> (x0 & 7));
+    unsigned char right = (unsigned char) (0xFF << (7 - ((x1 - 1) & 7)));
 
-        /* black run */
-        while (map[i] != WHITE_RUN)
-        {
-            result_line[i - min_x] = line[i]; /* copy instead of paint */
-            line[i] = 0;
-            if (++i > max_x) return;
-        }
+    if (i == last)
+    {
+        row[i] |= left & right;
+        return;
+    }
+    row[i] |= left;
+    if (last > i + 1)
+        memset(row + i + 1, 0xFF, last - i - 1);
+    row[last] |= right;
+}
 
-        map[i] = 0;
+/* __________________________   labelling runs   ___________________________ */
+
+/* The splitter gets the bitmap row by row and keeps track of connected
+ * black runs (4-connected) and of white areas between them (8-connected,
+ * so that they separate what the black ones don't). A shape is finished
+ * when a row passes without continuing it. A white area that closes up
+ * without touching the border is a hole of the shape right above it,
+ * and the shapes finished inside the hole are added to that shape -
+ * just what walking around the outer contour used to give.
+ *
+ * Shapes are cut after max_shape_size rows from their top;
+ * what goes on below is split anew.
+ *
+ * The splitter may also get a band of a page (see split_in_bands()).
+ * Then the rows above or below are not the border: what touches them
+ * is left open for stitching, and no shape is cut. The shapes from
+ * a hole are kept apart from the shape around (see add_shape()).
+ *
+ * Only the runs of the current and previous rows are labelled.
+ * The records of finished shapes and closed white areas are dropped
+ * from time to time (see compact()), so the state is O(width) plus
+ * the runs of unfinished shapes and of shapes waiting in possible holes.
+ */
+
+typedef struct
+{
+    int32 y, x0, x1; /* black pixels x0..x1-1 of row y */
+    int32 next;      /* next run of the same shape, -1 if none */
+} Run;
+
+/* Shapes and white areas are numbered in the order they were met,
+ * so the smaller index is always the one starting higher (or lefter).
+ * Merged ones point to the older one, as in union-find.
+ */
+typedef struct
+{
+    int32 link;                 /* itself if it's the root */
+    int32 min_x, max_x, top, bottom;
+    int32 first_x;              /* the first pixel, on the top row */
+    int32 first_run, last_run;
+    int32 white;                /* the area above the first pixel, -1 if none */
+    int32 next_held;            /* next shape waiting in the same white area */
+    int32 first_inner, last_inner; /* in a band, the shapes from its holes */
+    int new_hole;               /* the first of these from a hole */
+    int done;
+    int open;                   /* goes on into the band above or below */
+} Shape;
+
+typedef struct
+{
+    int32 link;
+    int32 shape;                /* the shape above the first pixel, -1 if none */
+    int32 bottom;
+    int32 first_held, last_held;
+    int outside;                /* touches the border */
+    int done;
+    int open;                   /* goes on into the band above or below */
+} White;
+
+typedef struct
+{
+    mdjvu_bitmap_t bitmap;
+    int32 x, y, first_x;
+} Piece;
+
+/* A shape from a hole of another one, drawn apart (see add_shape()). */
+typedef struct
+{
+    Piece piece;
+    int32 hole;                 /* the same for the shapes in the same hole */
+} Inner;
+
+typedef struct
+{
+    int32 width, y0, y1, max_shape_size, y; /* rows y0..y1-1 */
+    int open_top, open_bottom;  /* a band with more of the page there */
+
+    /* segments of the previous and the current row */
+    Segment *segments, *black, *white, *prev_black, *prev_white;
+    int32 black_count, white_count, prev_black_count, prev_white_count;
+
+    Run *runs;
+    int32 run_count, run_allocated, free_runs;
+
+    Shape *shapes;
+    int32 shape_count, shape_allocated;
+
+    White *whites;
+    int32 white_count_total, whites_allocated;
+
+    /* shape_count + white_count_total that triggers compact() */
+    int32 compact_limit;
+
+    Piece *pieces;
+    int32 piece_count, pieces_allocated;
+
+    /* the first row of a band, kept for stitching */
+    Segment *first_black, *first_white;
+    int32 first_black_count, first_white_count;
+} Splitter;
+
+#define GROW(ARRAY, COUNT, ALLOCATED, TYPE) \
+    do \
+    { \
+        if (COUNT == ALLOCATED) \
+        { \
+            ALLOCATED = ALLOCATED ? ALLOCATED * 2 : 256; \
+            ARRAY = (TYPE *) realloc(ARRAY, ALLOCATED * sizeof(TYPE)); \
+        } \
+    } while (0)
+
+static int32 shape_root(Splitter *s, int32 i)
+{
+    while (s->shapes[i].link != i)
+        i = s->shapes[i].link = s->shapes[s->shapes[i].link].link;
+    return i;
+}
+
+static int32 white_root(Splitter *s, int32 i)
+{
+    while (s->whites[i].link != i)
+        i = s->whites[i].link = s->whites[s->whites[i].link].link;
+    return i;
+}
+
+static void add_run(Splitter *s, int32 shape, int32 y, int32 x0, int32 x1)
+{
+    Shape *sh;
+    int32 r;
+
+    if (s->free_runs >= 0)
+    {
+        r = s->free_runs;
+        s->free_runs = s->runs[r].next;
     }
+    else
+    {
+        GROW(s->runs, s->run_count, s->run_allocated, Run);
+        r = s->run_count++;
+    }
+    s->runs[r].y = y;
+    s->runs[r].x0 = x0;
+    s->runs[r].x1 = x1;
+    s->runs[r].next = -1;
+
+    sh = &s->shapes[shape];
+    if (sh->last_run >= 0)
+        s->runs[sh->last_run].next = r;
+    else
+        sh->first_run = r;
+    sh->last_run = r;
+    if (x0 < sh->min_x) sh->min_x = x0;
+    if (x1 - 1 > sh->max_x) sh->max_x = x1 - 1;
+    sh->bottom = y;
 }
 
-/* This function does the same as interpret_runs_in_a_line(),
- *    but on a rectangle.
- * Returns the rendered result.
- * Also clears it in pixels[][].
- * `map' is cleared.
+static int32 new_shape(Splitter *s, int32 y, int32 x0, int32 x1, int32 white)
+{
+    Shape *sh;
+    GROW(s->shapes, s->shape_count, s->shape_allocated, Shape);
+    sh = &s->shapes[s->shape_count];
+    sh->link = s->shape_count;
+    sh->min_x = sh->first_x = x0;
+    sh->max_x = x1 - 1;
+    sh->top = sh->bottom = y;
+    sh->first_run = sh->last_run = -1;
+    sh->white = white;
+    sh->next_held = sh->first_inner = sh->last_inner = -1;
+    sh->new_hole = sh->done = 0;
+    sh->open = s->open_top && y == s->y0;
+    add_run(s, s->shape_count, y, x0, x1);
+    return s->shape_count++;
+}
+
+/* Move the runs of shape b into shape a. */
+static void take_runs(Splitter *s, int32 a, int32 b)
+{
+    Shape *sa = &s->shapes[a], *sb = &s->shapes[b];
+    if (sb->first_run < 0) return;
+    if (sa->last_run >= 0)
+        s->runs[sa->last_run].next = sb->first_run;
+    else
+        sa->first_run = sb->first_run;
+    sa->last_run = sb->last_run;
+    sb->first_run = sb->last_run = -1;
+}
+
+/* Merge two root shapes, return the root of the result */
+static int32 merge_shapes(Splitter *s, int32 a, int32 b)
+{
+    Shape *sa, *sb;
+    if (a == b) return a;
+    if (b < a) { int32 t = a; a = b; b = t; }
+    sa = &s->shapes[a];
+    sb = &s->shapes[b];
+    take_runs(s, a, b);
+    if (sb->first_inner >= 0)
+    {
+        if (sa->last_inner >= 0)
+            s->shapes[sa->last_inner].next_held = sb->first_inner;
+        else
+            sa->first_inner = sb->first_inner;
+        sa->last_inner = sb->last_inner;
+        sb->first_inner = sb->last_inner = -1;
+    }
+    if (sb->min_x < sa->min_x) sa->min_x = sb->min_x;
+    if (sb->max_x > sa->max_x) sa->max_x = sb->max_x;
+    if (sb->bottom > sa->bottom) sa->bottom = sb->bottom;
+    sa->open |= sb->open;
+    sb->link = a;
+    return a;
+}
+
+static int32 new_white(Splitter *s, int32 y, int32 x0, int32 x1, int32 shape)
+{
+    White *w;
+    GROW(s->whites, s->white_count_total, s->whites_allocated, White);
+    w = &s->whites[s->white_count_total];
+    w->link = s->white_count_total;
+    w->shape = shape;
+    w->bottom = y;
+    w->first_held = w->last_held = -1;
+    w->outside = (y == s->y0 && !s->open_top) || x0 == 0 || x1 == s->width;
+    w->done = 0;
+    w->open = s->open_top && y == s->y0;
+    return s->white_count_total++;
+}
+
+static int32 merge_whites(Splitter *s, int32 a, int32 b)
+{
+    White *wa, *wb;
+    if (a == b) return a;
+    if (b < a) { int32 t = a; a = b; b = t; }
+    wa = &s->whites[a];
+    wb = &s->whites[b];
+    if (wb->first_held >= 0)
+    {
+        if (wa->last_held >= 0)
+            s->shapes[wa->last_held].next_held = wb->first_held;
+        else
+            wa->first_held = wb->first_held;
+        wa->last_held = wb->last_held;
+    }
+    wa->outside |= wb->outside;
+    wa->open |= wb->open;
+    if (wb->bottom > wa->bottom) wa->bottom = wb->bottom;
+    wb->link = a;
+    return a;
+}
+
+/* Draw the runs from r on into a bitmap that starts at (x, y). */
+static void fill_runs(mdjvu_bitmap_t bitmap, const Run *runs, int32 r,
+                      int32 x, int32 y)
+{
+    for (; r >= 0; r = runs[r].next)
+    {
+        fill_segment(mdjvu_bitmap_access_packed_row(bitmap, runs[r].y - y),
+                     runs[r].x0 - x, runs[r].x1 - x);
+    }
+}
+
+/* Draw a finished shape with the shapes from its holes
+ * into a bitmap that starts at (x, y).
  */
-static mdjvu_bitmap_t interpret_runs(int32 min_x, int32 max_x,
-                                     int32 min_y, int32 max_y,
-                                     unsigned char **map,
-                                     unsigned char **pixels)
-{
-    int32 w = max_x - min_x + 1;
-    int32 h = max_y - min_y + 1;
-    unsigned char *line_buf = (unsigned char *) malloc(w);
-    mdjvu_bitmap_t bmp = mdjvu_bitmap_create(w, h);
-    int32 y;
-    for (y = min_y; y <= max_y; y++)
+static void draw_shape(Splitter *s, int32 i, mdjvu_bitmap_t bitmap,
+                       int32 x, int32 y)
+{
+    Shape *sh = &s->shapes[i];
+    int32 k;
+
+    fill_runs(bitmap, s->runs, sh->first_run, x, y);
+
+    /* return the runs to the free list */
+    if (sh->first_run >= 0)
+    {
+        s->runs[sh->last_run].next = s->free_runs;
+        s->free_runs = sh->first_run;
+    }
+    sh->first_run = sh->last_run = -1;
+
+    for (k = sh->first_inner; k >= 0; k = s->shapes[k].next_held)
+        draw_shape(s, k, bitmap, x, y);
+    sh->first_inner = sh->last_inner = -1;
+}
+
+/* Draw each shape from the holes of a shape into a piece of its own,
+ * numbering the holes from *hole on.
+ */
+static void draw_inner(Splitter *s, int32 i, int32 *hole,
+                       Inner **inner, int32 *count, int32 *allocated)
+{
+    int32 k;
+    for (k = s->shapes[i].first_inner; k >= 0; k = s->shapes[k].next_held)
     {
-        interpret_runs_in_a_line(min_x, max_x, map[y], line_buf, pixels[y]);
-        mdjvu_bitmap_pack_row(bmp, line_buf, y - min_y);
+        Shape *sh = &s->shapes[k];
+        Piece *p;
+        GROW(*inner, *count, *allocated, Inner);
+        if (sh->new_hole) ++*hole;
+        (*inner)[*count].hole = *hole;
+        p = &(*inner)[(*count)++].piece;
+        p->bitmap = mdjvu_bitmap_create(sh->max_x - sh->min_x + 1,
+                                        sh->bottom - sh->top + 1);
+        mdjvu_bitmap_clear(p->bitmap);
+        draw_shape(s, k, p->bitmap, sh->min_x, sh->top);
+        p->x = sh->min_x;
+        p->y = sh->top;
+        p->first_x = sh->first_x;
     }
-    free(line_buf);
-    return bmp;
+    s->shapes[i].first_inner = s->shapes[i].last_inner = -1;
+}
+
+static void add_shape(Splitter *s, mdjvu_bitmap_t bitmap,
+                      int32 x, int32 y, int32 first_x,
+                      Inner *inner, int32 inner_count);
+
+/* Render a finished shape into a bitmap and put it aside for sorting. */
+static void emit_shape(Splitter *s, int32 i)
+{
+    Shape *sh = &s->shapes[i];
+    mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(sh->max_x - sh->min_x + 1,
+                                                sh->bottom - sh->top + 1);
+    Inner *inner = NULL;
+    int32 inner_count = 0, inner_allocated = 0, hole = 0;
+
+    if (sh->bottom - sh->top + 1 > s->max_shape_size)
+        draw_inner(s, i, &hole, &inner, &inner_count, &inner_allocated);
+    mdjvu_bitmap_clear(bitmap);
+    draw_shape(s, i, bitmap, sh->min_x, sh->top);
+    add_shape(s, bitmap, sh->min_x, sh->top, sh->first_x, inner, inner_count);
+    free(inner);
 }
 
-/* ________________________   walking along contours   _____________________ */
+/* The white area turned out not to be a hole: emit the shapes inside. */
+static void release_held(Splitter *s, int32 i)
+{
+    int32 k = s->whites[i].first_held;
+    while (k >= 0)
+    {
+        int32 next = s->shapes[k].next_held;
+        s->shapes[k].next_held = -1;
+        emit_shape(s, k);
+        k = next;
+    }
+    s->whites[i].first_held = s->whites[i].last_held = -1;
+}
 
-/* (start_x, start_y) should be the leftmost of the topmost black pixels.
- * Walking is counterclockwise.
- * map must be cleared.
+/* The shape got no continuation or was cut: it is finished,
+ * but if it's inside a hole, it belongs to the shape around.
+ * An open shape waits for stitching, and so do the shapes finished
+ * in an open white area, even a closed one: it may come back from
+ * the band next to it.
  */
+static void finish_shape(Splitter *s, int32 i)
+{
+    Shape *sh = &s->shapes[i];
+    int32 w;
 
-static void walk_around_a_black_contour(unsigned char **pixels,
-                                        unsigned char **map,
-                                        int32 start_x, int32 start_y,
-                                        int32 *pmin_x, int32 *pmax_x,
-                                        int32 *pmin_y, int32 *pmax_y)
-{
-    int32 x = start_x, y = start_y;   /* current black pixel */
-    int32 dx = 0, dy = 1;  /* vector along the contour*/
-                   /* it's always true that abs(dx) == 1 && dy == 0
-                    *                        ||
-                    *                       abs(dy) == 1 && dx == 0
-                    */
-
-    /* Bounding box. start_y will always be minimal y. */
-    int32 min_x = start_x;
-    int32 max_x = start_x;
-    int32 max_y = start_y;
-
-    /* Starting picture:
-     *
-     *      | w | w |
-     *      ----+---|
-     *      | w | b |  <- start_y
-     *            ^
-     *           start_x
-     *
-     *  and we're heading down
-     */
+    sh->done = 1;
+    if (sh->open)
+        return;
+    if (sh->white < 0)
+    {
+        emit_shape(s, i);
+        return;
+    }
+    w = white_root(s, sh->white);
+    if ((s->whites[w].done && !s->whites[w].open) || s->whites[w].outside)
+    {
+        emit_shape(s, i);
+        return;
+    }
+    if (s->whites[w].last_held >= 0)
+        s->shapes[s->whites[w].last_held].next_held = i;
+    else
+        s->whites[w].first_held = i;
+    s->whites[w].last_held = i;
+}
 
-    /* Generic picture (===> denotes contour fragment along (dx,dy)):
-     *
-     *  (1) | b | ? | (3)
-     *      ====>----
-     *  (2) | w | ? | (4)
-     *
-     *  ===> vector is (dx,dy)
-     *  up vector (that is, (dx,dy) rotated counterclockwise) is (dy, -dx).
-     *  down vector (that is, (dx,dy) rotated clockwise) is      (-dy, dx).
-     *  (the coordinate system is left)
-     */
+/* The white area got no continuation: decide if it's a hole. */
+static void close_white(Splitter *s, int32 i)
+{
+    White *w = &s->whites[i];
+    int32 owner = -1, k;
 
-    /* MAIN IMAGE WALKING LOOP */
-    while (x != start_x || y != start_y || dx != -1)
+    w->done = 1;
+    if (w->open && !w->outside)
+        return; /* it's for stitching to decide */
+    if (!w->outside && w->shape >= 0)
     {
-        assert(pixels[y][x] /* is black */);
+        owner = shape_root(s, w->shape);
+        if (s->shapes[owner].done) /* it was cut, the hole is open below */
+            owner = -1;
+    }
+
+    if (owner < 0)
+    {
+        release_held(s, i);
+        return;
+    }
 
-        /* see if this pixel enlarges bbox */
-        if (x < min_x) min_x = x; else if (x > max_x) max_x = x;
-        if (y > max_y) max_y = y;
+    if ((s->open_top || s->open_bottom) && w->first_held >= 0)
+    {
+        /* a band keeps them apart (see add_shape()) */
+        Shape *o = &s->shapes[owner];
+        s->shapes[w->first_held].new_hole = 1;
+        if (o->last_inner >= 0)
+            s->shapes[o->last_inner].next_held = w->first_held;
+        else
+            o->first_inner = w->first_held;
+        o->last_inner = w->last_held;
+        w->first_held = w->last_held = -1;
+        return;
+    }
 
-        /* fill contour map if needed */
-        if (dx == 0)
+    k = w->first_held;
+    while (k >= 0)
+    {
+        int32 next = s->shapes[k].next_held;
+        s->shapes[k].next_held = -1;
+        take_runs(s, owner, k);
+        s->shapes[k].link = owner;
+        k = next;
+    }
+    w->first_held = w->last_held = -1;
+}
+
+/* Drop the records nothing refers to any more, between two rows.
+ * What matters for the rows to come is:
+ *     the shapes and white areas of the current row (all unfinished),
+ *     the white area above the first pixel of each of these shapes,
+ *     the shape above the first pixel of each of these white areas
+ *         and the shapes held in them.
+ * In a band, so do the open shapes and white areas, finished or not.
+ * All references are turned into roots first, so the merged records
+ * are not needed either. The live ones are moved down keeping their
+ * order, so the smaller index still means the older one.
+ */
+static void compact(Splitter *s)
+{
+    int32 *shape_map = (int32 *) malloc((s->shape_count + 1) * sizeof(int32));
+    int32 *white_map = (int32 *) malloc((s->white_count_total + 1) * sizeof(int32));
+    int32 i, k, n;
+
+    for (i = 0; i < s->shape_count; i++) shape_map[i] = -1;
+    for (i = 0; i < s->white_count_total; i++) white_map[i] = -1;
+
+    /* mark: -1 is dead, 0 is live */
+    for (i = 0; i < s->white_count; i++)
+    {
+        White *w;
+        s->white[i].label = white_root(s, s->white[i].label);
+        w = &s->whites[s->white[i].label];
+        if (white_map[s->white[i].label] == 0) continue;
+        white_map[s->white[i].label] = 0;
+        if (w->shape >= 0)
         {
-            if (dy > 0)
-                map[y][x] = BLACK_RUN;
-            else
-                map[y][x + 1] = WHITE_RUN; /* map has the right margin */
+            w->shape = shape_root(s, w->shape);
+            shape_map[w->shape] = 0;
+        }
+        for (k = w->first_held; k >= 0; k = s->shapes[k].next_held)
+            shape_map[k] = 0;
+    }
+    for (i = 0; i < s->black_count; i++)
+    {
+        Shape *sh;
+        s->black[i].label = shape_root(s, s->black[i].label);
+        sh = &s->shapes[s->black[i].label];
+        shape_map[s->black[i].label] = 0;
+        if (sh->white >= 0)
+        {
+            sh->white = white_root(s, sh->white);
+            white_map[sh->white] = 0;
         }
+    }
+    for (i = 0; i < s->shape_count; i++)
+    {
+        Shape *sh = &s->shapes[i];
+        if (!sh->open || sh->link != i) continue;
+        shape_map[i] = 0;
+        if (sh->white >= 0)
+        {
+            sh->white = white_root(s, sh->white);
+            white_map[sh->white] = 0;
+        }
+    }
+    for (i = 0; i < s->white_count_total; i++)
+    {
+        White *w = &s->whites[i];
+        if (!w->open || w->link != i) continue;
+        white_map[i] = 0;
+        if (w->shape >= 0)
+        {
+            w->shape = shape_root(s, w->shape);
+            shape_map[w->shape] = 0;
+        }
+        for (k = w->first_held; k >= 0; k = s->shapes[k].next_held)
+            shape_map[k] = 0;
+    }
+    for (i = 0; i < s->first_black_count; i++)
+        s->first_black[i].label = shape_root(s, s->first_black[i].label);
+    for (i = 0; i < s->first_white_count; i++)
+        s->first_white[i].label = white_root(s, s->first_white[i].label);
+    /* and the shapes from the holes of the live ones, which are younger */
+    for (i = 0; i < s->shape_count; i++)
+    {
+        if (shape_map[i] < 0) continue;
+        for (k = s->shapes[i].first_inner; k >= 0; k = s->shapes[k].next_held)
+            shape_map[k] = 0;
+    }
+
+    /* move */
+    for (i = n = 0; i < s->shape_count; i++)
+    {
+        if (shape_map[i] < 0) continue;
+        shape_map[i] = n;
+        s->shapes[n++] = s->shapes[i];
+    }
+    s->shape_count = n;
+    for (i = n = 0; i < s->white_count_total; i++)
+    {
+        if (white_map[i] < 0) continue;
+        white_map[i] = n;
+        s->whites[n++] = s->whites[i];
+    }
+    s->white_count_total = n;
 
-        /* proceed with contour */
-        if (pixels[y + dy][x + dx])  /* testing (3) */
+    /* renumber; finished shapes and closed areas don't look around */
+    for (i = 0; i < s->shape_count; i++)
+    {
+        Shape *sh = &s->shapes[i];
+        sh->link = i;
+        sh->white = (sh->done && !sh->open) || sh->white < 0 ?
+                    -1 : white_map[sh->white];
+        if (sh->next_held >= 0) sh->next_held = shape_map[sh->next_held];
+        if (sh->first_inner >= 0)
+        {
+            sh->first_inner = shape_map[sh->first_inner];
+            sh->last_inner = shape_map[sh->last_inner];
+        }
+    }
+    for (i = 0; i < s->white_count_total; i++)
+    {
+        White *w = &s->whites[i];
+        w->link = i;
+        w->shape = (w->done && !w->open) || w->shape < 0 ?
+                   -1 : shape_map[w->shape];
+        if (w->first_held >= 0)
         {
-            int32 x4 = x + dx - dy, y4 = y + dy + dx;
+            w->first_held = shape_map[w->first_held];
+            w->last_held = shape_map[w->last_held];
+        }
+    }
+    for (i = 0; i < s->black_count; i++)
+        s->black[i].label = shape_map[s->black[i].label];
+    for (i = 0; i < s->white_count; i++)
+        s->white[i].label = white_map[s->white[i].label];
+    for (i = 0; i < s->first_black_count; i++)
+        s->first_black[i].label = shape_map[s->first_black[i].label];
+    for (i = 0; i < s->first_white_count; i++)
+        s->first_white[i].label = white_map[s->first_white[i].label];
+
+    s->compact_limit = 2 * (s->shape_count + s->white_count_total) + 1024;
+    free(shape_map);
+    free(white_map);
+}
+
+static void swap_rows(Splitter *s)
+{
+    Segment *t;
+    t = s->black; s->black = s->prev_black; s->prev_black = t;
+    t = s->white; s->white = s->prev_white; s->prev_white = t;
+    s->prev_black_count = s->black_count;
+    s->prev_white_count = s->white_count;
+}
 
-            if (pixels[y4][x4]) /* testing (4) */
+/* Get ready for rows y0..y1-1 of a bitmap. */
+static void splitter_init(Splitter *s, int32 width, int32 y0, int32 y1,
+                          int32 max_shape_size)
+{
+    memset(s, 0, sizeof(Splitter));
+    s->width = width;
+    s->y0 = s->y = y0;
+    s->y1 = y1;
+    s->max_shape_size = max_shape_size;
+    s->free_runs = -1;
+    s->compact_limit = 1024;
+    s->segments = (Segment *) malloc(4 * (width / 2 + 1) * sizeof(Segment));
+    s->black = s->segments;
+    s->white = s->black + (width / 2 + 1);
+    s->prev_black = s->white + (width / 2 + 1);
+    s->prev_white = s->prev_black + (width / 2 + 1);
+}
+
+/* Take the next row of the bitmap (packed). */
+static void splitter_add_row(Splitter *s, const unsigned char *row)
+{
+    int32 y = s->y, i, j, k;
+
+    swap_rows(s);
+    s->black_count = find_segments(row, s->width, s->black, s->white,
+                                   &s->white_count);
+
+    /* Connect black segments to the ones above (4-connectivity),
+     * cutting the shapes that became too tall
+     */
+    for (i = j = k = 0; j < s->black_count; j++)
+    {
+        Segment *seg = &s->black[j];
+        int32 label = -1, m;
+
+        while (i < s->prev_black_count && s->prev_black[i].x1 <= seg->x0)
+            i++;
+        for (m = i; m < s->prev_black_count && s->prev_black[m].x0 < seg->x1; m++)
+        {
+            int32 r = shape_root(s, s->prev_black[m].label);
+            if (s->shapes[r].done) continue;
+            if (s->shapes[r].top + s->max_shape_size <= y
+             && !s->open_top && !s->open_bottom)
             {
-                /* (3) and (4) are black - right turn */
-                /* (-dy,dx) becomes new (dx,dy) (coordinate system is left) */
-                /* pixel (4) becomes (x,y) */
-                int32 old_dx = dx;
-                dx = -dy;
-                dy = old_dx;
-                x = x4; y = y4;
+                finish_shape(s, r);
+                continue;
             }
-            else
+            label = label < 0 ? r : merge_shapes(s, label, r);
+        }
+
+        if (label >= 0)
+        {
+            add_run(s, label, y, seg->x0, seg->x1);
+        }
+        else
+        {
+            /* a new shape; which white area is it in? */
+            int32 white = -1;
+            if (y > s->y0)
             {
-                /* go straight: pixel (3) becomes (x,y) */
-                x += dx; y += dy;
+                while (k < s->prev_white_count
+                    && s->prev_white[k].x1 <= seg->x0) k++;
+                /* below a cut shape, there's no white above */
+                if (k < s->prev_white_count && s->prev_white[k].x0 <= seg->x0)
+                    white = s->prev_white[k].label;
             }
+            label = new_shape(s, y, seg->x0, seg->x1, white);
+        }
+        seg->label = label;
+    }
+
+    /* Connect white segments to the ones above (8-connectivity) */
+    for (i = j = k = 0; j < s->white_count; j++)
+    {
+        Segment *seg = &s->white[j];
+        int32 label = -1, m;
+
+        while (i < s->prev_white_count && s->prev_white[i].x1 < seg->x0)
+            i++;
+        for (m = i; m < s->prev_white_count && s->prev_white[m].x0 <= seg->x1; m++)
+        {
+            int32 r = white_root(s, s->prev_white[m].label);
+            label = label < 0 ? r : merge_whites(s, label, r);
+        }
+
+        if (label >= 0)
+        {
+            White *w = &s->whites[label];
+            w->bottom = y;
+            if (seg->x0 == 0 || seg->x1 == s->width)
+                w->outside = 1;
+            if (w->outside && w->first_held >= 0)
+                release_held(s, label);
         }
         else
         {
-            /* (3) is white - left turn */
-            /* (dy,-dx) becomes new (dx,dy) (coordinate system is left) */
-            int32 old_dx = dx;
-            dx = dy;
-            dy = -old_dx;
+            /* a new white area; which shape is above it? */
+            int32 shape = -1;
+            if (y > s->y0 && seg->x0 > 0)
+            {
+                while (s->prev_black[k].x1 <= seg->x0) k++;
+                shape = s->prev_black[k].label;
+            }
+            label = new_white(s, y, seg->x0, seg->x1, shape);
+        }
+        seg->label = label;
+    }
+
+    /* Finish the shapes and white areas that didn't go on */
+    for (i = 0; i < s->prev_black_count; i++)
+    {
+        int32 r = shape_root(s, s->prev_black[i].label);
+        if (!s->shapes[r].done && s->shapes[r].bottom < y)
+            finish_shape(s, r);
+    }
+    for (i = 0; i < s->prev_white_count; i++)
+    {
+        int32 r = white_root(s, s->prev_white[i].label);
+        if (!s->whites[r].done && s->whites[r].bottom < y)
+            close_white(s, r);
+    }
+
+    if (y == s->y0 && s->open_top)
+    {
+        s->first_black = (Segment *)
+            malloc((s->black_count + s->white_count + 1) * sizeof(Segment));
+        s->first_white = s->first_black + s->black_count;
+        s->first_black_count = s->black_count;
+        s->first_white_count = s->white_count;
+        memcpy(s->first_black, s->black, s->black_count * sizeof(Segment));
+        memcpy(s->first_white, s->white, s->white_count * sizeof(Segment));
+    }
+
+    if (s->shape_count + s->white_count_total >= s->compact_limit)
+        compact(s);
+
+    s->y++;
+}
+
+/* Finish everything; the bottom of the bitmap is the border
+ * unless the band below goes on from there.
+ */
+static void splitter_finish(Splitter *s)
+{
+    int32 i;
+    for (i = 0; i < s->black_count; i++)
+    {
+        int32 r = shape_root(s, s->black[i].label);
+        if (!s->shapes[r].done)
+        {
+            s->shapes[r].open |= s->open_bottom;
+            finish_shape(s, r);
+        }
+    }
+    for (i = 0; i < s->white_count; i++)
+    {
+        int32 r = white_root(s, s->white[i].label);
+        if (!s->whites[r].done)
+        {
+            if (s->open_bottom)
+                s->whites[r].open = 1;
+            else
+                s->whites[r].outside = 1;
+            close_white(s, r);
         }
     }
-    *pmin_x = min_x;
-    *pmax_x = max_x;
-    *pmin_y = start_y;
-    *pmax_y = max_y;
 }
 
-/* ____________________________   process row   ____________________________ */
+static void splitter_destroy(Splitter *s)
+{
+    free(s->first_black);
+    free(s->segments);
+    free(s->runs);
+    free(s->shapes);
+    free(s->whites);
+    free(s->pieces);
+}
+
+/* Shapes are placed in the order of their first pixels. */
+static int compare_pieces(const void *p1, const void *p2)
+{
+    const Piece *a = (const Piece *) p1, *b = (const Piece *) p2;
+    if (a->y != b->y) return a->y < b->y ? -1 : 1;
+    return a->first_x < b->first_x ? -1 : a->first_x > b->first_x;
+}
+
+/* _________________________   the main routines   _________________________ */
+
+static int32 get_max_shape_size(mdjvu_split_options_t opt, int32 dpi,
+                                int32 height)
+{
+    int32 max_shape_size = opt ? ((Options *) opt)->max_shape_size : 0;
+    if (!max_shape_size)
+        max_shape_size = dpi;
+    if (max_shape_size > height)
+        max_shape_size = height;
+    return max_shape_size;
+}
+
+/* Smoothing as mdjvu_smooth() does it, which leaves short bitmaps alone. */
+static int get_smooth(mdjvu_split_options_t opt, int32 height)
+{
+    return opt && ((Options *) opt)->smooth && height >= 3;
+}
+
+/* Split the rows of the bitmap the splitter was made for,
+ * smoothed on the fly if asked. A smoothed row needs the rows around it,
+ * so the smoother is fed from the row above y0 to the row below y1 - 1.
+ */
+static void split_rows(Splitter *s, mdjvu_bitmap_t bitmap, int smooth)
+{
+    int32 width = s->width, y0 = s->y0, y1 = s->y1;
+    int32 height = mdjvu_bitmap_get_height(bitmap);
+    int32 y;
+    if (smooth)
+    {
+        mdjvu_smoother_t sm = mdjvu_smoother_create(width);
+        unsigned char *row = (unsigned char *) malloc(((width + 7) >> 3) + 1);
+        for (y = y0 > 0 ? y0 - 1 : 0; y <= y1; y++)
+        {
+            /* push row y, get row y - 1 */
+            if (mdjvu_smoother_push_row(sm, y < height ?
+                    mdjvu_bitmap_access_packed_row(bitmap, y) : NULL, row)
+             && y > y0)
+            {
+                splitter_add_row(s, row);
+            }
+        }
+        mdjvu_smoother_destroy(sm);
+        free(row);
+    }
+    else
+    {
+        for (y = y0; y < y1; y++)
+            splitter_add_row(s, mdjvu_bitmap_access_packed_row(bitmap, y));
+    }
+    splitter_finish(s);
+}
+
+/* Put a shape aside for sorting.
+ * Only a band, which cuts nothing, lets a shape grow taller than
+ * max_shape_size. Such a shape is split again, cutting it from its top
+ * just as splitting the whole page would.
+ */
+static void add_piece(Splitter *s, mdjvu_bitmap_t bitmap,
+                      int32 x, int32 y, int32 first_x)
+{
+    int32 height = mdjvu_bitmap_get_height(bitmap);
+    Piece *p;
+
+    if (height > s->max_shape_size)
+    {
+        Splitter t;
+        int32 i;
+        splitter_init(&t, mdjvu_bitmap_get_width(bitmap), 0, height,
+                      s->max_shape_size);
+        split_rows(&t, bitmap, /* smooth: */ 0);
+        for (i = 0; i < t.piece_count; i++)
+        {
+            p = &t.pieces[i];
+            add_piece(s, p->bitmap, x + p->x, y + p->y, x + p->first_x);
+        }
+        splitter_destroy(&t);
+        mdjvu_bitmap_destroy(bitmap);
+        return;
+    }
+
+    GROW(s->pieces, s->piece_count, s->pieces_allocated, Piece);
+    p = &s->pieces[s->piece_count++];
+    p->bitmap = bitmap;
+    p->x = x;
+    p->y = y;
+    p->first_x = first_x;
+}
+
+/* Draw the black pixels of a bitmap into another one at (x, y). */
+static void draw_bitmap(mdjvu_bitmap_t to, mdjvu_bitmap_t from,
+                        int32 x, int32 y)
+{
+    int32 width = mdjvu_bitmap_get_width(from);
+    int32 height = mdjvu_bitmap_get_height(from);
+    int32 row, x0, x1;
+
+    for (row = 0; row < height; row++)
+    {
+        const unsigned char *r = mdjvu_bitmap_access_packed_row(from, row);
+        x1 = 0;
+        while (x1 < width)
+        {
+            x0 = find_pixel(r, x1, width, 1);
+            if (x0 >= width) break;
+            x1 = find_pixel(r, x0, width, 0);
+            fill_segment(mdjvu_bitmap_access_packed_row(to, y + row),
+                         x + x0, x + x1);
+        }
+    }
+}
+
+static int get_pixel(mdjvu_bitmap_t bitmap, int32 x, int32 y)
+{
+    const unsigned char *row = mdjvu_bitmap_access_packed_row(bitmap, y);
+    return row[x >> 3] & (0x80 >> (x & 7));
+}
+
+static int compare_holes(const void *p1, const void *p2)
+{
+    const Inner *a = (const Inner *) p1, *b = (const Inner *) p2;
+    return a->hole < b->hole ? -1 : a->hole > b->hole;
+}
+
+/* Put a finished shape aside (see add_piece()) with the shapes
+ * from its holes, which a band keeps apart in `inner' and which are
+ * no taller than max_shape_size unless the shape is.
+ * If the shape is to be split again, they need not be: splitting
+ * the whole page would either give the shapes in a hole pieces of their
+ * own or put them into the piece that has the hole, and the first pixel
+ * of one of them alone goes the same way. It touches nothing, and nothing
+ * else depends on what's inside the hole.
+ * Only a tall shape inside takes splitting everything again.
+ */
+static void add_shape(Splitter *s, mdjvu_bitmap_t bitmap,
+                      int32 x, int32 y, int32 first_x,
+                      Inner *inner, int32 inner_count)
+{
+    int32 height = mdjvu_bitmap_get_height(bitmap);
+    int again = height > s->max_shape_size && inner_count;
+    int32 i, j, k, n, own_count;
+    Splitter t;
+    int32 *own;
+
+    for (i = 0; i < inner_count; i++)
+    {
+        if (mdjvu_bitmap_get_height(inner[i].piece.bitmap) > s->max_shape_size)
+            again = 0;
+    }
+    if (!again)
+    {
+        for (i = 0; i < inner_count; i++)
+        {
+            Piece *p = &inner[i].piece;
+            draw_bitmap(bitmap, p->bitmap, p->x - x, p->y - y);
+            mdjvu_bitmap_destroy(p->bitmap);
+        }
+        add_piece(s, bitmap, x, y, first_x);
+        return;
+    }
+
+    qsort(inner, inner_count, sizeof(Inner), &compare_holes);
+    for (i = 0; i < inner_count; i = j)
+    {
+        Piece *p = &inner[i].piece;
+        fill_segment(mdjvu_bitmap_access_packed_row(bitmap, p->y - y),
+                     p->first_x - x, p->first_x - x + 1);
+        for (j = i + 1; j < inner_count && inner[j].hole == inner[i].hole; j++)
+            ;
+    }
+    splitter_init(&t, mdjvu_bitmap_get_width(bitmap), 0, height,
+                  s->max_shape_size);
+    split_rows(&t, bitmap, /* smooth: */ 0);
+    mdjvu_bitmap_destroy(bitmap);
+    n = t.piece_count;
+    qsort(t.pieces, n, sizeof(Piece), &compare_pieces);
+    own = (int32 *) malloc((n + 1) * sizeof(int32));
+    for (k = 0; k < n; k++)
+        own[k] = 1;
+
+    /* a first pixel that got a piece of its own: so do all in the hole */
+    for (i = 0; i < inner_count; i = j)
+    {
+        Piece key, *p;
+        for (j = i + 1; j < inner_count && inner[j].hole == inner[i].hole; j++)
+            ;
+        key.y = inner[i].piece.y - y;
+        key.first_x = inner[i].piece.first_x - x;
+        p = (Piece *) bsearch(&key, t.pieces, n, sizeof(Piece),
+                              &compare_pieces);
+        if (!p) continue;
+        own[p - t.pieces] = 0;
+        for (k = i; k < j; k++)
+        {
+            add_piece(s, inner[k].piece.bitmap, inner[k].piece.x,
+                      inner[k].piece.y, inner[k].piece.first_x);
+            inner[k].piece.bitmap = NULL;
+        }
+    }
+
+    /* the others went into the pieces of the shape */
+    for (k = own_count = 0; k < n; k++)
+    {
+        if (own[k])
+            own[own_count++] = k;
+        else
+            mdjvu_bitmap_destroy(t.pieces[k].bitmap);
+    }
+    for (i = 0; i < inner_count; i = j)
+    {
+        int32 px = inner[i].piece.first_x - x, py = inner[i].piece.y - y;
+        Piece *p = NULL;
+        for (j = i + 1; j < inner_count && inner[j].hole == inner[i].hole; j++)
+            ;
+        if (!inner[i].piece.bitmap) continue;
+        for (k = 0; k < own_count; k++)
+        {
+            p = &t.pieces[own[k]];
+            if (px >= p->x && py >= p->y
+             && px < p->x + mdjvu_bitmap_get_width(p->bitmap)
+             && py < p->y + mdjvu_bitmap_get_height(p->bitmap)
+             && get_pixel(p->bitmap, px - p->x, py - p->y))
+            {
+                break;
+            }
+        }
+        assert(k < own_count);
+        for (k = i; k < j; k++)
+        {
+            Piece *q = &inner[k].piece;
+            draw_bitmap(p->bitmap, q->bitmap, q->x - x - p->x, q->y - y - p->y);
+            mdjvu_bitmap_destroy(q->bitmap);
+        }
+    }
+
+    for (k = 0; k < own_count; k++)
+    {
+        Piece *p = &t.pieces[own[k]];
+        add_piece(s, p->bitmap, x + p->x, y + p->y, x + p->first_x);
+    }
+    free(own);
+    splitter_destroy(&t);
+}
 
 static void add_to_image(mdjvu_image_t image,
                          mdjvu_bitmap_t bitmap,
@@ -219,181 +1136,502 @@ static void add_to_image(mdjvu_image_t image,
                          mdjvu_split_options_t opt,
                          int32 blit_shift_x,
                          int32 blit_shift_y,
-                         int big);
+                         int big,
+                         int smooth);
 
-
-/* This function scans the y-th row for contours. */
-/* Margins (1 pixel) from each side are required. */
-static void process_row(unsigned char **pixels, unsigned char **map,
-                        int32 y, int32 w, int32 h,
-                        mdjvu_image_t image, int32 shift_x, int32 shift_y,
-                        int32 max_shape_width,
-                        int32 blit_shift_x, int32 blit_shift_y,
-                        int32 dpi, mdjvu_split_options_t opt,
-                        int big)
+/* Put the shapes found by splitting into the image, sorted. */
+static void add_pieces(mdjvu_image_t image, Piece *pieces, int32 piece_count,
+                       int32 dpi, mdjvu_split_options_t opt,
+                       int32 max_shape_size,
+                       int32 blit_shift_x, int32 blit_shift_y, int big)
 {
-    unsigned char *row = pixels[y];
     int32 i;
-    for (i = 0; i < w; i++)
-    {
-        if (row[i])
-        {
-            int32 min_x, max_x, min_y, max_y, shape_width;
-
-            /* extract the contour */
-            mdjvu_bitmap_t bitmap;
-            walk_around_a_black_contour(pixels, map, i, y,
-                                        &min_x, &max_x, &min_y, &max_y);
-            bitmap = interpret_runs(min_x, max_x,
-                                    min_y, max_y,
-                                    map, pixels);
-            shape_width = mdjvu_bitmap_get_width(bitmap);
-            assert(shape_width == max_x - min_x + 1);
-            assert(mdjvu_bitmap_get_height(bitmap) == max_y - min_y + 1);
-            if (shape_width <= max_shape_width)
+
+    if (piece_count)
+        qsort(pieces, piece_count, sizeof(Piece), &compare_pieces);
+
+    for (i = 0; i < piece_count; i++)
+    {
+        mdjvu_bitmap_t shape = pieces[i].bitmap;
+        int32 shape_width = mdjvu_bitmap_get_width(shape);
+        int32 x = pieces[i].x + blit_shift_x;
+        int32 y = pieces[i].y + blit_shift_y;
+
+        if (shape_width <= max_shape_size)
+        {
+            mdjvu_image_add_bitmap(image, shape);
+            mdjvu_image_add_blit(image, x, y, shape);
+            mdjvu_image_set_suspiciously_big_flag(image, shape, big);
+        }
+        else
+        {
+            /* further split the bitmap */
+            int32 number_of_chunks = (shape_width + max_shape_size - 1)
+                                        /
+                                      max_shape_size;
+            int32 j;
+            int32 shape_height = mdjvu_bitmap_get_height(shape);
+            for (j = 0; j < number_of_chunks; j++)
             {
-                mdjvu_image_add_bitmap(image, bitmap);
-                mdjvu_image_add_blit(image, shift_x + min_x + blit_shift_x,
-                                            y + shift_y + blit_shift_y, bitmap);
-                mdjvu_image_set_suspiciously_big_flag(image, bitmap, big);
+                int32 chunk_x = shape_width * j / number_of_chunks;
+                mdjvu_bitmap_t chunk = mdjvu_bitmap_crop(shape,
+                  chunk_x, 0,
+                  shape_width * (j+1) / number_of_chunks - chunk_x,
+                  shape_height
+                );
+                /* After splitting, some white margins may be left,
+                 * or the bitmap may lose connectivity.
+                 * Apply the algorithm recursively to the chunk.
+                 */
+                add_to_image(image, chunk, dpi, opt,
+                             x + chunk_x, y, /* big: */ 1, /* smooth: */ 0);
+                mdjvu_bitmap_destroy(chunk);
             }
-            else
-            {
-                /* further split the bitmap */
-                int32 number_of_chunks = (shape_width + max_shape_width - 1)
-                                            /
-                                          max_shape_width;
-                int32 j;
-                int32 shape_height = mdjvu_bitmap_get_height(bitmap);
-                for (j = 0; j < number_of_chunks; j++)
-                {
-                    int32 chunk_x = shape_width * j / number_of_chunks;
-                    mdjvu_bitmap_t chunk = mdjvu_bitmap_crop(bitmap,
-                      chunk_x, 0,
-                      shape_width * (j+1) / number_of_chunks - chunk_x,
-                      shape_height
-                    );
-                    /* After splitting, some white margins may be left,
-                     * or the bitmap may lose connectivity.
-                     * Apply the algorithm recursively to the chunk.
-                     */
-                    add_to_image(image, chunk, dpi, opt,
-                                 shift_x + chunk_x + min_x + blit_shift_x,
-                                 y + shift_y + blit_shift_y, /* big: */ 1);
-                    mdjvu_bitmap_destroy(chunk);
-                }
-                mdjvu_bitmap_destroy(bitmap);
-            } /* if (shape_width <= max_shape_width) */
-        }
+            mdjvu_bitmap_destroy(shape);
+        } /* if (shape_width <= max_shape_size) */
     }
 }
 
-/* _________________________   the main routines   _________________________ */
-
-/* Not much job left to do here, mostly moving a window through the image. */
-
 static void add_to_image(mdjvu_image_t image,
                          mdjvu_bitmap_t bitmap,
                          int32 dpi,
                          mdjvu_split_options_t opt,
                          int32 blit_shift_x,
                          int32 blit_shift_y,
-                         int big)
+                         int big,
+                         int smooth)
 {
-    int32 max_shape_size = opt ? * (int32 *) opt : 0;
-    int32 width = mdjvu_bitmap_get_width(bitmap);
     int32 height = mdjvu_bitmap_get_height(bitmap);
-    unsigned char **buf, **window_base, **window_buf, **map;
-    int32 window_shift = 0, y = 0, i;
+    int32 max_shape_size = get_max_shape_size(opt, dpi, height);
+    Splitter s;
 
-    if (!max_shape_size)
-        max_shape_size = dpi;
-    if (max_shape_size > height)
-        max_shape_size = height;
+    splitter_init(&s, mdjvu_bitmap_get_width(bitmap), 0, height,
+                  max_shape_size);
+    split_rows(&s, bitmap, smooth);
+    add_pieces(image, s.pieces, s.piece_count, dpi, opt, max_shape_size,
+               blit_shift_x, blit_shift_y, big);
+    splitter_destroy(&s);
+}
 
-    /* n-th line will be unpacked into buf[n % max_shape_size] + 1.
-     * ( +1 is to make the left margin)
-     * buf[max_shape_size] will always be blank.
-     *
-     * window_base[window_shift - 1]
-     *      points to buf[max_shape_size] + 1 (blank line) - top margin
-     * window_base[window_shift + max_shape_size]
-     *      points to buf[max_shape_size] + 1 (blank line) - bottom margin
-     * window_base[window_shift + i]
-     *      points to buf[(window_shift + i) % max_shape_size] + 1.
-     */
+/* __________________________   splitting in bands   _______________________ */
+
+/* A page may be cut into bands of equal height that are split in parallel.
+ * A band doesn't know what's above or below it, so it leaves open
+ * the shapes and the white areas that touch its top or bottom row,
+ * and the shapes finished in such white areas. Nor does it know where
+ * the tops of the shapes are, so it cuts none: a shape it finishes
+ * taller than max_shape_size is split again (see add_shape()).
+ * Then the bands are stitched, and the result is just the same
+ * as splitting the whole page at once.
+ */
+
+typedef struct
+{
+    Splitter s;
+    mdjvu_bitmap_t bitmap;
+    int smooth;
+    int32 shape_base, white_base; /* the numbers of its records on the page */
+} Band;
+
+static void *split_band(void *arg)
+{
+    Band *band = (Band *) arg;
+    split_rows(&band->s, band->bitmap, band->smooth);
+    return NULL;
+}
+
+/* A shape or a white area of some band as seen by stitching.
+ * They are numbered over the page, band after band,
+ * so the smaller number still means the older one.
+ */
+typedef struct
+{
+    Splitter *s;        /* the band */
+    int32 i;            /* the record there */
+    int32 link;         /* as in union-find */
+    int32 other;        /* a shape: the white area above its first pixel;
+                         * a white area: the shape above its first pixel;
+                         * -1 if none */
+    int32 next, last;   /* the records joined to this root */
+    int32 first_inner, last_inner, next_inner; /* shapes put into its holes */
+} Record;
 
-    /* map has the right margin of 1 */
-    map = mdjvu_create_2d_array(width + 1, max_shape_size);
+static int32 record_root(Record *r, int32 i)
+{
+    while (r[i].link != i)
+        i = r[i].link = r[r[i].link].link;
+    return i;
+}
 
-    /* buf has left, right and bottom margins of 1 */
-    buf = mdjvu_create_2d_array(width + 2, max_shape_size + 1);
-    window_buf = (unsigned char **)
-        malloc(2 * (max_shape_size + 2) * sizeof(unsigned char *));
-    window_base = window_buf + 1;
+static Shape *shape_of(Record *r, int32 i)
+{
+    return &r[i].s->shapes[r[i].i];
+}
 
-    /* Unpack initial portion of the bitmap; bind the window to the buffer */
-    for (i = 0; i < max_shape_size; i++)
+static White *white_of(Record *r, int32 i)
+{
+    return &r[i].s->whites[r[i].i];
+}
+
+/* Make the root a the root of b too, keeping b in a's list. */
+static void append_record(Record *r, int32 a, int32 b)
+{
+    r[r[a].last].next = b;
+    r[a].last = r[b].last;
+    r[b].link = a;
+}
+
+/* Put the shape b into a hole of the root a, as close_white() does. */
+static void put_inner(Record *r, int32 a, int32 b)
+{
+    if (r[a].last_inner >= 0)
+        r[r[a].last_inner].next_inner = b;
+    else
+        r[a].first_inner = b;
+    r[a].last_inner = b;
+}
+
+/* Join two shapes across a cut; the older one is the root,
+ * as in merge_shapes().
+ */
+static void join_shapes(Record *r, int32 a, int32 b)
+{
+    Shape *sa, *sb;
+    a = record_root(r, a);
+    b = record_root(r, b);
+    if (a == b) return;
+    if (b < a) { int32 t = a; a = b; b = t; }
+    sa = shape_of(r, a);
+    sb = shape_of(r, b);
+    if (sb->min_x < sa->min_x) sa->min_x = sb->min_x;
+    if (sb->max_x > sa->max_x) sa->max_x = sb->max_x;
+    if (sb->bottom > sa->bottom) sa->bottom = sb->bottom;
+    append_record(r, a, b);
+}
+
+static void join_whites(Record *r, int32 a, int32 b)
+{
+    White *wa, *wb;
+    a = record_root(r, a);
+    b = record_root(r, b);
+    if (a == b) return;
+    if (b < a) { int32 t = a; a = b; b = t; }
+    wa = white_of(r, a);
+    wb = white_of(r, b);
+    wa->outside |= wb->outside;
+    if (wb->bottom > wa->bottom) wa->bottom = wb->bottom;
+    append_record(r, a, b);
+}
+
+/* Connect the last row of a band to the first row of the band below
+ * as splitter_add_row() would. A shape or a white area starting
+ * in the first row without joining anything above takes what's above
+ * its first pixel from the last row; `seen' marks the records met
+ * in the row, so that only their leftmost (first) segments count.
+ */
+static void stitch_cut(Record *shapes, Record *whites, Band *up, Band *down,
+                       char *seen_shapes, char *seen_whites)
+{
+    Splitter *u = &up->s, *d = &down->s;
+    int32 i, j, k, m;
+
+    for (i = j = k = 0; j < d->first_black_count; j++)
     {
-        window_base[i] = window_base[max_shape_size + i] = buf[i] + 1;
-        mdjvu_bitmap_unpack_row(bitmap, buf[i] + 1, i);
+        Segment *seg = &d->first_black[j];
+        int32 g = down->shape_base + shape_root(d, seg->label);
+        int joined = 0;
+
+        while (i < u->black_count && u->black[i].x1 <= seg->x0)
+            i++;
+        for (m = i; m < u->black_count && u->black[m].x0 < seg->x1; m++)
+        {
+            join_shapes(shapes, g,
+                        up->shape_base + shape_root(u, u->black[m].label));
+            joined = 1;
+        }
+
+        if (!joined && !seen_shapes[g])
+        {
+            while (k < u->white_count && u->white[k].x1 <= seg->x0) k++;
+            if (k < u->white_count && u->white[k].x0 <= seg->x0)
+                shapes[g].other = up->white_base
+                                + white_root(u, u->white[k].label);
+        }
+        seen_shapes[g] = 1;
     }
 
-    /* Setup top and bottom white margins */
-    window_base[-1] =
-        window_base[2 * max_shape_size - 1] =
-            buf[max_shape_size] + 1;
+    for (i = j = k = 0; j < d->first_white_count; j++)
+    {
+        Segment *seg = &d->first_white[j];
+        int32 g = down->white_base + white_root(d, seg->label);
+        int joined = 0;
 
-    /* The "window moving" loop.
-     * We're moving a (width x max_shape_size) window through the image.
-     */
-    while(1)
+        while (i < u->white_count && u->white[i].x1 < seg->x0)
+            i++;
+        for (m = i; m < u->white_count && u->white[m].x0 <= seg->x1; m++)
+        {
+            join_whites(whites, g,
+                        up->white_base + white_root(u, u->white[m].label));
+            joined = 1;
+        }
+
+        if (!joined && !seen_whites[g] && seg->x0 > 0)
+        {
+            while (u->black[k].x1 <= seg->x0) k++;
+            whites[g].other = up->shape_base
+                            + shape_root(u, u->black[k].label);
+        }
+        seen_whites[g] = 1;
+    }
+}
+
+/* What a shape finished in the white area w in the given row belongs to:
+ * the shape above the area if it's a hole that was not closed by then
+ * (see finish_shape() and close_white()), -1 if none.
+ * Only an open area may be a hole here; the bands decided the others.
+ */
+static int32 find_holder(Record *whites, int32 w, int32 bottom)
+{
+    White *wh;
+    if (w < 0) return -1;
+    w = record_root(whites, w);
+    wh = white_of(whites, w);
+    if (!wh->open || wh->outside || wh->bottom < bottom)
+        return -1;
+    return whites[w].other;
+}
+
+/* Draw a shape with all the records joined to it and the shapes
+ * from its holes into a bitmap that starts at (x, y).
+ */
+static void draw_record(Record *r, int32 g, mdjvu_bitmap_t bitmap,
+                        int32 x, int32 y)
+{
+    int32 k;
+    for (k = g; k >= 0; k = r[k].next)
+        draw_shape(r[k].s, r[k].i, bitmap, x, y);
+    for (k = r[g].first_inner; k >= 0; k = r[k].next_inner)
+        draw_record(r, k, bitmap, x, y);
+}
+
+/* Render a stitched shape as emit_shape() does
+ * and put it aside in the band where it starts.
+ */
+static void emit_record(Record *r, int32 g)
+{
+    Shape *sh = shape_of(r, g);
+    Splitter *s = r[g].s;
+    mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(sh->max_x - sh->min_x + 1,
+                                                sh->bottom - sh->top + 1);
+    Inner *inner = NULL;
+    int32 inner_count = 0, inner_allocated = 0, hole = 0, k;
+
+    if (sh->bottom - sh->top + 1 > s->max_shape_size)
+    {
+        for (k = g; k >= 0; k = r[k].next)
+        {
+            draw_inner(r[k].s, r[k].i, &hole,
+                       &inner, &inner_count, &inner_allocated);
+        }
+        for (k = r[g].first_inner; k >= 0; k = r[k].next_inner)
+        {
+            Shape *in = shape_of(r, k);
+            Piece *p;
+            GROW(inner, inner_count, inner_allocated, Inner);
+            inner[inner_count].hole = -1 - r[k].other; /* see stitch_bands() */
+            p = &inner[inner_count++].piece;
+            p->bitmap = mdjvu_bitmap_create(in->max_x - in->min_x + 1,
+                                            in->bottom - in->top + 1);
+            mdjvu_bitmap_clear(p->bitmap);
+            draw_record(r, k, p->bitmap, in->min_x, in->top);
+            p->x = in->min_x;
+            p->y = in->top;
+            p->first_x = in->first_x;
+        }
+        r[g].first_inner = r[g].last_inner = -1;
+    }
+    mdjvu_bitmap_clear(bitmap);
+    draw_record(r, g, bitmap, sh->min_x, sh->top);
+    add_shape(s, bitmap, sh->min_x, sh->top, sh->first_x, inner, inner_count);
+    free(inner);
+}
+
+/* Finish what the bands have left open. */
+static void stitch_bands(Band *bands, int n)
+{
+    int32 shape_total = 0, white_total = 0, unit_count = 0, i, k;
+    Record *shapes, *whites;
+    int32 *units, *holders;
+    char *seen;
+    int b;
+
+    for (b = 0; b < n; b++)
     {
-        /* Extract some shapes from the window
-         * (shapes touching the topmost row will be affected).
-         */
+        bands[b].shape_base = shape_total;
+        bands[b].white_base = white_total;
+        shape_total += bands[b].s.shape_count;
+        white_total += bands[b].s.white_count_total;
+    }
+    shapes = (Record *) malloc((shape_total + 1) * sizeof(Record));
+    whites = (Record *) malloc((white_total + 1) * sizeof(Record));
+    units = (int32 *) malloc(2 * (shape_total + 1) * sizeof(int32));
+    holders = units + shape_total + 1;
+    seen = (char *) calloc(shape_total + white_total + 1, 1);
 
-        unsigned char *top_margin_save =    /* make the top margin */
-            window_base[window_shift - 1];  /* (save what was there) */
-        unsigned char *bot_margin_save =    /* same with the bottom margin */
-            window_base[window_shift + max_shape_size];
-        int32 old_window_shift;
-        window_base[window_shift - 1] = buf[max_shape_size] + 1; /* clear them */
-        window_base[window_shift + max_shape_size] = buf[max_shape_size] + 1;
+    for (b = 0; b < n; b++)
+    {
+        Splitter *s = &bands[b].s;
+        for (i = 0; i < s->shape_count; i++)
+        {
+            Record *r = &shapes[bands[b].shape_base + i];
+            int32 white = s->shapes[i].white;
+            r->s = s;
+            r->i = i;
+            r->link = bands[b].shape_base + shape_root(s, i);
+            r->other = white < 0 ? -1
+                                 : bands[b].white_base + white_root(s, white);
+            r->next = r->first_inner = r->last_inner = r->next_inner = -1;
+            r->last = bands[b].shape_base + i;
+        }
+        for (i = 0; i < s->white_count_total; i++)
+        {
+            Record *r = &whites[bands[b].white_base + i];
+            int32 shape = s->whites[i].shape;
+            r->s = s;
+            r->i = i;
+            r->link = bands[b].white_base + white_root(s, i);
+            r->other = shape < 0 ? -1
+                                 : bands[b].shape_base + shape_root(s, shape);
+            r->next = r->first_inner = r->last_inner = r->next_inner = -1;
+            r->last = bands[b].white_base + i;
+        }
+    }
 
-        process_row(window_base + window_shift, map,
-                    /* index of a row to process: */ 0,
-                    width, max_shape_size, image, 0, y, max_shape_size,
-                    blit_shift_x, blit_shift_y, dpi, opt, big);
+    for (b = 0; b + 1 < n; b++)
+    {
+        stitch_cut(shapes, whites, &bands[b], &bands[b + 1],
+                   seen, seen + shape_total);
+    }
 
-        window_base[window_shift - 1] = top_margin_save; /* restore margins */
-        window_base[window_shift + max_shape_size] = bot_margin_save;
+    /* The shapes to finish are the open ones and the ones waiting
+     * in open white areas. Find what holds each of them first:
+     * whether an area is a hole doesn't change as they are put in.
+     */
+    for (b = 0; b < n; b++)
+    {
+        Splitter *s = &bands[b].s;
+        for (i = 0; i < s->shape_count; i++)
+        {
+            int32 g = bands[b].shape_base + i;
+            Shape *sh = &s->shapes[i];
+            if (!sh->open || sh->link != i || record_root(shapes, g) != g)
+                continue;
+            holders[unit_count] = find_holder(whites, shapes[g].other,
+                                              sh->bottom);
+            units[unit_count++] = g;
+        }
+        for (i = 0; i < s->white_count_total; i++)
+        {
+            White *w = &s->whites[i];
+            if (!w->open || w->link != i) continue;
+            for (k = w->first_held; k >= 0; k = s->shapes[k].next_held)
+            {
+                int32 g = bands[b].shape_base + k;
+                shapes[g].other = bands[b].white_base + i;
+                holders[unit_count] = find_holder(whites, shapes[g].other,
+                                                  s->shapes[k].bottom);
+                units[unit_count++] = g;
+            }
+        }
+    }
 
-        /* Shift the window */
-        y++;
-        old_window_shift = window_shift;
-        window_shift = y % max_shape_size;
-        if (y + max_shape_size > height)
-            break;
+    for (i = 0; i < unit_count; i++)
+    {
+        if (holders[i] < 0) continue;
+        /* the hole, to tell apart the shapes in different ones */
+        shapes[units[i]].other = record_root(whites, shapes[units[i]].other);
+        put_inner(shapes, record_root(shapes, holders[i]), units[i]);
+    }
+    for (i = 0; i < unit_count; i++)
+    {
+        if (holders[i] < 0)
+            emit_record(shapes, units[i]);
+    }
 
-        /* Unpack a new row into the bottom window row */
-        mdjvu_bitmap_unpack_row(bitmap, buf[old_window_shift] + 1,
-                                        y + max_shape_size - 1);
+    free(shapes);
+    free(whites);
+    free(units);
+    free(seen);
+}
+
+static void split_in_bands(mdjvu_image_t image, mdjvu_bitmap_t bitmap,
+                           int32 dpi, mdjvu_split_options_t opt, int nbands)
+{
+    int32 width = mdjvu_bitmap_get_width(bitmap);
+    int32 height = mdjvu_bitmap_get_height(bitmap);
+    int32 max_shape_size = get_max_shape_size(opt, dpi, height);
+    int smooth = get_smooth(opt, height);
+    Band *bands = (Band *) malloc(nbands * sizeof(Band));
+    Piece *pieces;
+    int32 piece_count = 0;
+    int i;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t *threads;
+    char *started;
+#endif
+
+    for (i = 0; i < nbands; i++)
+    {
+        splitter_init(&bands[i].s, width,
+                      (int32) ((double) height * i / nbands),
+                      (int32) ((double) height * (i + 1) / nbands),
+                      max_shape_size);
+        bands[i].s.open_top = i > 0;
+        bands[i].s.open_bottom = i < nbands - 1;
+        bands[i].bitmap = bitmap;
+        bands[i].smooth = smooth;
     }
 
-    /* Process the last window fully */
-    for (i = 0; y + i < height; i++)
+#ifdef HAVE_LIBPTHREAD
+    threads = (pthread_t *) malloc(nbands * sizeof(pthread_t));
+    started = (char *) malloc(nbands);
+    for (i = 1; i < nbands; i++)
+        started[i] = !pthread_create(&threads[i], NULL, split_band, &bands[i]);
+    split_band(&bands[0]);
+    for (i = 1; i < nbands; i++)
     {
-        process_row(window_base + window_shift, map,
-                    /* index of a row to process: */ i,
-                    width, max_shape_size, image, 0, y, max_shape_size,
-                    blit_shift_x, blit_shift_y, dpi, opt, big);
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            split_band(&bands[i]);
     }
+    free(threads);
+    free(started);
+#else
+    for (i = 0; i < nbands; i++)
+        split_band(&bands[i]);
+#endif
+
+    stitch_bands(bands, nbands);
 
-    /* Clean up */
-    free(window_buf);
-    mdjvu_destroy_2d_array(map);
-    mdjvu_destroy_2d_array(buf);
+    for (i = 0; i < nbands; i++)
+        piece_count += bands[i].s.piece_count;
+    pieces = (Piece *) malloc((piece_count + 1) * sizeof(Piece));
+    piece_count = 0;
+    for (i = 0; i < nbands; i++)
+    {
+        if (bands[i].s.piece_count)
+        {
+            memcpy(pieces + piece_count, bands[i].s.pieces,
+                   bands[i].s.piece_count * sizeof(Piece));
+            piece_count += bands[i].s.piece_count;
+        }
+        splitter_destroy(&bands[i].s);
+    }
+    add_pieces(image, pieces, piece_count, dpi, opt, max_shape_size,
+               0, 0, /* big: */ 0);
+    free(pieces);
+    free(bands);
 }
 
 mdjvu_image_t
@@ -401,9 +1639,67 @@ mdjvu_split(mdjvu_bitmap_t bitmap, int32 dpi, mdjvu_split_options_t opt)
 {
     int32 width = mdjvu_bitmap_get_width(bitmap);
     int32 height = mdjvu_bitmap_get_height(bitmap);
+    int nthreads = opt ? ((Options *) opt)->nthreads : 1;
     mdjvu_image_t result = mdjvu_image_create(width, height);
     mdjvu_image_enable_suspiciously_big_flags(result);
     mdjvu_image_set_resolution(result, dpi);
-    add_to_image(result, bitmap, dpi, opt, 0, 0, /* big: */ 0);
+    if (nthreads > 1 && height >= nthreads)
+        split_in_bands(result, bitmap, dpi, opt, nthreads);
+    else
+        add_to_image(result, bitmap, dpi, opt, 0, 0, /* big: */ 0,
+                     get_smooth(opt, height));
+    return result;
+}
+
+mdjvu_image_t mdjvu_split_stream(int32 width, int32 height, int32 dpi,
+                                 mdjvu_split_options_t opt,
+                                 int (*get_row)(void *param, int32 y,
+                                                unsigned char *row),
+                                 void *param)
+{
+    int32 max_shape_size = get_max_shape_size(opt, dpi, height);
+    int32 row_size = ((width + 7) >> 3) + 1;
+    unsigned char *row = (unsigned char *) malloc(2 * row_size);
+    unsigned char *smoothed = row + row_size;
+    mdjvu_smoother_t sm = NULL;
+    mdjvu_image_t result;
+    Splitter s;
+    int32 y, i;
+
+    if (get_smooth(opt, height))
+        sm = mdjvu_smoother_create(width);
+
+    splitter_init(&s, width, 0, height, max_shape_size);
+    for (y = 0; y < height; y++)
+    {
+        if (!get_row(param, y, row))
+        {
+            for (i = 0; i < s.piece_count; i++)
+                mdjvu_bitmap_destroy(s.pieces[i].bitmap);
+            splitter_destroy(&s);
+            if (sm) mdjvu_smoother_destroy(sm);
+            free(row);
+            return NULL;
+        }
+        if (!sm)
+            splitter_add_row(&s, row);
+        else if (mdjvu_smoother_push_row(sm, row, smoothed))
+            splitter_add_row(&s, smoothed); /* the row above */
+    }
+    if (sm)
+    {
+        mdjvu_smoother_push_row(sm, NULL, smoothed);
+        splitter_add_row(&s, smoothed);
+        mdjvu_smoother_destroy(sm);
+    }
+    splitter_finish(&s);
+    free(row);
+
+    result = mdjvu_image_create(width, height);
+    mdjvu_image_enable_suspiciously_big_flags(result);
+    mdjvu_image_set_resolution(result, dpi);
+    add_pieces(result, s.pieces, s.piece_count, dpi, opt, max_shape_size,
+               0, 0, /* big: */ 0);
+    splitter_destroy(&s);
     return result;
 }
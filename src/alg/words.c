@@ -0,0 +1,33 @@
+/*
+ * words.c - packed rows as 32-bit words
+ */
+
+#include "../base/mdjvucfg.h"
+#include <minidjvu/minidjvu.h>
+#include "words.h"
+
+void load_words(uint32 *words, const unsigned char *row, int32 width)
+{
+    int32 n = width >> 5, i;
+    int32 rest = ((width + 7) >> 3) - (n << 2);
+
+    for (i = 0; i < n; i++, row += 4)
+    {
+        words[i] = ((uint32) row[0] << 24) | ((uint32) row[1] << 16)
+                 | ((uint32) row[2] << 8) | row[3];
+    }
+    if (width & 31)
+    {
+        uint32 a = 0;
+        for (i = 0; i < rest; i++)
+            a |= (uint32) row[i] << (24 - (i << 3));
+        words[n] = a & ~(0xFFFFFFFF >> (width & 31));
+    }
+}
+
+void store_words(const uint32 *words, unsigned char *row, int32 width)
+{
+    int32 n = (width + 7) >> 3, i;
+    for (i = 0; i < n; i++)
+        row[i] = (unsigned char) (words[i >> 2] >> (24 - ((i & 3) << 3)));
+}
@@ -0,0 +1,20 @@
+/*
+ * words.h - packed rows as 32-bit words (for smooth.c and erosion.c)
+ */
+
+#ifndef MDJVU_ALG_WORDS_H
+#define MDJVU_ALG_WORDS_H
+
+/* Rows are processed 32 pixels at a time. A packed row is loaded into
+ * words with the leftmost pixel in the top bit; the bits past the row end
+ * are cleared. Callers keep a zero word on both sides of a loaded row,
+ * so that LEFT() and RIGHT() may look past its ends.
+ */
+void load_words(uint32 *words, const unsigned char *row, int32 width);
+void store_words(const uint32 *words, unsigned char *row, int32 width);
+
+/* The pixels to the left and to the right of each pixel in the word. */
+#define LEFT(W, I)  (((W)[I] >> 1) | ((W)[(I) - 1] << 31))
+#define RIGHT(W, I) (((W)[I] << 1) | ((W)[(I) + 1] >> 31))
+
+#endif /* MDJVU_ALG_WORDS_H */
@@ -11,6 +11,10 @@
 #include <locale.h>
 #endif
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 MDJVU_IMPLEMENT const char *mdjvu_check_sanity(void)
 {
     if (sizeof(int32) != 4)
@@ -29,14 +33,9 @@ MDJVU_IMPLEMENT const char *mdjvu_check_sanity(void)
 }
 
 
-static int initialized = 0;
-
-void mdjvu_init(void)
+static void initialize(void)
 {
     const char *sanity_error_message;
-    
-    if (initialized)
-        return;
 
     #ifdef HAVE_GETTEXT
         bindtextdomain("minidjvu", LOCALEDIR);
@@ -49,6 +48,28 @@ void mdjvu_init(void)
         fprintf(stderr, "%s\n", sanity_error_message);
         exit(1);
     }
+}
+
+/* Bitmaps may be created in several threads at once. */
+#ifdef HAVE_LIBPTHREAD
 
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+void mdjvu_init(void)
+{
+    pthread_once(&initialized, initialize);
+}
+
+#else
+
+static int initialized = 0;
+
+void mdjvu_init(void)
+{
+    if (initialized)
+        return;
+    initialize();
     initialized = 1;
 }
+
+#endif
@@ -8,6 +8,10 @@
 #include <string.h>
 #include <assert.h>
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 typedef struct
 {
     unsigned char **data;
@@ -18,6 +22,14 @@ typedef struct
 
 #ifndef NDEBUG
 int32 alive_bitmap_counter = 0;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t alive_bitmap_counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_COUNTER()   pthread_mutex_lock(&alive_bitmap_counter_mutex)
+#define UNLOCK_COUNTER() pthread_mutex_unlock(&alive_bitmap_counter_mutex)
+#else
+#define LOCK_COUNTER()
+#define UNLOCK_COUNTER()
+#endif
 #endif
 
 #define BYTES_PER_ROW(WIDTH) (((WIDTH) + 7) >> 3)
@@ -29,7 +41,9 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_bitmap_create(int32 width, int32 height)
     Bitmap *b = (Bitmap *) malloc(sizeof(Bitmap));
     mdjvu_init();
     #ifndef NDEBUG
+        LOCK_COUNTER();
         alive_bitmap_counter++;
+        UNLOCK_COUNTER();
     #endif
     b->width = width;
     b->height = height;
@@ -42,7 +56,9 @@ MDJVU_IMPLEMENT void mdjvu_bitmap_destroy(mdjvu_bitmap_t bmp)
 {
     Bitmap *b = (Bitmap *) bmp;
     #ifndef NDEBUG
+        LOCK_COUNTER();
         alive_bitmap_counter--;
+        UNLOCK_COUNTER();
     #endif
     mdjvu_destroy_2d_array(b->data);
     free(b);
@@ -128,72 +144,79 @@ MDJVU_IMPLEMENT void mdjvu_bitmap_clear(mdjvu_bitmap_t b)
 
 /* __________________________   packing/unpacking   ________________________ */
 
-/* All the functions in this part are, well, suboptimized. */
+/* Whole bytes are done eight pixels at once, without a loop over bits. */
 
 MDJVU_IMPLEMENT void mdjvu_bitmap_pack_row
     (mdjvu_bitmap_t b, unsigned char *bytes, int32 y)
 {
     unsigned char *bits = BMP->data[y];
-    int coef = 0x80;
+    int32 n = BMP->width >> 3, i;
     int a = 0; /* accumulates bits */
-    int32 i = BMP->width;
-    while (i--)
-    {
-        if (*bytes++) a |= coef;
 
-        coef >>= 1;
-        if (!coef)
-        {
-            coef = 0x80;
-            *bits++ = a;
-            a = 0;
-        }
+    for (i = 0; i < n; i++, bytes += 8)
+    {
+        bits[i] = (bytes[0] ? 0x80 : 0) | (bytes[1] ? 0x40 : 0)
+                | (bytes[2] ? 0x20 : 0) | (bytes[3] ? 0x10 : 0)
+                | (bytes[4] ? 0x08 : 0) | (bytes[5] ? 0x04 : 0)
+                | (bytes[6] ? 0x02 : 0) | (bytes[7] ? 0x01 : 0);
     }
 
-    if (BMP->width & 7) *bits = a;
+    if (BMP->width & 7)
+    {
+        int32 rest = BMP->width & 7;
+        for (i = 0; i < rest; i++)
+            if (bytes[i]) a |= 0x80 >> i;
+        bits[n] = a;
+    }
 }
 
-MDJVU_IMPLEMENT void mdjvu_bitmap_unpack_row
-    (mdjvu_bitmap_t b, unsigned char *bytes, int32 y)
+/* Unpacks a row, writing pixel & mask for each pixel
+ * (shifted down to 0 or 1 if `zero_or_one').
+ */
+static void unpack_row(Bitmap *bmp, unsigned char *bytes, int32 y,
+                       int zero_or_one)
 {
-    unsigned char *bits = BMP->data[y];
-    int coef = 0x80;
-    int a = *bits;
-    int32 i = BMP->width;
-    while (i--)
-    {
-        *bytes++ = a & coef;
+    unsigned char *bits = bmp->data[y];
+    int32 n = bmp->width >> 3, rest = bmp->width & 7, i;
 
-        coef >>= 1;
-        if (!coef)
+    if (zero_or_one)
+    {
+        for (i = 0; i < n; i++, bytes += 8)
         {
-            coef = 0x80;
-            if (!i) break; /* FIXME: this is not necessary, only to valgrind */
-            a = *++bits;
+            int a = bits[i];
+            bytes[0] = (a >> 7) & 1; bytes[1] = (a >> 6) & 1;
+            bytes[2] = (a >> 5) & 1; bytes[3] = (a >> 4) & 1;
+            bytes[4] = (a >> 3) & 1; bytes[5] = (a >> 2) & 1;
+            bytes[6] = (a >> 1) & 1; bytes[7] = a & 1;
         }
+        for (i = 0; i < rest; i++)
+            bytes[i] = (bits[n] >> (7 - i)) & 1;
+    }
+    else
+    {
+        for (i = 0; i < n; i++, bytes += 8)
+        {
+            int a = bits[i];
+            bytes[0] = a & 0x80; bytes[1] = a & 0x40;
+            bytes[2] = a & 0x20; bytes[3] = a & 0x10;
+            bytes[4] = a & 0x08; bytes[5] = a & 0x04;
+            bytes[6] = a & 0x02; bytes[7] = a & 0x01;
+        }
+        for (i = 0; i < rest; i++)
+            bytes[i] = bits[n] & (0x80 >> i);
     }
 }
 
-/* FIXME: this is almost a copy of the previous function */
-MDJVU_IMPLEMENT void mdjvu_bitmap_unpack_row_0_or_1
+MDJVU_IMPLEMENT void mdjvu_bitmap_unpack_row
     (mdjvu_bitmap_t b, unsigned char *bytes, int32 y)
 {
-    unsigned char *bits = BMP->data[y];
-    int coef = 0x80;
-    int a = *bits;
-    int32 i = BMP->width;
-    while (i--)
-    {
-        *bytes++ = a & coef ? 1 : 0;
+    unpack_row(BMP, bytes, y, 0);
+}
 
-        coef >>= 1;
-        if (!coef)
-        {
-            coef = 0x80;
-            if (!i) break; /* FIXME: this is not necessary, only to valgrind */
-            a = *++bits;
-        }
-    }
+MDJVU_IMPLEMENT void mdjvu_bitmap_unpack_row_0_or_1
+    (mdjvu_bitmap_t b, unsigned char *bytes, int32 y)
+{
+    unpack_row(BMP, bytes, y, 1);
 }
 
 MDJVU_IMPLEMENT void mdjvu_bitmap_pack_all
@@ -226,6 +249,138 @@ MDJVU_IMPLEMENT void mdjvu_bitmap_unpack_all_0_or_1
     }
 }
 
+/* __________________________   packed rows   ______________________________ */
+
+/* Pixels of packed rows are taken 8 at a time, shifted into place,
+ * and bytes are counted 4 at a time.
+ * Bits past the end of the given range are never read nor written
+ * (except for reading the rest of the last byte).
+ */
+
+/* Gets the 8 pixels starting from x (x > -8) of a row, where pixels
+ * from `end' on must not be read. Pixels outside of the row are garbage.
+ */
+static int get_8_pixels(const unsigned char *row, int32 x, int32 end)
+{
+    int32 i, shift;
+    int a;
+
+    if (x < 0) return row[0] >> -x;
+    i = x >> 3;
+    shift = x & 7;
+    a = row[i] << shift;
+    if (shift && ((i + 1) << 3) < end)
+        a |= row[i + 1] >> (8 - shift);
+    return a & 0xFF;
+}
+
+MDJVU_IMPLEMENT void mdjvu_packed_row_combine(unsigned char *dst, int32 dst_x,
+    const unsigned char *src, int32 src_x, int32 n, int op)
+{
+    int32 first, last, i;
+
+    if (n <= 0) return;
+    first = dst_x >> 3;
+    last = (dst_x + n - 1) >> 3;
+    for (i = first; i <= last; i++)
+    {
+        int32 lo = dst_x - (i << 3);     /* first pixel of the byte to touch */
+        int32 hi = dst_x + n - (i << 3); /* pixel past the last one */
+        int mask, a;
+
+        if (lo < 0) lo = 0;
+        if (hi > 8) hi = 8;
+        mask = (0xFF >> lo) & (0xFF << (8 - hi));
+        a = get_8_pixels(src, src_x + (i << 3) - dst_x, src_x + n) & mask;
+
+        switch (op)
+        {
+            case MDJVU_BITMAP_COPY: dst[i] = (dst[i] & ~mask) | a;    break;
+            case MDJVU_BITMAP_OR:   dst[i] |= a;                      break;
+            case MDJVU_BITMAP_AND:  dst[i] &= a | ~mask;              break;
+            case MDJVU_BITMAP_XOR:  dst[i] ^= a;                      break;
+            default: assert(0);
+        }
+    }
+}
+
+/* the number of set bits in a word (see "fortune -m BITCOUNT") */
+static int32 count_bits(uint32 x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_packed_row_get_mass(const unsigned char *row, int32 n)
+{
+    int32 bytes = n >> 3, i, m = 0;
+
+    for (i = 0; i + 4 <= bytes; i += 4)
+    {
+        m += count_bits(((uint32) row[i] << 24) | ((uint32) row[i + 1] << 16)
+                      | ((uint32) row[i + 2] << 8) | row[i + 3]);
+    }
+    for (; i < bytes; i++)
+        m += count_bits(row[i]);
+    if (n & 7)
+        m += count_bits(row[bytes] & (0xFF00 >> (n & 7)));
+    return m;
+}
+
+/* the leftmost and the rightmost set bits of a nonzero byte */
+static int first_bit(int a)
+{
+    int i = 0;
+    while (!(a & (0x80 >> i))) i++;
+    return i;
+}
+
+static int last_bit(int a)
+{
+    int i = 7;
+    while (!(a & (0x80 >> i))) i--;
+    return i;
+}
+
+MDJVU_IMPLEMENT int mdjvu_packed_row_get_extent
+    (const unsigned char *row, int32 n, int32 *left, int32 *right)
+{
+    int32 bytes = (n + 7) >> 3, l, r;
+    int tail_mask = n & 7 ? 0xFF00 >> (n & 7) : 0xFF;
+
+    if (!n) return 0;
+
+    /* the last byte is the only one with bits that don't count */
+    for (l = 0; l < bytes - 1 && !row[l]; l++) {}
+    if (l == bytes - 1 && !(row[l] & tail_mask)) return 0;
+
+    r = bytes - 1;
+    if (!(row[r] & tail_mask))
+        for (r--; !row[r]; r--) {}
+
+    *left = (l << 3) + first_bit(l == bytes - 1 ? row[l] & tail_mask : row[l]);
+    *right = (r << 3) + last_bit(r == bytes - 1 ? row[r] & tail_mask : row[r]);
+    return 1;
+}
+
+MDJVU_IMPLEMENT void mdjvu_bitmap_combine(mdjvu_bitmap_t b, mdjvu_bitmap_t src,
+                                          int32 x, int32 y, int op)
+{
+    Bitmap *s = (Bitmap *) src;
+    int32 sx = 0, sy = 0, w = s->width, h = s->height, i;
+
+    /* clip the source to the bitmap */
+    if (x < 0) { sx = -x; w += x; x = 0; }
+    if (y < 0) { sy = -y; h += y; y = 0; }
+    if (x + w > BMP->width) w = BMP->width - x;
+    if (y + h > BMP->height) h = BMP->height - y;
+
+    for (i = 0; i < h; i++)
+        mdjvu_packed_row_combine(BMP->data[y + i], x, s->data[sy + i], sx, w, op);
+}
+
 /* _______________________________   crop   ________________________________ */
 
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_bitmap_crop
@@ -238,8 +393,6 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_bitmap_crop
     else
     {
         mdjvu_bitmap_t result;
-        int32 i = top, count = h;
-        unsigned char *buf;
 
         assert(left >= 0);
         assert(left + w <= BMP->width);
@@ -247,14 +400,8 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_bitmap_crop
         assert(top + h <= BMP->height);
 
         result = mdjvu_bitmap_create(w, h);
-        buf = (unsigned char *) malloc(BMP->width);
-        while (count--)
-        {
-            mdjvu_bitmap_unpack_row(b, buf, i);
-            mdjvu_bitmap_pack_row(result, buf + left, i - top);
-            i++;
-        }
-        free(buf);
+        mdjvu_bitmap_clear(result); /* so the bits past the width are 0 */
+        mdjvu_bitmap_combine(result, b, -left, -top, MDJVU_BITMAP_COPY);
         return result;
     }
 }
@@ -276,40 +423,69 @@ static int row_is_empty(Bitmap *bmp, int32 y)
     return 1;
 }
 
-static int column_is_empty(Bitmap *bmp, int32 x)
+static int column_is_empty(Bitmap *bmp, int32 x, int32 top, int32 bottom)
 {
-    int32 byte_offset = x >> 3;
-    int mask = 1 << (7 - (x & 7));
-    int32 bytes_per_row = BYTES_PER_ROW(bmp->width);
-    unsigned char *p = bmp->data[0] + byte_offset;
-    int32 i = bmp->height;
-
-    while(i--)
-    {
-        if (*p & mask) return 0;
-        p += bytes_per_row;
-    }
+    int mask = 0x80 >> (x & 7);
+    int32 y;
 
+    for (y = top; y <= bottom; y++)
+        if (bmp->data[y][x >> 3] & mask) return 0;
     return 1;
 }
 
+/* An empty bitmap gets a 1x1 box in the corner.
+ * Most bitmaps have no margins, and that is checked first.
+ * Otherwise rows are scanned from the top and the bottom to the first
+ * black pixels, and the rows between are scanned word by word
+ * until the box spans the width.
+ */
 MDJVU_IMPLEMENT void mdjvu_bitmap_get_bounding_box(mdjvu_bitmap_t b,
     int32 *pl, int32 *pt, int32 *pw, int32 *ph)
 {
-    int32 right = BMP->width - 1;
-    int32 left = 0;
-    int32 bottom = BMP->height - 1;
-    int32 top = 0;
+    int32 w = BMP->width, h = BMP->height;
+    int32 left = 0, right = 0, top, bottom, l, r, y;
 
-    while (column_is_empty(BMP, right) && right) right--;
-    while (column_is_empty(BMP, left) && left < right) left++;
+    if (!row_is_empty(BMP, 0) && !row_is_empty(BMP, h - 1)
+     && !column_is_empty(BMP, 0, 0, h - 1)
+     && !column_is_empty(BMP, w - 1, 0, h - 1))
+    {
+        *pl = *pt = 0;
+        *pw = w;
+        *ph = h;
+        return;
+    }
 
-    *pl = left;
-    *pw = right - left + 1;
+    for (top = 0; top < h; top++)
+        if (mdjvu_packed_row_get_extent(BMP->data[top], w, &left, &right)) break;
+
+    if (top == h)
+    {
+        *pl = *pt = 0;
+        *pw = *ph = 1;
+        return;
+    }
+
+    for (bottom = h - 1; bottom > top; bottom--)
+        if (mdjvu_packed_row_get_extent(BMP->data[bottom], w, &l, &r)) break;
 
-    while (row_is_empty(BMP, bottom) && bottom) bottom--;
-    while (row_is_empty(BMP, top) && top < bottom) top++;
+    if (bottom > top)
+    {
+        if (l < left) left = l;
+        if (r > right) right = r;
+    }
 
+    if (!column_is_empty(BMP, 0, top, bottom)) left = 0;
+    if (!column_is_empty(BMP, w - 1, top, bottom)) right = w - 1;
+
+    for (y = top + 1; y < bottom && (left > 0 || right < w - 1); y++)
+    {
+        if (!mdjvu_packed_row_get_extent(BMP->data[y], w, &l, &r)) continue;
+        if (l < left) left = l;
+        if (r > right) right = r;
+    }
+
+    *pl = left;
+    *pw = right - left + 1;
     *pt = top;
     *ph = bottom - top + 1;
 }
@@ -329,24 +505,48 @@ MDJVU_IMPLEMENT void mdjvu_bitmap_remove_margins
 
 /* _______________________________   misc   ________________________________ */
 
-/* This is a sub-optimal way to count mass.
- * Run "fortune -m BITCOUNT" to see a better way...
- */
 MDJVU_IMPLEMENT int32 mdjvu_bitmap_get_mass(mdjvu_bitmap_t b)
 {
-    int32 m = 0;
-    int32 w = BMP->width;
-    int32 h = BMP->height;
-    unsigned char *buf = (unsigned char *) malloc(w);
-    int32 y;
+    int32 m = 0, y;
+    for (y = 0; y < BMP->height; y++)
+        m += mdjvu_packed_row_get_mass(BMP->data[y], BMP->width);
+    return m;
+}
+
+/* the last byte of a packed row with the bits past the width cleared */
+#define LAST_BYTE(ROW) ((ROW)[ROW_SIZE - 1] & (0xFF00 >> (((BMP->width - 1) & 7) + 1)))
+
+MDJVU_IMPLEMENT uint32 mdjvu_bitmap_get_hash(mdjvu_bitmap_t b)
+{
+    int32 w = BMP->width, h = BMP->height, n = ROW_SIZE;
+    uint32 hash = 2166136261U; /* FNV-1a */
+    int32 x, y;
+
+    hash = (hash ^ (uint32) w) * 16777619U;
+    hash = (hash ^ (uint32) h) * 16777619U;
+    if (!w) return hash;
     for (y = 0; y < h; y++)
     {
-        int x;
-        mdjvu_bitmap_unpack_row_0_or_1(b, buf, y);
-        for (x = 0; x < w; x++)
-            m += buf[x];
+        unsigned char *row = BMP->data[y];
+        for (x = 0; x < n - 1; x++)
+            hash = (hash ^ row[x]) * 16777619U;
+        hash = (hash ^ LAST_BYTE(row)) * 16777619U;
     }
-    free(buf);
-    return m;
+    return hash;
 }
 
+MDJVU_IMPLEMENT int mdjvu_bitmap_equal(mdjvu_bitmap_t b, mdjvu_bitmap_t other)
+{
+    Bitmap *o = (Bitmap *) other;
+    int32 n = ROW_SIZE, y;
+
+    if (BMP->width != o->width || BMP->height != o->height) return 0;
+    if (!BMP->width) return 1;
+    for (y = 0; y < BMP->height; y++)
+    {
+        unsigned char *r1 = BMP->data[y], *r2 = o->data[y];
+        if (memcmp(r1, r2, n - 1) || LAST_BYTE(r1) != LAST_BYTE(r2))
+            return 0;
+    }
+    return 1;
+}
@@ -178,6 +178,27 @@ static void invert_row(unsigned char *row, int32 bytes_per_row, int32 w)
         row[bytes_per_row - 1] &= ~(0xFF >> (w & 7));
 }
 
+#define FFs 0xFFFFFF
+/* Read and check the header of a monochrome BMP; 1 - success, 0 - failure.
+ * The pixel rows follow it, from the bottom one.
+ */
+static int read_1bit_bmp_header(FILE *f, Header *header, int *invert)
+{
+    if (fgetc(f) != 'B' || fgetc(f) != 'M') return 0;
+    read_bmp_header(f, header);
+    if (header->compression != 0) return 0;
+    if (header->planes != 1) return 0;
+    if (header->bits != 1) return 0;
+    if (!(((header->color_0 & FFs) == 0 && (header->color_1 & FFs) == FFs) ||
+          ((header->color_1 & FFs) == 0 && (header->color_0 & FFs) == FFs )))
+    {
+        return 0;
+    }
+
+    *invert = (header->color_0 & FFs) == 0;
+    return 1;
+}
+
 #define CHECK(X) \
 { \
     if (!(X)) \
@@ -186,7 +207,6 @@ static void invert_row(unsigned char *row, int32 bytes_per_row, int32 w)
         return NULL; \
     } \
 }
-#define FFs 0xFFFFFF
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t file, mdjvu_error_t *perr)
 {
     FILE *f = (FILE *) file;
@@ -198,16 +218,8 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t file, mdjvu_erro
 
     if (perr) *perr = NULL;
 
-    CHECK(fgetc(f)=='B');
-    CHECK(fgetc(f)=='M');
-    read_bmp_header(f, &header);
-    CHECK(header.compression == 0);
-    CHECK(header.planes == 1);
-    CHECK(header.bits == 1);
-    CHECK(((header.color_0 & FFs) == 0 && (header.color_1 & FFs) == FFs) ||
-          ((header.color_1 & FFs) == 0 && (header.color_0 & FFs) == FFs ));
+    CHECK(read_1bit_bmp_header(f, &header, &invert));
 
-    invert = (header.color_0 & FFs) == 0;
     w = header.width;
     h = header.height;
     result = mdjvu_bitmap_create(w, h);
@@ -248,3 +260,64 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_bmp(const char *path, mdjvu_error_t *p
     fclose(f);
     return result;
 }
+
+typedef struct
+{
+    FILE *file;
+    long data_offset;
+    int32 height, DIB_row_size, bytes_per_row, width;
+    int invert;
+} RowReader;
+
+/* The rows are stored bottom-up, so seek to each of them. */
+static int load_bmp_row(void *param, int32 y, unsigned char *row)
+{
+    RowReader *r = (RowReader *) param;
+    long offset = r->data_offset + (long) (r->height - 1 - y) * r->DIB_row_size;
+
+    if (fseek(r->file, offset, SEEK_SET) != 0) return 0;
+    if (fread(row, r->bytes_per_row, 1, r->file) != 1) return 0;
+    if (r->invert)
+        invert_row(row, r->bytes_per_row, r->width);
+    return 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_split_bmp(mdjvu_file_t file, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr)
+{
+    RowReader r;
+    Header header;
+    mdjvu_image_t result;
+
+    if (perr) *perr = NULL;
+
+    r.file = (FILE *) file;
+    CHECK(read_1bit_bmp_header(r.file, &header, &r.invert));
+    r.data_offset = ftell(r.file);
+    r.width = header.width;
+    r.height = header.height;
+    r.DIB_row_size = ((r.width + 31) & ~31) >> 3; /* padding to 32 bit */
+    r.bytes_per_row = (r.width + 7) >> 3;
+
+    result = mdjvu_split_stream(r.width, r.height, dpi, opt, &load_bmp_row, &r);
+    if (!result)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return NULL;
+    }
+    return result;
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_split_bmp(const char *path, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr)
+{
+    FILE *f = fopen(path, "rb");
+    mdjvu_image_t result;
+    if (!f)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+    if (perr) *perr = NULL;
+    result = mdjvu_file_split_bmp((mdjvu_file_t) f, dpi, opt, perr);
+    fclose(f);
+    return result;
+}
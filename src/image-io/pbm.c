@@ -80,6 +80,54 @@ MDJVU_IMPLEMENT int mdjvu_file_save_pbm(mdjvu_bitmap_t b, mdjvu_file_t f, mdjvu_
     return 1;
 }
 
+typedef struct
+{
+    FILE *file;
+    int32 bytes_per_row;
+} RowWriter;
+
+static int save_pbm_row(void *param, int32 y, unsigned char *row)
+{
+    RowWriter *w = (RowWriter *) param;
+    return fwrite(row, w->bytes_per_row, 1, w->file) == 1;
+}
+
+MDJVU_IMPLEMENT int mdjvu_save_rendered_pbm(mdjvu_image_t image, const char *path, mdjvu_error_t *perr)
+{
+    FILE *file = fopen(path, "wb");
+    int result;
+    if (perr) *perr = NULL;
+    if (!file)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return 0;
+    }
+    result = mdjvu_file_save_rendered_pbm(image, (mdjvu_file_t) file, perr);
+    fclose(file);
+    return result;
+}
+
+MDJVU_IMPLEMENT int mdjvu_file_save_rendered_pbm(mdjvu_image_t image, mdjvu_file_t f, mdjvu_error_t *perr)
+{
+    RowWriter w;
+    int32 width = mdjvu_image_get_width(image);
+    int32 height = mdjvu_image_get_height(image);
+
+    if (perr) *perr = NULL;
+
+    w.file = (FILE *) f;
+    w.bytes_per_row = (width + 7) >> 3;
+    fprintf(w.file, "P4\n"MDJVU_INT32_FORMAT" "MDJVU_INT32_FORMAT"\n",
+            width, height);
+
+    if (!mdjvu_render_band(image, 0, height, &save_pbm_row, &w))
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return 0;
+    }
+    return 1;
+}
+
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *perr)
 {
     FILE *file = fopen(path, "rb");
@@ -95,34 +143,40 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *p
     return result;
 }
 
-#define COMPLAIN \
-{ \
-    if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_pbm); \
-    return NULL; \
-}
-MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t f, mdjvu_error_t *perr)
+/* Read the PBM header up to the first row; 1 - success, 0 - failure. */
+static int read_pbm_header(FILE *file, int32 *width, int32 *height)
 {
-    FILE *file = (FILE *) f;
-    int32 width, height, bytes_per_row, i;
-    mdjvu_bitmap_t result;
-    if (perr) *perr = NULL;
-    if (fgetc(file) != 'P') COMPLAIN;
-    if (fgetc(file) != '4') COMPLAIN;
+    if (fgetc(file) != 'P') return 0;
+    if (fgetc(file) != '4') return 0;
     mdjvu_skip_pbm_whitespace_and_comments((mdjvu_file_t) file);
     if (fscanf(file,
-        MDJVU_INT32_FORMAT" "MDJVU_INT32_FORMAT, &width, &height) != 2)
+        MDJVU_INT32_FORMAT" "MDJVU_INT32_FORMAT, width, height) != 2)
     {
-        COMPLAIN;
+        return 0;
     }
 
     /* a fancy way to write if ( || || || ) - maybe, abandon this switch? */
     switch(fgetc(file))
     {
         case ' ': case '\t': case '\r': case '\n':
-            break;
+            return 1;
         default:
-            COMPLAIN;
+            return 0;
     }
+}
+
+#define COMPLAIN \
+{ \
+    if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_pbm); \
+    return NULL; \
+}
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t f, mdjvu_error_t *perr)
+{
+    FILE *file = (FILE *) f;
+    int32 width, height, bytes_per_row, i;
+    mdjvu_bitmap_t result;
+    if (perr) *perr = NULL;
+    if (!read_pbm_header(file, &width, &height)) COMPLAIN;
 
     result = mdjvu_bitmap_create(width, height);
     bytes_per_row = mdjvu_bitmap_get_packed_row_size(result);
@@ -137,3 +191,45 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t f, mdjvu_error_t
     }
     return result;
 }
+
+typedef struct
+{
+    FILE *file;
+    int32 bytes_per_row;
+} RowReader;
+
+static int load_pbm_row(void *param, int32 y, unsigned char *row)
+{
+    RowReader *r = (RowReader *) param;
+    return fread(row, r->bytes_per_row, 1, r->file) == 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_split_pbm(const char *path, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr)
+{
+    FILE *file = fopen(path, "rb");
+    mdjvu_image_t result;
+    if (perr) *perr = NULL;
+    if (!file)
+    {
+        if(perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+    result = mdjvu_file_split_pbm((mdjvu_file_t) file, dpi, opt, perr);
+    fclose(file);
+    return result;
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_split_pbm(mdjvu_file_t f, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr)
+{
+    RowReader r;
+    int32 width, height;
+    mdjvu_image_t result;
+    if (perr) *perr = NULL;
+    r.file = (FILE *) f;
+    if (!read_pbm_header(r.file, &width, &height)) COMPLAIN;
+
+    r.bytes_per_row = (width + 7) >> 3;
+    result = mdjvu_split_stream(width, height, dpi, opt, &load_pbm_row, &r);
+    if (!result) COMPLAIN;
+    return result;
+}
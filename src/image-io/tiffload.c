@@ -15,15 +15,20 @@
 
 #ifdef HAVE_LIBTIFF
 
-static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_error_t *perr, uint32 idx)
+typedef struct
 {
+    TIFF *tiff;
+    uint32 width, height;
     uint16 photometric;
-    uint32 w, h;
-    uint16 bits_per_sample = 0, samples_per_pixel = 0;
-    float dpi;
-    mdjvu_bitmap_t result;
     tsize_t scanline_size;
     unsigned char *scanline;
+} Reader;
+
+/* Open the page and read its header; 1 - success, 0 - failure. */
+static int open_reader(Reader *r, const char *path, int32 *presolution, mdjvu_error_t *perr, uint32 idx)
+{
+    uint16 bits_per_sample = 0, samples_per_pixel = 0;
+    float dpi;
     uint32 i;
 
     TIFF *tiff = TIFFOpen(path, "r");
@@ -37,7 +42,8 @@ static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_erro
     if (!tiff || i<idx)
     {
         *perr = mdjvu_get_error(mdjvu_error_fopen_read);
-        return NULL;
+        if (tiff) TIFFClose(tiff);
+        return 0;
     }
 
     /* test if bitonal */
@@ -47,20 +53,20 @@ static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_erro
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
         TIFFClose(tiff);
-        return NULL;
+        return 0;
     }
 
     /* photometric */
-    photometric = PHOTOMETRIC_MINISWHITE;
-    TIFFGetFieldDefaulted(tiff, TIFFTAG_PHOTOMETRIC, &photometric);
+    r->photometric = PHOTOMETRIC_MINISWHITE;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PHOTOMETRIC, &r->photometric);
 
     /* image size */
-    if (!TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGEWIDTH, &w)
-     || !TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGELENGTH, &h))
+    if (!TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGEWIDTH, &r->width)
+     || !TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGELENGTH, &r->height))
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
         TIFFClose(tiff);
-        return NULL;
+        return 0;
     }
 
     /* get the resolution */
@@ -69,52 +75,92 @@ static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_erro
         *presolution = (int32) dpi;
     }
 
-    result = mdjvu_bitmap_create(w, h);
-
-    scanline_size = TIFFScanlineSize(tiff);
+    r->scanline_size = TIFFScanlineSize(tiff);
 
-    if (scanline_size < mdjvu_bitmap_get_packed_row_size(result))
+    if (r->scanline_size < (tsize_t) ((r->width + 7) >> 3))
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
         TIFFClose(tiff);
-        mdjvu_bitmap_destroy(result);
-        return NULL;
+        return 0;
     }
 
-    scanline = (unsigned char *) malloc(scanline_size);
+    r->tiff = tiff;
+    r->scanline = (unsigned char *) malloc(r->scanline_size);
+    return 1;
+}
+
+/* Read the next row into a packed row; 1 - success, 0 - failure. */
+static int read_row(void *param, int32 y, unsigned char *row)
+{
+    Reader *r = (Reader *) param;
+
+    if (TIFFReadScanline(r->tiff, (tdata_t)r->scanline, y, 0) < 0)
+        return 0;
 
-    for (i = 0; i < h; i++)
+    if (r->photometric != PHOTOMETRIC_MINISWHITE)
     {
-        if (TIFFReadScanline(tiff, (tdata_t)scanline, i, 0) < 0)
+        /* invert the row */
+        int32 k;
+        int32 s = (int32) r->scanline_size;
+        for (k = 0; k < s; k++)
+            r->scanline[k] = ~r->scanline[k];
+    }
+
+    /* clear the padding bits */
+    if (r->width & 7)
+        r->scanline[r->scanline_size - 1] &= ~(0xFF >> (r->width & 7));
+
+    memcpy(row, r->scanline, (r->width + 7) >> 3);
+    return 1;
+}
+
+static void close_reader(Reader *r)
+{
+    free(r->scanline);
+    TIFFClose(r->tiff);
+}
+
+static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_error_t *perr, uint32 idx)
+{
+    Reader r;
+    mdjvu_bitmap_t result;
+    uint32 i;
+
+    if (!open_reader(&r, path, presolution, perr, idx))
+        return NULL;
+
+    result = mdjvu_bitmap_create(r.width, r.height);
+
+    for (i = 0; i < r.height; i++)
+    {
+        if (!read_row(&r, i, mdjvu_bitmap_access_packed_row(result, i)))
         {
             *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
-            TIFFClose(tiff);
-            free(scanline);
+            close_reader(&r);
             mdjvu_bitmap_destroy(result);
             return NULL;
         }
+    }
 
-        if (photometric != PHOTOMETRIC_MINISWHITE)
-        {
-            /* invert the row */
-            int32 k;
-            int32 s = (int32) scanline_size;
-            for (k = 0; k < s; k++)
-                scanline[k] = ~scanline[k];
-        }
+    close_reader(&r);
+    return result;
+}
 
-        /* clear the padding bits */
-        if (w & 7)
-            scanline[scanline_size - 1] &= ~(0xFF >> (w & 7));
+static mdjvu_image_t split_tiff(const char *path, int32 *presolution, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr, uint32 idx)
+{
+    Reader r;
+    mdjvu_image_t result;
 
-        memcpy(mdjvu_bitmap_access_packed_row(result, i),
-               scanline,
-               mdjvu_bitmap_get_packed_row_size(result));
-    }
+    if (!open_reader(&r, path, presolution, perr, idx))
+        return NULL;
+    if (presolution)
+        dpi = *presolution;
 
-    free(scanline);
+    result = mdjvu_split_stream(r.width, r.height, dpi, opt, &read_row, &r);
+    if (!result)
+        *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
 
-    TIFFClose(tiff);
+    close_reader(&r);
     return result;
 }
 
@@ -145,3 +191,13 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_tiff(const char *path, int32 *presolut
         return NULL;
     #endif
 }
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_split_tiff(const char *path, int32 *presolution, int32 dpi, mdjvu_split_options_t opt, mdjvu_error_t *perr, uint32 idx)
+{
+    #ifdef HAVE_LIBTIFF
+        return split_tiff(path, presolution, dpi, opt, perr, idx);
+    #else
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return NULL;
+    #endif
+}
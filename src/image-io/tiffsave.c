@@ -17,12 +17,10 @@
     #define COMPRESSION_PACKBITS 32771
 #endif
 
-static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *perr)
+/* Open a TIFF file for writing a w x h bitmap; NULL if failed */
+static TIFF *open_tiff(int32 w, int32 h, const char *path, mdjvu_error_t *perr)
 {
-    int32 w = mdjvu_bitmap_get_width(bitmap);
-    int32 h = mdjvu_bitmap_get_height(bitmap);
     int32 compression = COMPRESSION_NONE;
-    int32 i;
     TIFF * tiff;
 
     *perr = NULL;
@@ -35,7 +33,7 @@ static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *per
     if (!tiff)
     {
         *perr = mdjvu_get_error(mdjvu_error_fopen_write);
-        return 0;
+        return NULL;
     }
 
     /* FIXME: save resolution */
@@ -47,13 +45,25 @@ static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *per
     TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
     TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
 
-    if (mdjvu_bitmap_get_packed_row_size(bitmap) != TIFFScanlineSize(tiff))
+    if (((w + 7) >> 3) != TIFFScanlineSize(tiff))
     {
         /* FIXME: not very accurate error reporting */
         *perr = mdjvu_get_error(mdjvu_error_fopen_write);
-        return 0;
+        TIFFClose(tiff);
+        return NULL;
     }
 
+    return tiff;
+}
+
+static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *perr)
+{
+    int32 h = mdjvu_bitmap_get_height(bitmap);
+    int32 i;
+    TIFF * tiff = open_tiff(mdjvu_bitmap_get_width(bitmap), h, path, perr);
+
+    if (!tiff) return 0;
+
     for (i = 0; i < h; i++)
         TIFFWriteScanline(tiff,
                           mdjvu_bitmap_access_packed_row(bitmap, i), i,
@@ -64,6 +74,28 @@ static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *per
     return 1;
 }
 
+static int save_tiff_row(void *param, int32 y, unsigned char *row)
+{
+    return TIFFWriteScanline((TIFF *) param, row, (uint32) y, 0) != -1;
+}
+
+static int save_rendered_tiff(mdjvu_image_t image, const char *path, mdjvu_error_t *perr)
+{
+    int32 h = mdjvu_image_get_height(image);
+    TIFF * tiff = open_tiff(mdjvu_image_get_width(image), h, path, perr);
+    int result;
+
+    if (!tiff) return 0;
+
+    result = mdjvu_render_band(image, 0, h, &save_tiff_row, tiff);
+    if (!result)
+        *perr = mdjvu_get_error(mdjvu_error_io);
+
+    TIFFClose(tiff);
+
+    return result;
+}
+
 #endif /* HAVE_LIBTIFF */
 
 MDJVU_IMPLEMENT int mdjvu_save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *perr)
@@ -75,3 +107,13 @@ MDJVU_IMPLEMENT int mdjvu_save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdj
         return 0;
     #endif
 }
+
+MDJVU_IMPLEMENT int mdjvu_save_rendered_tiff(mdjvu_image_t image, const char *path, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        return save_rendered_tiff(image, path, perr);
+    #else
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return 0;
+    #endif
+}
@@ -6,89 +6,417 @@
 #include <minidjvu/minidjvu.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_LIBPTHREAD
+    #include <pthread.h>
+#endif
 
 #define THRESHOLD 21
 
 static const int32 bigint = INT32_MAX / 100 - 1;
 
-/* THIS THING IS THE PRIMARY BOTTLENECK FOR LOSSLESS COMPRESSION
- * TODO: OPTIMIZE IT!
+/* Bitmaps are compared in a packed form, 32 pixels to a word,
+ * the most significant bit being the leftmost one.
+ * Pixel x of a row is stored as bit x + 1, so the row can be shifted
+ * by one pixel either way without losing anything.
+ */
+typedef struct
+{
+    int32 width, height;
+    int32 words_per_row;
+    uint32 *data;
+} PackedBitmap;
+
+/* The number of words to pack a bitmap of the given size. */
+static int32 packed_size(int32 w, int32 h)
+{
+    return ((w + 2 + 31) >> 5) * h; /* the margin bit and a bit to shift into */
+}
+
+/* `data' should be zeroed and have packed_size(w, h) words. */
+static void pack_bitmap(PackedBitmap *p, mdjvu_bitmap_t b, uint32 *data)
+{
+    int32 w = mdjvu_bitmap_get_width(b);
+    int32 h = mdjvu_bitmap_get_height(b);
+    int32 bytes_per_row = mdjvu_bitmap_get_packed_row_size(b);
+    int32 wpr = (w + 2 + 31) >> 5;
+    unsigned char last_mask = (unsigned char) (0xFF << ((8 - (w & 7)) & 7));
+    int32 x, y;
+
+    p->width = w;
+    p->height = h;
+    p->words_per_row = wpr;
+    p->data = data;
+
+    for (y = 0; y < h; y++)
+    {
+        unsigned char *bytes = mdjvu_bitmap_access_packed_row(b, y);
+        uint32 *row = p->data + y * wpr;
+        for (x = 0; x < bytes_per_row; x++)
+        {
+            uint32 v = bytes[x];
+            int32 pos = (x << 3) + 1;
+            int32 k = pos >> 5, off = pos & 31;
+            if (x == bytes_per_row - 1) v &= last_mask;
+            if (!v) continue;
+            if (off <= 24)
+                row[k] |= v << (24 - off);
+            else
+            {
+                row[k] |= v >> (off - 24);
+                row[k + 1] |= v << (56 - off);
+            }
+        }
+    }
+}
+
+static int32 popcount(uint32 x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (int32) ((x * 0x01010101) >> 24);
+}
+
+/* Count different pixels in two rows, the image being shifted by shift_x
+ * (-1, 0 or 1) pixels to the right. Either row may be NULL (blank).
+ */
+static int32 row_diff(const uint32 *ir, int32 iwords,
+                      const uint32 *pr, int32 pwords,
+                      int32 shift_x)
+{
+    int32 n = iwords > pwords ? iwords : pwords;
+    int32 k, s = 0;
+
+    if (!ir) iwords = 0;
+    if (!pr) pwords = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        uint32 a = k < iwords ? ir[k] : 0;
+        uint32 b = k < pwords ? pr[k] : 0;
+
+        if (shift_x > 0)
+        {
+            a >>= 1;
+            if (k > 0 && k <= iwords) a |= ir[k - 1] << 31;
+        }
+        else if (shift_x < 0)
+        {
+            a <<= 1;
+            if (k + 1 < iwords) a |= ir[k + 1] >> 31;
+        }
+
+        s += popcount(a ^ b);
+    }
+    return s;
+}
+
+/* Count pixels that differ when the centers of the bitmaps are aligned.
+ * This is the bottleneck of lossless compression, so rows are XORed
+ * a word at a time.
  * ceiling is an optimization - if we have more, quit
  */
-static int diff(mdjvu_bitmap_t image,
-                mdjvu_bitmap_t prototype,
-                unsigned char **image_uncompressed,
-                unsigned char **proto_uncompressed,
-                int32 ceiling)
-{
-    int32 pw = mdjvu_bitmap_get_width (prototype);
-    int32 ph = mdjvu_bitmap_get_height(prototype);
-    int32 iw = mdjvu_bitmap_get_width (image);
-    int32 ih = mdjvu_bitmap_get_height(image);
+static int32 diff(PackedBitmap *image, PackedBitmap *prototype, int32 ceiling)
+{
+    int32 pw = prototype->width;
+    int32 ph = prototype->height;
+    int32 iw = image->width;
+    int32 ih = image->height;
+    int32 iwords = image->words_per_row;
+    int32 pwords = prototype->words_per_row;
     int32 shift_x, shift_y;
-    int32 s = 0, i, n = pw + 2;
-    unsigned char *ir;
-    unsigned char *pr;
+    int32 s = 0, i, first, last;
 
     if (abs(iw - pw) > 2) return INT32_MAX;
     if (abs(ih - ph) > 2) return INT32_MAX;
 
-    ir = (unsigned char *) malloc(n);
-    pr = (unsigned char *) malloc(n);
-
     /* (shift_x, shift_y) is a shift of image with respect to prototype */
     shift_x = (pw - pw/2) - (iw - iw/2); /* center favors right */
     shift_y = ph/2 - ih/2;               /* center favors top */
 
-    memset(pr, 0, n);
-    memset(ir, 0, n);
+    /* rows of the prototype's coordinates where either bitmap is present */
+    first = shift_y < 0 ? shift_y : 0;
+    last = ih + shift_y > ph ? ih + shift_y : ph;
 
-    for (i = -1; i <= ph; i++)
+    for (i = first; i < last; i++)
     {
         int32 y = i - shift_y;
+        const uint32 *ir = (y >= 0 && y < ih) ? image->data + y * iwords : NULL;
+        const uint32 *pr = (i >= 0 && i < ph) ? prototype->data + i * pwords : NULL;
 
-        if (y >= 0 && y < ih)
-            memcpy(ir + shift_x + 1, image_uncompressed[y], iw);
-        else
-            memset(ir, 0, n); /* SUB-OPTIMAL? */
-
-        if (i >= 0 && i < ph)
-            memcpy(pr + 1, proto_uncompressed[i], pw);
-        else
-            memset(pr, 0, n);
-
-        /* reusing y */
-        for (y = 0; y < n; y++) if (ir[y] != pr[y]) s++;
+        s += row_diff(ir, iwords, pr, pwords, shift_x);
         if (s > ceiling)
-        {
-            free(ir);
-            free(pr);
             return s;
-        }
     }
 
-    free(ir);
-    free(pr);
-
     return s;
 }
 
-static void find_prototypes
-    (mdjvu_image_t dict, unsigned char ***uncompressed_dict, mdjvu_image_t img)
+/* ______________________________   index   _______________________________ */
+
+/* Candidates for prototypes are put into buckets by (width, height),
+ * each bucket being sorted by mass. diff() rejects bitmaps that differ
+ * in size by more than 2, so only 25 buckets are looked up for a bitmap,
+ * and each of them is scanned outward from the closest mass, stopping
+ * where the mass difference alone exceeds the best score.
+ *
+ * `order' is the position in the dictionary-then-page scan order;
+ * among equally good candidates, the first one in that order wins,
+ * just like in a plain linear scan.
+ */
+typedef struct
+{
+    int32 mass;
+    int32 order;
+    mdjvu_bitmap_t bitmap;
+    PackedBitmap *packed;
+} Candidate;
+
+typedef struct
+{
+    int32 width, height;
+    int32 first, count;   /* a slice of the candidates array */
+    int32 next;           /* the next bucket in the hash chain, or -1 */
+} Bucket;
+
+typedef struct
+{
+    int32 score;
+    int32 order;
+    mdjvu_bitmap_t bitmap;
+} Match;
+
+/* Everything needed to search among the bitmaps of an image.
+ * Memory is only reallocated when an image doesn't fit,
+ * so a Scratch reused for page after page allocates O(1) times per page.
+ * Each thread of a search needs its own.
+ */
+typedef struct
+{
+    PackedBitmap *packed;
+    uint32 *words;
+    Candidate *candidates;
+    Bucket *buckets;
+    int32 *table;         /* hash table of bucket indices, -1 is empty */
+    int32 bucket_count;
+    int32 table_size;     /* a power of 2 */
+
+    int32 packed_capacity, words_capacity, candidates_capacity;
+    int32 buckets_capacity, table_capacity;
+} Scratch;
+
+/* size differences to try, the most promising first */
+static const signed char size_offsets[25][2] =
+{
+    { 0, 0},
+    {-1, 0}, { 1, 0}, { 0,-1}, { 0, 1},
+    {-1,-1}, {-1, 1}, { 1,-1}, { 1, 1},
+    {-2, 0}, { 2, 0}, { 0,-2}, { 0, 2},
+    {-2,-1}, {-2, 1}, { 2,-1}, { 2, 1},
+    {-1,-2}, {-1, 2}, { 1,-2}, { 1, 2},
+    {-2,-2}, {-2, 2}, { 2,-2}, { 2, 2}
+};
+
+static void scratch_init(Scratch *s)
+{
+    memset(s, 0, sizeof(Scratch));
+}
+
+static void scratch_destroy(Scratch *s)
+{
+    free(s->packed);
+    free(s->words);
+    free(s->candidates);
+    free(s->buckets);
+    free(s->table);
+}
+
+/* Make *p hold at least `needed' elements of the given size. */
+static void *reserve(void *p, int32 *capacity, int32 needed, size_t size)
+{
+    if (needed <= *capacity) return p;
+    if (needed < 2 * *capacity) needed = 2 * *capacity;
+    *capacity = needed;
+    return realloc(p, needed * size);
+}
+
+static int32 *index_slot(Scratch *s, int32 w, int32 h)
+{
+    uint32 hash = ((uint32) w * 31 + (uint32) h) * 2654435761U;
+    return &s->table[(hash >> 8) & (s->table_size - 1)];
+}
+
+static Bucket *index_find(Scratch *s, int32 w, int32 h)
+{
+    int32 i = *index_slot(s, w, h);
+    while (i >= 0 && (s->buckets[i].width != w || s->buckets[i].height != h))
+        i = s->buckets[i].next;
+    return i >= 0 ? &s->buckets[i] : NULL;
+}
+
+/* Pack all bitmaps of the image and prepare an empty index for them. */
+static void scratch_load(Scratch *s, mdjvu_image_t img)
 {
-    int32 d = dict ? mdjvu_image_get_bitmap_count(dict) : 0;
     int32 i, n = mdjvu_image_get_bitmap_count(img);
-    unsigned char ***uncompressed_bitmaps = (unsigned char ***)
-        malloc(n * sizeof(unsigned char **));
+    int32 total_words = 0, first = 0;
 
     for (i = 0; i < n; i++)
     {
-        mdjvu_bitmap_t current = mdjvu_image_get_bitmap(img, i);
-        int32 w = mdjvu_bitmap_get_width(current);
-        int32 h = mdjvu_bitmap_get_height(current);
-        uncompressed_bitmaps[i] = mdjvu_create_2d_array(w, h);
-        mdjvu_bitmap_unpack_all_0_or_1(current, uncompressed_bitmaps[i]);
+        mdjvu_bitmap_t b = mdjvu_image_get_bitmap(img, i);
+        total_words += packed_size(mdjvu_bitmap_get_width(b),
+                                   mdjvu_bitmap_get_height(b));
+    }
+
+    /* + 1 to never allocate 0 bytes */
+    s->packed = (PackedBitmap *) reserve(s->packed, &s->packed_capacity,
+                                         n + 1, sizeof(PackedBitmap));
+    s->candidates = (Candidate *) reserve(s->candidates, &s->candidates_capacity,
+                                          n + 1, sizeof(Candidate));
+    s->buckets = (Bucket *) reserve(s->buckets, &s->buckets_capacity,
+                                    n + 1, sizeof(Bucket));
+    s->words = (uint32 *) reserve(s->words, &s->words_capacity,
+                                  total_words + 1, sizeof(uint32));
+    memset(s->words, 0, total_words * sizeof(uint32));
+
+    s->table_size = 16;
+    while (s->table_size < n) s->table_size <<= 1;
+    s->table = (int32 *) reserve(s->table, &s->table_capacity,
+                                 s->table_size, sizeof(int32));
+    for (i = 0; i < s->table_size; i++) s->table[i] = -1;
+    s->bucket_count = 0;
+
+    total_words = 0;
+    for (i = 0; i < n; i++)
+    {
+        PackedBitmap *p = &s->packed[i];
+        Bucket *bucket;
+
+        pack_bitmap(p, mdjvu_image_get_bitmap(img, i), s->words + total_words);
+        total_words += packed_size(p->width, p->height);
+
+        /* count bucket sizes */
+        bucket = index_find(s, p->width, p->height);
+        if (!bucket)
+        {
+            int32 *slot = index_slot(s, p->width, p->height);
+            bucket = &s->buckets[s->bucket_count];
+            bucket->width = p->width;
+            bucket->height = p->height;
+            bucket->count = 0;
+            bucket->next = *slot;
+            *slot = s->bucket_count++;
+        }
+        bucket->count++;
+    }
+
+    /* give each bucket its slice of candidates */
+    for (i = 0; i < s->bucket_count; i++)
+    {
+        s->buckets[i].first = first;
+        first += s->buckets[i].count;
+        s->buckets[i].count = 0;
+    }
+}
+
+/* Add the i-th bitmap of the loaded image to the index.
+ * Candidates should be added in increasing order.
+ */
+static void index_add(Scratch *s, int32 i, mdjvu_bitmap_t bitmap,
+                      int32 mass, int32 order)
+{
+    PackedBitmap *p = &s->packed[i];
+    Bucket *b = index_find(s, p->width, p->height);
+    Candidate *candidates = s->candidates + b->first;
+    int32 k = b->count++;
+
+    while (k > 0 && candidates[k - 1].mass > mass)
+    {
+        candidates[k] = candidates[k - 1];
+        k--;
+    }
+    candidates[k].mass = mass;
+    candidates[k].order = order;
+    candidates[k].bitmap = bitmap;
+    candidates[k].packed = p;
+}
+
+static void try_candidate(PackedBitmap *current, Candidate *c, Match *best)
+{
+    int32 score;
+    if (best->bitmap && !best->score && best->order < c->order) return;
+    score = diff(current, c->packed, best->score);
+    if (score < best->score
+     || (score == best->score && best->bitmap && c->order < best->order))
+    {
+        best->score = score;
+        best->order = c->order;
+        best->bitmap = c->bitmap;
     }
+}
+
+/* Look for a better match than *best. */
+static void index_search(Scratch *s, PackedBitmap *current,
+                         int32 mass, Match *best)
+{
+    int32 k;
+
+    for (k = 0; k < 25; k++)
+    {
+        Bucket *b = index_find(s, current->width + size_offsets[k][0],
+                                  current->height + size_offsets[k][1]);
+        Candidate *candidates;
+        int32 left, right, lo, hi;
+
+        if (!b) continue;
+        candidates = s->candidates + b->first;
+
+        /* find the first candidate with mass not less than ours */
+        lo = 0; hi = b->count;
+        while (lo < hi)
+        {
+            int32 mid = (lo + hi) / 2;
+            if (candidates[mid].mass < mass)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        right = lo;
+        left = lo - 1;
+
+        /* going outward, the mass difference never decreases */
+        while (1)
+        {
+            Candidate *c;
+            int32 left_dm = left >= 0 ?
+                mass - candidates[left].mass : INT32_MAX;
+            int32 right_dm = right < b->count ?
+                candidates[right].mass - mass : INT32_MAX;
+
+            if (left_dm <= right_dm)
+            {
+                if (left_dm > best->score) break;
+                c = &candidates[left--];
+            }
+            else
+            {
+                if (right_dm > best->score) break;
+                c = &candidates[right++];
+            }
+            try_candidate(current, c, best);
+        }
+    }
+}
+
+/* ____________________________   searching   _____________________________ */
+
+/* dict_scratch should have the dictionary loaded and indexed,
+ * page_scratch is for the page's own use.
+ */
+static void find_prototypes(mdjvu_image_t dict, Scratch *dict_scratch,
+                            Scratch *page_scratch, mdjvu_image_t img)
+{
+    int32 d = dict ? mdjvu_image_get_bitmap_count(dict) : 0;
+    int32 i, n = mdjvu_image_get_bitmap_count(img);
 
     if (!mdjvu_image_has_prototypes(img))
         mdjvu_image_enable_prototypes(img);
@@ -96,109 +424,187 @@ static void find_prototypes
         mdjvu_image_enable_substitutions(img);
     if (!mdjvu_image_has_masses(img))
         mdjvu_image_enable_masses(img); /* calculates them, not just enables */
+
+    scratch_load(page_scratch, img);
+
     for (i = 0; i < n; i++)
     {
         mdjvu_bitmap_t current = mdjvu_image_get_bitmap(img, i);
+        PackedBitmap *packed = &page_scratch->packed[i];
         int32 mass = mdjvu_image_get_mass(img, current);
-        int32 w = mdjvu_bitmap_get_width(current);
-        int32 h = mdjvu_bitmap_get_height(current);
-        int32 max_score = w * h * THRESHOLD / 100;
-        int32 j;
-        mdjvu_bitmap_t best_match = NULL;
-        int32 best_score = max_score;
-
-        for (j = 0; j < d; j++)
-        {
-            int32 score;
-            mdjvu_bitmap_t candidate = mdjvu_image_get_bitmap(dict, j);
-            int32 c_mass = mdjvu_image_get_mass(dict, candidate);
-            if (abs(mass - c_mass) > best_score) continue;
-            score = diff(current,
-                         candidate,
-                         uncompressed_bitmaps[i],
-                         uncompressed_dict[j],
-                         best_score);
-            if (score < best_score)
-            {
-                best_score = score;
-                best_match = candidate;
-                if (!score)
-                    break; /* a perfect match is found */
-            }
-        }
+        Match best;
 
-        if (best_score) for (j = 0; j < i; j++)
-        {
-            int32 score;
-            mdjvu_bitmap_t candidate = mdjvu_image_get_bitmap(img, j);
-            int32 c_mass = mdjvu_image_get_mass(img, candidate);
-            if (abs(mass - c_mass) > best_score) continue;
-            score = diff(current,
-                         candidate,
-                         uncompressed_bitmaps[i],
-                         uncompressed_bitmaps[j],
-                         best_score);
-            if (score < best_score)
-            {
-                best_score = score;
-                best_match = candidate;
-                if (!score)
-                    break; /* a perfect match is found */
-            }
-        }
+        best.score = packed->width * packed->height * THRESHOLD / 100;
+        best.order = INT32_MAX;
+        best.bitmap = NULL;
 
-        if (best_score)
-            mdjvu_image_set_prototype(img, current, best_match);
+        if (dict)
+            index_search(dict_scratch, packed, mass, &best);
+
+        /* only earlier bitmaps of the page may serve as prototypes */
+        if (best.score)
+            index_search(page_scratch, packed, mass, &best);
+        index_add(page_scratch, i, current, mass, d + i);
+
+        if (best.score)
+            mdjvu_image_set_prototype(img, current, best.bitmap);
         else
-            mdjvu_image_set_substitution(img, current, best_match);
+            mdjvu_image_set_substitution(img, current, best.bitmap);
     }
+}
 
-    /* destroy uncompressed bitmaps */
-    for (i = 0; i < n; i++)
+MDJVU_IMPLEMENT void mdjvu_find_prototypes(mdjvu_image_t img)
+{
+    Scratch scratch;
+    scratch_init(&scratch);
+    find_prototypes(NULL, NULL, &scratch, img);
+    scratch_destroy(&scratch);
+}
+
+/* _________________________   multipage search   __________________________ */
+
+/* Pages only share the dictionary, which is read-only during the search,
+ * so they may be searched in several threads, each with its own scratch.
+ */
+typedef struct
+{
+    mdjvu_image_t dict;
+    Scratch *dict_scratch;
+    int32 npages;
+    mdjvu_image_t *pages;
+    int32 next_page;
+    unsigned char *page_done;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t mutex;
+    pthread_cond_t page_finished;
+#endif
+} PrototypeSearch;
+
+#ifdef HAVE_LIBPTHREAD
+static void *prototype_search_thread(void *param)
+{
+    PrototypeSearch *search = (PrototypeSearch *) param;
+    Scratch scratch;
+
+    scratch_init(&scratch);
+    while (1)
     {
-        mdjvu_destroy_2d_array(uncompressed_bitmaps[i]);
+        int32 i;
+
+        pthread_mutex_lock(&search->mutex);
+        i = search->next_page++;
+        pthread_mutex_unlock(&search->mutex);
+        if (i >= search->npages) break;
+
+        find_prototypes(search->dict, search->dict_scratch, &scratch,
+                        search->pages[i]);
+
+        pthread_mutex_lock(&search->mutex);
+        search->page_done[i] = 1;
+        pthread_cond_broadcast(&search->page_finished);
+        pthread_mutex_unlock(&search->mutex);
     }
-    free(uncompressed_bitmaps);
+    scratch_destroy(&scratch);
+    return NULL;
 }
 
-MDJVU_IMPLEMENT void mdjvu_find_prototypes(mdjvu_image_t img)
+/* Returns 0 if no threads could be started. */
+static int search_in_threads(PrototypeSearch *search, int nthreads,
+                             void (*report)(void *, int), void *param)
 {
-    find_prototypes(NULL, NULL, img);
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    int i, started = 0;
+
+    search->page_done = (unsigned char *) calloc(search->npages, 1);
+    pthread_mutex_init(&search->mutex, NULL);
+    pthread_cond_init(&search->page_finished, NULL);
+
+    while (started < nthreads
+        && !pthread_create(&threads[started], NULL,
+                           prototype_search_thread, search))
+    {
+        started++;
+    }
+
+    if (started)
+    {
+        /* report pages in order, from the calling thread */
+        for (i = 0; i < search->npages; i++)
+        {
+            pthread_mutex_lock(&search->mutex);
+            while (!search->page_done[i])
+                pthread_cond_wait(&search->page_finished, &search->mutex);
+            pthread_mutex_unlock(&search->mutex);
+            report(param, i);
+        }
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&search->page_finished);
+    pthread_mutex_destroy(&search->mutex);
+    free(search->page_done);
+    free(threads);
+    return started;
 }
+#endif
 
-MDJVU_IMPLEMENT void mdjvu_multipage_find_prototypes(mdjvu_image_t dict,
-                                                     int32 npages,
-                                                     mdjvu_image_t *pages,
-                                                     void (*report)(void *, int ),
-                                                     void *param)
+MDJVU_IMPLEMENT void mdjvu_multipage_find_prototypes_in_threads
+    (mdjvu_image_t dict, int32 npages, mdjvu_image_t *pages,
+     void (*report)(void *, int), void *param, int nthreads)
 {
     int i;
     int32 n = mdjvu_image_get_bitmap_count(dict);
-    unsigned char ***uncompressed_dict_bitmaps = (unsigned char ***)
-        malloc(n * sizeof(unsigned char **));
+    Scratch dict_scratch, page_scratch;
+    int searched = 0;
+
+    if (!mdjvu_image_has_masses(dict))
+        mdjvu_image_enable_masses(dict); /* calculates them, not just enables */
 
+    /* the dictionary is packed and indexed once for all pages */
+    scratch_init(&dict_scratch);
+    scratch_load(&dict_scratch, dict);
     for (i = 0; i < n; i++)
     {
         mdjvu_bitmap_t current = mdjvu_image_get_bitmap(dict, i);
-        int32 w = mdjvu_bitmap_get_width(current);
-        int32 h = mdjvu_bitmap_get_height(current);
-        uncompressed_dict_bitmaps[i] = mdjvu_create_2d_array(w, h);
-        mdjvu_bitmap_unpack_all_0_or_1(current, uncompressed_dict_bitmaps[i]);
+        index_add(&dict_scratch, i, current,
+                  mdjvu_image_get_mass(dict, current), i);
     }
 
-    if (!mdjvu_image_has_masses(dict))
-        mdjvu_image_enable_masses(dict); /* calculates them, not just enables */
-
-    for (i = 0; i < npages; i++)
+#ifdef HAVE_LIBPTHREAD
+    if (nthreads > npages) nthreads = npages;
+    if (nthreads > 1)
     {
-        find_prototypes(dict, uncompressed_dict_bitmaps, pages[i]);
-        report(param, i);
+        PrototypeSearch search;
+        search.dict = dict;
+        search.dict_scratch = &dict_scratch;
+        search.npages = npages;
+        search.pages = pages;
+        search.next_page = 0;
+        searched = search_in_threads(&search, nthreads, report, param);
     }
+#endif
 
-    /* destroy uncompressed bitmaps */
-    for (i = 0; i < n; i++)
+    if (!searched)
     {
-        mdjvu_destroy_2d_array(uncompressed_dict_bitmaps[i]);
+        scratch_init(&page_scratch);
+        for (i = 0; i < npages; i++)
+        {
+            find_prototypes(dict, &dict_scratch, &page_scratch, pages[i]);
+            report(param, i);
+        }
+        scratch_destroy(&page_scratch);
     }
-    free(uncompressed_dict_bitmaps);
+
+    scratch_destroy(&dict_scratch);
+}
+
+MDJVU_IMPLEMENT void mdjvu_multipage_find_prototypes(mdjvu_image_t dict,
+                                                     int32 npages,
+                                                     mdjvu_image_t *pages,
+                                                     void (*report)(void *, int ),
+                                                     void *param)
+{
+    mdjvu_multipage_find_prototypes_in_threads(dict, npages, pages,
+                                               report, param, 1);
 }
@@ -16,6 +16,20 @@
 #include <assert.h>
 #include <math.h>
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/* SSE2 is always there on x86-64 and may be enabled on x86.
+ * Without it, the row kernels below are plain loops.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define USE_SSE2 1
+    #include <emmintrin.h>
+#else
+    #define USE_SSE2 0
+#endif
+
 
 #define TIMES_TO_THIN 1
 #define TIMES_TO_THICKEN 1
@@ -33,6 +47,7 @@ typedef struct
     double shiftdiff3_threshold;
     int aggression;
     int method;
+    mdjvu_pattern_cache_t cache; /* not owned by the options */
 } Options;
 
 /* These are hand-tweaked parameters of this classifier. */
@@ -91,6 +106,7 @@ MDJVU_IMPLEMENT mdjvu_matcher_options_t mdjvu_matcher_options_create(void)
     mdjvu_init();
     mdjvu_set_aggression(options, 100);
     ((Options *) options)->method = 0;
+    ((Options *) options)->cache = NULL;
     return options;
 }
 
@@ -108,15 +124,28 @@ MDJVU_IMPLEMENT void mdjvu_matcher_options_destroy(mdjvu_matcher_options_t opt)
 
 typedef unsigned char byte;
 
+/* A black-and-white picture packed into bits, 32 pixels per word.
+ * Pixel x of a row is bit 31 - x % 32 of word x / 32.
+ * There's an extra word after the last row, so that 32 bits may be taken
+ * starting from any pixel (the bits past the row end are garbage).
+ */
+typedef struct
+{
+    int32 width, height, words_per_row;
+    uint32 *data; /* NULL if there's no plane */
+} BitPlane;
+
 typedef struct ComparableImageData
 {
     byte **pixels; /* 0 - purely white, 255 - purely black (inverse to PGM!) */
-    byte **pith2_inner;
-    byte **pith2_outer;
+    BitPlane pith2_inner; /* width x height */
+    BitPlane pith2_outer; /* (width + 2) x (height + 2) */
     int32 width, height, mass;
     int32 mass_center_x, mass_center_y;
     byte signature[SIGNATURE_SIZE];  /* for shiftdiff 1 and 3 tests */
     byte signature2[SIGNATURE_SIZE]; /* for shiftdiff 2 test */
+    mdjvu_pattern_cache_t cache; /* NULL unless a pattern cache shares it */
+    int32 references; /* counted under the cache lock, if there's a cache */
 } Image;
 
 
@@ -136,21 +165,29 @@ typedef struct ComparableImageData
  * Mass checking was introduced by Leon Bottou.
  */
 
-static int simple_tests(Image *i1, Image *i2)
+static int sizes_differ(int32 s1, int32 s2)
 {
-    int32 w1 = i1->width, h1 = i1->height, m1 = i1->mass;
-    int32 w2 = i2->width, h2 = i2->height, m2 = i2->mass;
+    return 100.* s1 > (100.+ size_difference_threshold) * s2
+        || 100.* s2 > (100.+ size_difference_threshold) * s1;
+}
 
-    if (100.* w1 > (100.+ size_difference_threshold) * w2) return -1;
-    if (100.* w2 > (100.+ size_difference_threshold) * w1) return -1;
-    if (100.* h1 > (100.+ size_difference_threshold) * h2) return -1;
-    if (100.* h2 > (100.+ size_difference_threshold) * h1) return -1;
+static int simple_tests_by_dimensions(int32 w1, int32 h1, int32 m1,
+                                      int32 w2, int32 h2, int32 m2)
+{
+    if (sizes_differ(w1, w2)) return -1;
+    if (sizes_differ(h1, h2)) return -1;
     if (100.* m1 > (100.+ mass_difference_threshold) * m2) return -1;
     if (100.* m2 > (100.+ mass_difference_threshold) * m1) return -1;
 
     return 0;
 }
 
+static int simple_tests(Image *i1, Image *i2)
+{
+    return simple_tests_by_dimensions(i1->width, i1->height, i1->mass,
+                                      i2->width, i2->height, i2->mass);
+}
+
 
 #define USE_PITHDIFF 1
 #define USE_SHIFTDIFF_1 1
@@ -160,18 +197,84 @@ static int simple_tests(Image *i1, Image *i2)
 
 /* Computing distance by comparing pixels {{{ */
 
+/* Row kernels {{{ */
+
+/* The kernels take pointers to byte rows and their length.
+ * They are called directly (not through pointers) by the pixel comparison,
+ * so that the compiler may inline them.
+ */
+
+#if USE_SSE2
+/* sum of bytes in both halves */
+static int32 sse2_sum(__m128i sum)
+{
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+#endif
+
+/* pithdiff: penalty for any pixel that's framework (255) in one row
+ *     and not in the other.
+ */
+static int32 pithdiff_compare_row(byte *row1, byte *row2, int32 n)
+{
+    int32 i = 0, s = 0;
+#if USE_SSE2
+    __m128i ff = _mm_set1_epi8((char) 0xFF), zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i k = _mm_loadu_si128((const __m128i *) (row1 + i));
+        __m128i l = _mm_loadu_si128((const __m128i *) (row2 + i));
+        __m128i k_is_255 = _mm_cmpeq_epi8(k, ff);
+        __m128i l_is_255 = _mm_cmpeq_epi8(l, ff);
+
+        /* 255 - l if k is 255, else 255 - k if l is 255, else 0 */
+        __m128i d = _mm_or_si128(
+            _mm_and_si128(k_is_255, _mm_xor_si128(l, ff)),
+            _mm_andnot_si128(k_is_255,
+                _mm_and_si128(l_is_255, _mm_xor_si128(k, ff))));
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(d, zero));
+    }
+    s = sse2_sum(sum);
+#endif
+    for (; i < n; i++)
+    {
+        int32 k = row1[i], l = row2[i];
+        if (k == 255)
+            s += 255 - l;
+        else if (l == 255)
+            s += 255 - k;
+    }
+    return s;
+}
+
+static int32 pithdiff_compare_with_white(byte *row, int32 n)
+{
+    int32 i = 0, s = 0;
+#if USE_SSE2
+    __m128i ff = _mm_set1_epi8((char) 0xFF), zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i r = _mm_loadu_si128((const __m128i *) (row + i));
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(_mm_cmpeq_epi8(r, ff), zero));
+    }
+    s = sse2_sum(sum);
+#endif
+    for (; i < n; i++) if (row[i] == 255) s += 255;
+    return s;
+}
+
+/* Row kernels }}} */
+
 /* This function compares two images pixel by pixel.
- * The exact way to compare pixels is defined by two functions,
- *     compare_row and compare_with_white.
- * Both functions take pointers to byte rows and their length.
+ * Pixels are compared by pithdiff_compare_row
+ *     and pithdiff_compare_with_white.
  *
  * Now images are aligned by mass centers.
  * Code needs some clarification, yes...
  */
 static int32 distance_by_pixeldiff_functions_by_shift(Image *i1, Image *i2,
-    int32 (*compare_row)(byte *, byte *, int32),
-    int32 (*compare_1_with_white)(byte *, int32),
-    int32 (*compare_2_with_white)(byte *, int32),
     int32 ceiling,
     int32 shift_x, int32 shift_y) /* of i1's coordinate system with respect to i2 */
 {
@@ -198,37 +301,37 @@ static int32 distance_by_pixeldiff_functions_by_shift(Image *i1, Image *i2,
         if (i < 0 || i >= h2)
         {
             /* calculate difference of i1 with white */
-            score += compare_1_with_white(i1->pixels[y1], w1);
+            score += pithdiff_compare_with_white(i1->pixels[y1], w1);
         }
         else if (i < shift_y || i >= shift_y + h1)
         {
             /* calculate difference of i2 with white */
-            score += compare_2_with_white(i2->pixels[i], w2);
+            score += pithdiff_compare_with_white(i2->pixels[i], w2);
         }
         else
         {
             /* calculate difference in a line where the bitmaps overlap */
-            score += compare_row(i1->pixels[y1] + min_overlap_x_for_i1,
-                                 i2->pixels[i] + min_overlap_x,
-                                 overlap_length);
+            score += pithdiff_compare_row(i1->pixels[y1] + min_overlap_x_for_i1,
+                                          i2->pixels[i] + min_overlap_x,
+                                          overlap_length);
 
 
             /* calculate penalty for the left margin */
             if (min_overlap_x > 0)
-                score += compare_2_with_white(i2->pixels[i], min_overlap_x);
+                score += pithdiff_compare_with_white(i2->pixels[i], min_overlap_x);
             else
-                score += compare_1_with_white(i1->pixels[y1], min_overlap_x_for_i1);
+                score += pithdiff_compare_with_white(i1->pixels[y1], min_overlap_x_for_i1);
 
             /* calculate penalty for the right margin */
             if (max_overlap_x_plus_1 < w2)
             {
-                score += compare_2_with_white(
+                score += pithdiff_compare_with_white(
                     i2->pixels[i] + max_overlap_x_plus_1,
                     w2 - max_overlap_x_plus_1);
             }
             else
             {
-                score += compare_1_with_white(
+                score += pithdiff_compare_with_white(
                      i1->pixels[y1] + max_overlap_x_plus_1_for_i1,
                      w1 - max_overlap_x_plus_1_for_i1);
 
@@ -240,17 +343,13 @@ static int32 distance_by_pixeldiff_functions_by_shift(Image *i1, Image *i2,
     return score;
 }
 
-static int32 distance_by_pixeldiff_functions(Image *i1, Image *i2,
-    int32 (*compare_row)(byte *, byte *, int32),
-    int32 (*compare_1_with_white)(byte *, int32),
-    int32 (*compare_2_with_white)(byte *, int32),
-    int32 ceiling)
+/* Makes *pi1 to be narrower than *pi2 and aligns them by mass centers. */
+static void align_images(Image **pi1, Image **pi2,
+                         int32 *pshift_x, int32 *pshift_y)
 {
-    byte **p1, **p2;
+    Image *i1 = *pi1, *i2 = *pi2;
     int32 w1, w2, h1, h2;
     int32 shift_x, shift_y; /* of i1's coordinate system with respect to i2 */
-    /*int32 s = 0, i, i_start, i_cap;
-    int32 right_margin_start, right_margin_width;*/
 
     /* make i1 to be narrower than i2 */
     if (i1->width > i2->width)
@@ -260,8 +359,8 @@ static int32 distance_by_pixeldiff_functions(Image *i1, Image *i2,
         i2 = img;
     }
 
-    w1 = i1->width; h1 = i1->height; p1 = i1->pixels;
-    w2 = i2->width; h2 = i2->height; p2 = i2->pixels;
+    w1 = i1->width; h1 = i1->height;
+    w2 = i2->width; h2 = i2->height;
 
     /* (shift_x, shift_y) */
     /*     is what should be added to i1's coordinates to get i2's coordinates. */
@@ -280,9 +379,19 @@ static int32 distance_by_pixeldiff_functions(Image *i1, Image *i2,
     else
         shift_y = (shift_y + MDJVU_CENTER_QUANT / 2) / MDJVU_CENTER_QUANT;
 
+    *pi1 = i1;
+    *pi2 = i2;
+    *pshift_x = shift_x;
+    *pshift_y = shift_y;
+}
+
+static int32 distance_by_pixeldiff_functions(Image *i1, Image *i2,
+    int32 ceiling)
+{
+    int32 shift_x, shift_y;
+    align_images(&i1, &i2, &shift_x, &shift_y);
     return distance_by_pixeldiff_functions_by_shift(
-        i1, i2, compare_row, compare_1_with_white, compare_2_with_white,
-        ceiling, shift_x, shift_y);
+        i1, i2, ceiling, shift_x, shift_y);
 }
 
 /* Computing distance by comparing pixels }}} */
@@ -299,34 +408,9 @@ static int32 distance_by_pixeldiff_functions(Image *i1, Image *i2,
  *     that's framework in one image and white in the other.
  */
 
-static int32 pithdiff_compare_row(byte *row1, byte *row2, int32 n)
-{
-    int32 i, s = 0;
-    for (i = 0; i < n; i++)
-    {
-        int32 k = row1[i], l = row2[i];
-        if (k == 255)
-            s += 255 - l;
-        else if (l == 255)
-            s += 255 - k;
-    }
-    return s;
-}
-
-static int32 pithdiff_compare_with_white(byte *row, int32 n)
-{
-    int32 i, s = 0;
-    for (i = 0; i < n; i++) if (row[i] == 255) s += 255;
-    return s;
-}
-
 static int32 pithdiff_distance(Image *i1, Image *i2, int32 ceiling)
 {
-    return distance_by_pixeldiff_functions(i1, i2,
-            &pithdiff_compare_row,
-            &pithdiff_compare_with_white,
-            &pithdiff_compare_with_white,
-            ceiling);
+    return distance_by_pixeldiff_functions(i1, i2, ceiling);
 }
 
 static int pithdiff_equivalence(Image *i1, Image *i2, double threshold, int32 dpi)
@@ -375,7 +459,7 @@ static int shiftdiff_equivalence(byte *s1, byte *s2, double falloff, double veto
 /* shift signature comparison }}} */
 
 #ifndef NO_MINIDJVU
-mdjvu_pattern_t mdjvu_pattern_create(mdjvu_matcher_options_t opt, mdjvu_bitmap_t bitmap)
+static mdjvu_pattern_t create_pattern(mdjvu_matcher_options_t opt, mdjvu_bitmap_t bitmap)
 {
     /* not calling mdjvu_init() since we already have a bitmap */
     int32 w = mdjvu_bitmap_get_width(bitmap);
@@ -387,6 +471,279 @@ mdjvu_pattern_t mdjvu_pattern_create(mdjvu_matcher_options_t opt, mdjvu_bitmap_t
     mdjvu_destroy_2d_array(pixels);
     return pattern;
 }
+
+/* Pattern cache {{{ */
+
+/* The cache keeps a copy of each bitmap it has seen along with its pattern.
+ * Entries are found by the bitmap hash and evicted in the order of addition.
+ * Patterns that got into the cache keep it (but not its entries) alive,
+ * since their references are counted under its lock.
+ */
+
+typedef struct CacheEntry
+{
+    struct CacheEntry *next_in_chain;
+    struct CacheEntry *next_added;
+    mdjvu_bitmap_t bitmap;
+    mdjvu_pattern_t pattern;
+    uint32 hash;
+    int flags; /* options that the pattern depends on */
+    int32 size;
+} CacheEntry;
+
+typedef struct
+{
+    CacheEntry **chains;
+    int32 nchains; /* a power of two */
+    int32 count;
+    CacheEntry *oldest, *newest;
+    double memory, max_memory;
+    int32 hits, misses;
+    int32 users; /* the cache itself and the patterns it has shared */
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t mutex;
+#endif
+} PatternCache;
+
+#ifdef HAVE_LIBPTHREAD
+#define LOCK_CACHE(C)   pthread_mutex_lock(&(C)->mutex)
+#define UNLOCK_CACHE(C) pthread_mutex_unlock(&(C)->mutex)
+#else
+#define LOCK_CACHE(C)
+#define UNLOCK_CACHE(C)
+#endif
+
+#define INITIAL_CACHE_CHAINS 1024
+
+static void free_image(Image *);
+
+MDJVU_IMPLEMENT mdjvu_pattern_cache_t mdjvu_pattern_cache_create(double max_memory)
+{
+    PatternCache *c = (PatternCache *) malloc(sizeof(PatternCache));
+    c->nchains = INITIAL_CACHE_CHAINS;
+    c->chains = (CacheEntry **) calloc(c->nchains, sizeof(CacheEntry *));
+    c->count = 0;
+    c->oldest = c->newest = NULL;
+    c->memory = 0;
+    c->max_memory = max_memory;
+    c->hits = c->misses = 0;
+    c->users = 1;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&c->mutex, NULL);
+#endif
+    return (mdjvu_pattern_cache_t) c;
+}
+
+static void free_cache(PatternCache *c)
+{
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_destroy(&c->mutex);
+#endif
+    free(c);
+}
+
+/* Drops a reference to a pattern shared by the cache (which is locked).
+ * Returns 1 if it was the last one.
+ */
+static int unreference_cached_image(PatternCache *c, Image *img)
+{
+    if (--img->references) return 0;
+    c->users--;
+    return 1;
+}
+
+/* The cache must be locked. */
+static void destroy_cache_entry(PatternCache *c, CacheEntry *e)
+{
+    mdjvu_bitmap_destroy(e->bitmap);
+    if (unreference_cached_image(c, (Image *) e->pattern))
+        free_image((Image *) e->pattern);
+    free(e);
+}
+
+/* Called by mdjvu_pattern_destroy() for patterns shared by a cache.
+ * Returns 1 if the pattern should be freed.
+ */
+static int release_cached_image(Image *img)
+{
+    PatternCache *c = (PatternCache *) img->cache;
+    int last;
+    int32 users;
+
+    LOCK_CACHE(c);
+    last = unreference_cached_image(c, img);
+    users = c->users;
+    UNLOCK_CACHE(c);
+    if (!users) free_cache(c);
+    return last;
+}
+
+MDJVU_IMPLEMENT void mdjvu_pattern_cache_destroy(mdjvu_pattern_cache_t cache)
+{
+    PatternCache *c = (PatternCache *) cache;
+    CacheEntry *e;
+    int32 users;
+
+    LOCK_CACHE(c);
+    e = c->oldest;
+    while (e)
+    {
+        CacheEntry *next = e->next_added;
+        destroy_cache_entry(c, e);
+        e = next;
+    }
+    free(c->chains);
+    users = --c->users;
+    UNLOCK_CACHE(c);
+    if (!users) free_cache(c);
+}
+
+MDJVU_IMPLEMENT void mdjvu_pattern_cache_get_statistics
+    (mdjvu_pattern_cache_t cache, int32 *hits, int32 *misses)
+{
+    PatternCache *c = (PatternCache *) cache;
+    LOCK_CACHE(c);
+    *hits = c->hits;
+    *misses = c->misses;
+    UNLOCK_CACHE(c);
+}
+
+MDJVU_IMPLEMENT void mdjvu_set_pattern_cache(mdjvu_matcher_options_t opt,
+                                             mdjvu_pattern_cache_t cache)
+{
+    ((Options *) opt)->cache = cache;
+}
+
+/* Returns a new reference to the cached pattern or NULL. */
+static mdjvu_pattern_t find_in_cache(PatternCache *c, mdjvu_bitmap_t bitmap,
+                                     uint32 hash, int flags)
+{
+    CacheEntry *e = c->chains[hash & (c->nchains - 1)];
+    for (; e; e = e->next_in_chain)
+    {
+        if (e->hash == hash && e->flags == flags
+         && mdjvu_bitmap_equal(e->bitmap, bitmap))
+        {
+            ((Image *) e->pattern)->references++;
+            return e->pattern;
+        }
+    }
+    return NULL;
+}
+
+static void double_cache_chains(PatternCache *c)
+{
+    int32 n = c->nchains * 2;
+    CacheEntry **chains = (CacheEntry **) calloc(n, sizeof(CacheEntry *));
+    CacheEntry *e;
+    for (e = c->oldest; e; e = e->next_added)
+    {
+        CacheEntry **chain = &chains[e->hash & (n - 1)];
+        e->next_in_chain = *chain;
+        *chain = e;
+    }
+    free(c->chains);
+    c->chains = chains;
+    c->nchains = n;
+}
+
+static void remove_oldest_cache_entry(PatternCache *c)
+{
+    CacheEntry *e = c->oldest;
+    CacheEntry **p = &c->chains[e->hash & (c->nchains - 1)];
+    while (*p != e) p = &(*p)->next_in_chain;
+    *p = e->next_in_chain;
+
+    c->oldest = e->next_added;
+    if (!c->oldest) c->newest = NULL;
+    c->count--;
+    c->memory -= e->size;
+    destroy_cache_entry(c, e);
+}
+
+/* The cache takes its own reference to the pattern (which is not shared yet). */
+static void add_to_cache(PatternCache *c, mdjvu_bitmap_t bitmap,
+                         mdjvu_pattern_t pattern, uint32 hash, int flags)
+{
+    CacheEntry *e = (CacheEntry *) malloc(sizeof(CacheEntry));
+    CacheEntry **chain;
+    int32 w = mdjvu_bitmap_get_width(bitmap);
+    int32 h = mdjvu_bitmap_get_height(bitmap);
+
+    e->bitmap = mdjvu_bitmap_clone(bitmap);
+    e->pattern = pattern;
+    e->hash = hash;
+    e->flags = flags;
+    e->size = sizeof(CacheEntry) + mdjvu_pattern_get_memory_size(pattern)
+            + h * ((w + 7) / 8 + sizeof(byte *));
+    ((Image *) pattern)->cache = (mdjvu_pattern_cache_t) c;
+    ((Image *) pattern)->references++;
+    c->users++;
+
+    if (c->count >= c->nchains)
+        double_cache_chains(c);
+    chain = &c->chains[hash & (c->nchains - 1)];
+    e->next_in_chain = *chain;
+    *chain = e;
+
+    e->next_added = NULL;
+    if (c->newest)
+        c->newest->next_added = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+    c->count++;
+    c->memory += e->size;
+
+    while (c->memory > c->max_memory && c->oldest != e)
+        remove_oldest_cache_entry(c);
+}
+
+/* The pattern is created outside of the lock,
+ * so another thread may have cached the same bitmap meanwhile.
+ */
+static mdjvu_pattern_t get_cached_pattern(PatternCache *c,
+    mdjvu_matcher_options_t opt, mdjvu_bitmap_t bitmap)
+{
+    uint32 hash = mdjvu_bitmap_get_hash(bitmap);
+    int flags = (((Options *) opt)->aggression ? 1 : 0)
+              | (((Options *) opt)->method & MDJVU_MATCHER_PITH_2 ? 2 : 0);
+    mdjvu_pattern_t pattern, cached;
+
+    LOCK_CACHE(c);
+    pattern = find_in_cache(c, bitmap, hash, flags);
+    if (pattern)
+        c->hits++;
+    else
+        c->misses++;
+    UNLOCK_CACHE(c);
+    if (pattern) return pattern;
+
+    pattern = create_pattern(opt, bitmap);
+
+    LOCK_CACHE(c);
+    cached = find_in_cache(c, bitmap, hash, flags);
+    if (!cached)
+        add_to_cache(c, bitmap, pattern, hash, flags);
+    UNLOCK_CACHE(c);
+
+    if (cached)
+    {
+        mdjvu_pattern_destroy(pattern);
+        return cached;
+    }
+    return pattern;
+}
+
+/* Pattern cache }}} */
+
+mdjvu_pattern_t mdjvu_pattern_create(mdjvu_matcher_options_t opt, mdjvu_bitmap_t bitmap)
+{
+    PatternCache *cache = (PatternCache *) ((Options *) opt)->cache;
+    if (cache)
+        return get_cached_pattern(cache, opt, bitmap);
+    return create_pattern(opt, bitmap);
+}
 #endif
 
 /* Finding mass center {{{ */
@@ -423,6 +780,39 @@ MDJVU_IMPLEMENT void mdjvu_pattern_get_center(mdjvu_pattern_t p, int32 *cx, int3
     *cy = ((Image *) p)->mass_center_y;
 }
 
+MDJVU_IMPLEMENT void mdjvu_pattern_get_dimensions(mdjvu_pattern_t p,
+                                                  int32 *w, int32 *h, int32 *mass)
+{
+    *w = ((Image *) p)->width;
+    *h = ((Image *) p)->height;
+    *mass = ((Image *) p)->mass;
+}
+
+MDJVU_IMPLEMENT int mdjvu_pattern_dimensions_fit(mdjvu_pattern_t p,
+                                                 int32 w, int32 h, int32 mass)
+{
+    Image *img = (Image *) p;
+    return !simple_tests_by_dimensions(img->width, img->height, img->mass,
+                                       w, h, mass);
+}
+
+MDJVU_IMPLEMENT void mdjvu_pattern_get_fitting_widths(mdjvu_pattern_t p,
+                                                     int32 *min_w, int32 *max_w)
+{
+    int32 w = ((Image *) p)->width;
+    int32 lo = (int32) (w * 100. / (100.+ size_difference_threshold));
+    int32 hi = (int32) (w * (100.+ size_difference_threshold) / 100.);
+
+    /* the guesses may be off by one due to rounding */
+    while (lo > 0 && !sizes_differ(w, lo - 1)) lo--;
+    while (sizes_differ(w, lo)) lo++;
+    while (!sizes_differ(w, hi + 1)) hi++;
+    while (sizes_differ(w, hi)) hi--;
+
+    *min_w = lo;
+    *max_w = hi;
+}
+
 static void sweep(unsigned char **pixels, unsigned char **source, int w, int h)
 {
     int x, y;
@@ -488,6 +878,121 @@ static unsigned char **quick_thicken(unsigned char **pixels, int w, int h, int N
     return buf;
 }
 
+/* Bit planes {{{ */
+
+static int32 popcount(uint32 x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (int32) ((x * 0x01010101) >> 24);
+}
+
+/* Packs nonzero pixels as black. */
+static void pack_plane(BitPlane *plane, byte **pixels, int32 w, int32 h)
+{
+    int32 x, y;
+    int32 wpr = plane->words_per_row = (w + 31) / 32;
+    plane->width = w;
+    plane->height = h;
+    plane->data = MALLOC(uint32, wpr * h + 1);
+    memset(plane->data, 0, (wpr * h + 1) * sizeof(uint32));
+    for (y = 0; y < h; y++)
+    {
+        uint32 *row = plane->data + y * wpr;
+        for (x = 0; x < w; x++)
+            if (pixels[y][x]) row[x >> 5] |= 0x80000000u >> (x & 31);
+    }
+}
+
+/* 32 pixels of the row starting from x, those past the row end are garbage */
+static uint32 get_32_pixels(uint32 *row, int32 x)
+{
+    int32 k = x >> 5, r = x & 31;
+    if (!r) return row[k];
+    return (row[k] << r) | (row[k + 1] >> (32 - r));
+}
+
+/* the number of black pixels among n pixels of the row starting from x */
+static int32 count_black(uint32 *row, int32 x, int32 n)
+{
+    int32 i, s = 0;
+    for (i = 0; i + 32 <= n; i += 32)
+        s += popcount(get_32_pixels(row, x + i));
+    if (i < n)
+        s += popcount(get_32_pixels(row, x + i) & (0xFFFFFFFFu << (32 - (n - i))));
+    return s;
+}
+
+/* the number of pixels that are black in a and white in b (among n) */
+static int32 count_black_and_white(uint32 *a, int32 x_a,
+                                   uint32 *b, int32 x_b, int32 n)
+{
+    int32 i, s = 0;
+    for (i = 0; i + 32 <= n; i += 32)
+        s += popcount(get_32_pixels(a, x_a + i) & ~get_32_pixels(b, x_b + i));
+    if (i < n)
+    {
+        uint32 d = get_32_pixels(a, x_a + i) & ~get_32_pixels(b, x_b + i);
+        s += popcount(d & (0xFFFFFFFFu << (32 - (n - i))));
+    }
+    return s;
+}
+
+/* This is distance_by_pixeldiff_functions_by_shift() for bit planes,
+ * counting 255 for each pixel that's black in p1 and white in p2.
+ */
+static int32 subset_distance_by_shift(BitPlane *p1, BitPlane *p2,
+    int32 ceiling,
+    int32 shift_x, int32 shift_y) /* of p1's coordinate system with respect to p2 */
+{
+    int32 w1 = p1->width, w2 = p2->width, h1 = p1->height, h2 = p2->height;
+    int32 min_y = shift_y < 0 ? shift_y : 0;
+    int32 right1 = shift_x + w1;
+    int32 max_y_plus_1 = h2 > shift_y + h1 ? h2 : shift_y + h1;
+    int32 i;
+    int32 min_overlap_x = shift_x > 0 ? shift_x : 0;
+    int32 max_overlap_x_plus_1 = w2 < right1 ? w2 : right1;
+    int32 min_overlap_x_for_p1 = min_overlap_x - shift_x;
+    int32 max_overlap_x_plus_1_for_p1 = max_overlap_x_plus_1 - shift_x;
+    int32 overlap_length = max_overlap_x_plus_1 - min_overlap_x;
+    int32 score = 0;
+
+    if (overlap_length <= 0) return INT32_MAX;
+
+    /* rows of p2 out of p1 are never counted */
+    if (min_y < shift_y) min_y = shift_y;
+    if (max_y_plus_1 > shift_y + h1) max_y_plus_1 = shift_y + h1;
+
+    for (i = min_y; i < max_y_plus_1; i++)
+    {
+        uint32 *row1 = p1->data + (i - shift_y) * p1->words_per_row;
+
+        if (i < 0 || i >= h2)
+        {
+            score += 255 * count_black(row1, 0, w1);
+        }
+        else
+        {
+            uint32 *row2 = p2->data + i * p2->words_per_row;
+            int32 s = count_black_and_white(row1, min_overlap_x_for_p1,
+                                            row2, min_overlap_x,
+                                            overlap_length);
+
+            /* the margins of p1 */
+            s += count_black(row1, 0, min_overlap_x_for_p1);
+            s += count_black(row1, max_overlap_x_plus_1_for_p1,
+                             w1 - max_overlap_x_plus_1_for_p1);
+            score += 255 * s;
+        }
+
+        if (score >= ceiling) return INT32_MAX;
+    }
+    return score;
+}
+
+/* Bit planes }}} */
+
 MDJVU_IMPLEMENT mdjvu_pattern_t mdjvu_pattern_create_from_array(mdjvu_matcher_options_t m_opt, byte **pixels, int32 w, int32 h)/*{{{*/
 {
     Options *opt = (Options *) m_opt;
@@ -498,6 +1003,8 @@ MDJVU_IMPLEMENT mdjvu_pattern_t mdjvu_pattern_create_from_array(mdjvu_matcher_op
 
     img->width = w;
     img->height = h;
+    img->cache = NULL;
+    img->references = 1;
 
     img->pixels = allocate_bitmap(w, h);
     memset(img->pixels[0], 0, w * h);
@@ -533,15 +1040,20 @@ MDJVU_IMPLEMENT mdjvu_pattern_t mdjvu_pattern_create_from_array(mdjvu_matcher_op
 
     if (opt->method & MDJVU_MATCHER_PITH_2)
     {
-        img->pith2_inner = quick_thin(pixels, w, h, TIMES_TO_THIN);
-        img->pith2_outer = quick_thicken(pixels, w, h, TIMES_TO_THICKEN);
-        assert(img->pith2_inner);
-        assert(img->pith2_outer);
+        byte **inner = quick_thin(pixels, w, h, TIMES_TO_THIN);
+        byte **outer = quick_thicken(pixels, w, h, TIMES_TO_THICKEN);
+        assert(inner);
+        assert(outer);
+        pack_plane(&img->pith2_inner, inner, w, h);
+        pack_plane(&img->pith2_outer, outer,
+                   w + TIMES_TO_THICKEN*2, h + TIMES_TO_THICKEN*2);
+        free_bitmap_with_margins(inner);
+        free_bitmap_with_margins(outer);
     }
     else
     {
-        img->pith2_inner = NULL;
-        img->pith2_outer = NULL;
+        img->pith2_inner.data = NULL;
+        img->pith2_outer.data = NULL;
     }
 
     return (mdjvu_pattern_t) img;
@@ -549,62 +1061,38 @@ MDJVU_IMPLEMENT mdjvu_pattern_t mdjvu_pattern_create_from_array(mdjvu_matcher_op
 
 
 
-static int32 pith2_row_subset(byte *A, byte *B, int32 length)
-{
-    int32 i, s = 0;
-    for (i = 0; i < length; i++)
-    {
-        if (A[i] & !B[i])
-            s += 255;
-    }
-    return s;
-}
-
-static int32 pith2_row_has_black(byte *row, int32 length)
-{
-    int32 i, s = 0;
-    for (i = 0; i < length; i++)
-    {
-        if (row[i])
-            s += 255;
-    }
-    return s;
-}
-
-static int32 pith2_return_0(byte *A, int32 length)
-{
-    return 0;
-}
-
 static int pith2_is_subset(mdjvu_pattern_t ptr1, mdjvu_pattern_t ptr2, double threshold, int32 dpi)
 {
     Image *i1 = (Image *) ptr1;
     Image *i2 = (Image *) ptr2;
     Image ptr1_inner;
     Image ptr2_outer;
+    Image *a = &ptr1_inner, *b = &ptr2_outer;
     int32 perimeter = i1->width + i1->height + i2->width + i2->height;
     int32 ceiling = (int32) (pithdiff2_veto_threshold * dpi * perimeter / 100);
+    int32 shift_x, shift_y;
     int32 d = 0;
 
-    ptr1_inner.pixels = i1->pith2_inner;
-    assert(i1->pith2_inner);
+    assert(i1->pith2_inner.data);
     ptr1_inner.width  = i1->width;
     ptr1_inner.height = i1->height;
     ptr1_inner.mass_center_x = i1->mass_center_x;
     ptr1_inner.mass_center_y = i1->mass_center_y;
 
-    ptr2_outer.pixels = i2->pith2_outer;
-    assert(i2->pith2_outer);
+    assert(i2->pith2_outer.data);
     ptr2_outer.width  = i2->width  + TIMES_TO_THICKEN*2;
     ptr2_outer.height = i2->height + TIMES_TO_THICKEN*2;
     ptr2_outer.mass_center_x = i2->mass_center_x + MDJVU_CENTER_QUANT;
     ptr2_outer.mass_center_y = i2->mass_center_y + MDJVU_CENTER_QUANT;
 
-    d = distance_by_pixeldiff_functions(&ptr1_inner, &ptr2_outer,
-        &pith2_row_subset,
-        &pith2_row_has_black,
-        &pith2_return_0,
-        ceiling);
+    /* The narrower one (maybe the outer) is checked to be a subset. */
+    align_images(&a, &b, &shift_x, &shift_y);
+    if (a == &ptr1_inner)
+        d = subset_distance_by_shift(&i1->pith2_inner, &i2->pith2_outer,
+                                     ceiling, shift_x, shift_y);
+    else
+        d = subset_distance_by_shift(&i2->pith2_outer, &i1->pith2_inner,
+                                     ceiling, shift_x, shift_y);
 
     if (d == INT32_MAX) return -1;
     else if (d < threshold * dpi * perimeter / 100) return 1;
@@ -690,17 +1178,45 @@ MDJVU_IMPLEMENT int mdjvu_match_patterns(mdjvu_pattern_t ptr1, mdjvu_pattern_t p
 }
 
 
-MDJVU_IMPLEMENT void mdjvu_pattern_destroy(mdjvu_pattern_t p)/*{{{*/
+static void free_image(Image *img)
 {
-    Image *img = (Image *) p;
     if (img->pixels)
         free_bitmap(img->pixels);
 
-    if (img->pith2_inner)
-        free_bitmap_with_margins(img->pith2_inner);
+    if (img->pith2_inner.data)
+        FREE(img->pith2_inner.data);
 
-    if (img->pith2_outer)
-        free_bitmap_with_margins(img->pith2_outer);
+    if (img->pith2_outer.data)
+        FREE(img->pith2_outer.data);
 
     FREE(img);
+}
+
+MDJVU_IMPLEMENT void mdjvu_pattern_destroy(mdjvu_pattern_t p)/*{{{*/
+{
+    Image *img = (Image *) p;
+
+#ifndef NO_MINIDJVU
+    if (img->cache && !release_cached_image(img)) return;
+#endif
+    free_image(img);
 }/*}}}*/
+
+MDJVU_IMPLEMENT int32 mdjvu_pattern_get_memory_size(mdjvu_pattern_t p)
+{
+    Image *img = (Image *) p;
+    int32 size = sizeof(Image);
+
+    if (img->pixels)
+        size += img->width * img->height + img->height * sizeof(byte *);
+
+    if (img->pith2_inner.data)
+        size += (img->pith2_inner.words_per_row * img->pith2_inner.height + 1)
+              * sizeof(uint32);
+
+    if (img->pith2_outer.data)
+        size += (img->pith2_outer.words_per_row * img->pith2_outer.height + 1)
+              * sizeof(uint32);
+
+    return size;
+}
@@ -10,6 +10,9 @@
 #include <math.h>
 #include <assert.h>
 #include <locale.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 /* TODO: remove duplicated code */
 
@@ -30,8 +33,17 @@ int report = 0;
 int no_prototypes = 0;
 int warnings = 0;
 int indirect = 0;
+int jobs = 1;
+int sharded = 0;
+int representatives = 0;
+int unify = 0;
+int duplicates = 0;
+int cache_megabytes = 0;
 const char* dict_suffix = NULL;
 
+/* shared by all dictionary groups */
+mdjvu_pattern_cache_t pattern_cache = NULL;
+
 /* ========================================================================= */
 
 /* file name template routines (for multipage encoding) {{{ */
@@ -142,16 +154,22 @@ static void show_usage_and_exit(void)           /* {{{ */
     printf(_("Options:\n"));
     printf(_("    -A, --Averaging:               compute \"average\" representatives\n"));
     printf(_("    -a <n>, --aggression <n>:      set aggression level (default 100)\n"));
+    printf(_("    -C <n>, --Cache <n>:           reuse patterns of equal shapes (n MB)\n"));
     printf(_("    -c, --clean                    remove small black pieces\n"));
+    printf(_("    -D, --Duplicates:              classify equal letters without matching\n"));
     printf(_("    -d <n> --dpi <n>:              set resolution in dots per inch\n"));
     printf(_("    -e, --erosion                  sacrifice quality to gain in size\n"));
     printf(_("    -i, --indirect:                generate an indirect multipage document\n"));
+    printf(_("    -j <n>, --jobs <n>:            compress using n threads (default 1)\n"));
     printf(_("    -l, --lossy:                   use all lossy options (-s -c -m -e -A)\n"));
     printf(_("    -m, --match:                   match and substitute patterns\n"));
     printf(_("    -n, --no-prototypes:           do not search for prototypes\n"));
     printf(_("    -p <n>, --pages-per-dict <n>:  pages per dictionary (default 10)\n"));
+    printf(_("    -R <n>, --Representatives <n>: keep n patterns per class when matching\n"));
     printf(_("    -r, --report:                  report multipage coding progress\n"));
+    printf(_("    -S, --Sharded:                 classify page ranges in parallel (with -j)\n"));
     printf(_("    -s, --smooth:                  remove some badly looking pixels\n"));
+    printf(_("    -u, --unify:                   substitute only equal letters (lossless)\n"));
     printf(_("    -v, --verbose:                 print messages about everything\n"));
     printf(_("    -X, --Xtension:                file extension for shared dictionary files\n"));
     printf(_("    -w, --warnings:                do not suppress TIFF warnings\n"));
@@ -209,6 +227,8 @@ static mdjvu_matcher_options_t get_matcher_options(void)
         if (Match)
             mdjvu_use_matcher_method(m_options, MDJVU_MATCHER_RAMPAGE);
         mdjvu_set_aggression(m_options, aggression);
+        if (pattern_cache)
+            mdjvu_set_pattern_cache(m_options, pattern_cache);
     }
     return m_options;
 }
@@ -224,6 +244,8 @@ static void sort_and_save_image(mdjvu_image_t image, const char *path)
     mdjvu_set_verbose(options, verbose);
     mdjvu_set_no_prototypes(options, no_prototypes);
     mdjvu_set_averaging(options, averaging);
+    mdjvu_set_exact_substitution(options, unify);
+    mdjvu_set_classify_duplicates(options, duplicates);
     mdjvu_compress_image(image, options);
     mdjvu_compression_options_destroy(options);
 
@@ -236,7 +258,10 @@ static void sort_and_save_image(mdjvu_image_t image, const char *path)
     }
 }
 
-static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
+/* If the file carries its own resolution, it is stored into *page_dpi
+ * (unless --dpi was given).
+ */
+static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx, int32 *page_dpi)
 {
     mdjvu_error_t error;
     mdjvu_bitmap_t bitmap;
@@ -249,13 +274,11 @@ static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
     else if (decide_if_tiff(path))
     {
         if (verbose) printf(_("loading from TIFF file `%s'\n"), path);
-        if (!warnings)
-            mdjvu_disable_tiff_warnings();
         if (dpi_specified)
             bitmap = mdjvu_load_tiff(path, NULL, &error, tiff_idx);
         else
-            bitmap = mdjvu_load_tiff(path, &dpi, &error, tiff_idx);
-        if (verbose) printf(_("resolution is %d dpi\n"), dpi);
+            bitmap = mdjvu_load_tiff(path, page_dpi, &error, tiff_idx);
+        if (verbose) printf(_("resolution is %d dpi\n"), *page_dpi);
     }
     else if (decide_if_djvu(path))
     {
@@ -281,12 +304,6 @@ static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
         exit(1);
     }
 
-    if (smooth)
-    {
-        if (verbose) printf(_("smoothing the bitmap\n"));
-        mdjvu_smooth(bitmap);
-    }
-
     return bitmap;
 }
 
@@ -303,8 +320,6 @@ static void save_bitmap(mdjvu_bitmap_t bitmap, const char *path)
     else if (decide_if_tiff(path))
     {
         if (verbose) printf(_("saving to TIFF file `%s'\n"), path);
-        if (!warnings)
-            mdjvu_disable_tiff_warnings();
         result = mdjvu_save_tiff(bitmap, path, &error);
     }
     else
@@ -320,6 +335,36 @@ static void save_bitmap(mdjvu_bitmap_t bitmap, const char *path)
     }
 }
 
+static void save_rendered_image(mdjvu_image_t image, const char *path)
+{
+    mdjvu_error_t error;
+    int result;
+
+    if (verbose)
+    {
+        printf(_("rendering bitmap %d x %d by bands\n"),
+               mdjvu_image_get_width(image),
+               mdjvu_image_get_height(image));
+    }
+
+    if (decide_if_tiff(path))
+    {
+        if (verbose) printf(_("saving to TIFF file `%s'\n"), path);
+        result = mdjvu_save_rendered_tiff(image, path, &error);
+    }
+    else
+    {
+        if (verbose) printf(_("saving to PBM file `%s'\n"), path);
+        result = mdjvu_save_rendered_pbm(image, path, &error);
+    }
+
+    if (!result)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+        exit(1);
+    }
+}
+
 /* ========================================================================= */
 
 static void decode(int argc, char **argv)
@@ -331,6 +376,17 @@ static void decode(int argc, char **argv)
     if (verbose) printf(_("________\n\n"));
 
     image = load_image(argv[1]);
+
+    /* Without smoothing, PBM and TIFF can be written while rendering,
+     * so that the whole page never has to be in memory.
+     */
+    if (!smooth && !decide_if_bmp(argv[2]))
+    {
+        save_rendered_image(image, argv[2]);
+        mdjvu_image_destroy(image);
+        return;
+    }
+
     bitmap = mdjvu_render(image);
     mdjvu_image_destroy(image);
 
@@ -352,12 +408,8 @@ static void decode(int argc, char **argv)
 }
 
 
-static mdjvu_image_t split_and_destroy(mdjvu_bitmap_t bitmap)
+static mdjvu_image_t clean_split_image(mdjvu_image_t image)
 {
-    mdjvu_image_t image;
-    if (verbose) printf(_("splitting the bitmap into pieces\n"));
-    image = mdjvu_split(bitmap, dpi, /* options:*/ NULL);
-    mdjvu_bitmap_destroy(bitmap);
     if (verbose)
     {
         printf(_("the split image has %d pieces\n"),
@@ -377,17 +429,89 @@ static mdjvu_image_t split_and_destroy(mdjvu_bitmap_t bitmap)
 }
 
 
+/* Smoothing is done by the splitter on the fly, in the same pass. */
+static mdjvu_split_options_t get_split_options(int nthreads)
+{
+    mdjvu_split_options_t options;
+    if (nthreads <= 1 && !smooth) return NULL;
+    options = mdjvu_split_options_create();
+    mdjvu_split_options_set_threads(options, nthreads);
+    mdjvu_split_options_set_smooth(options, smooth);
+    if (verbose && smooth) printf(_("smoothing the bitmap while splitting\n"));
+    return options;
+}
+
+
+static mdjvu_image_t split_and_destroy(mdjvu_bitmap_t bitmap, int32 page_dpi,
+                                       int nthreads)
+{
+    mdjvu_image_t image;
+    mdjvu_split_options_t options = get_split_options(nthreads);
+    if (verbose) printf(_("splitting the bitmap into pieces\n"));
+    image = mdjvu_split(bitmap, page_dpi, options);
+    if (options) mdjvu_split_options_destroy(options);
+    mdjvu_bitmap_destroy(bitmap);
+    return clean_split_image(image);
+}
+
+
+/* PBM, BMP and TIFF pages are split while being read,
+ * so that the whole page bitmap never has to be in memory.
+ * Splitting in several threads needs the bitmap, so it is loaded then.
+ */
+static mdjvu_image_t load_and_split(const char *path, int tiff_idx,
+                                    int32 *page_dpi, int nthreads)
+{
+    mdjvu_error_t error;
+    mdjvu_image_t image;
+    mdjvu_split_options_t options;
+
+    if (nthreads > 1 || decide_if_djvu(path))
+    {
+        mdjvu_bitmap_t bitmap = load_bitmap(path, tiff_idx, page_dpi);
+        return split_and_destroy(bitmap, *page_dpi, nthreads);
+    }
+
+    options = get_split_options(1);
+    if (decide_if_bmp(path))
+    {
+        if (verbose) printf(_("splitting Windows BMP file `%s' while loading\n"), path);
+        image = mdjvu_split_bmp(path, *page_dpi, options, &error);
+    }
+    else if (decide_if_tiff(path))
+    {
+        if (verbose) printf(_("splitting TIFF file `%s' while loading\n"), path);
+        if (dpi_specified)
+            image = mdjvu_split_tiff(path, NULL, *page_dpi, options, &error, tiff_idx);
+        else
+            image = mdjvu_split_tiff(path, page_dpi, *page_dpi, options, &error, tiff_idx);
+        if (verbose) printf(_("resolution is %d dpi\n"), *page_dpi);
+    }
+    else
+    {
+        if (verbose) printf(_("splitting PBM file `%s' while loading\n"), path);
+        image = mdjvu_split_pbm(path, *page_dpi, options, &error);
+    }
+    if (options) mdjvu_split_options_destroy(options);
+
+    if (!image)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+        exit(1);
+    }
+
+    return clean_split_image(image);
+}
+
+
 static void encode(int argc, char **argv)
 {
-    mdjvu_bitmap_t bitmap;
     mdjvu_image_t image;
 
     if (verbose) printf(_("\nENCODING\n"));
     if (verbose) printf(_("________\n\n"));
 
-    bitmap = load_bitmap(argv[1], 0);
-
-    image = split_and_destroy(bitmap);
+    image = load_and_split(argv[1], 0, &dpi, jobs);
     sort_and_save_image(image, argv[2]);
     mdjvu_image_destroy(image);
 }
@@ -401,7 +525,14 @@ static void filter(int argc, char **argv)
     if (verbose) printf(_("\nFILTERING\n"));
     if (verbose) printf(_("_________\n\n"));
 
-    bitmap = load_bitmap(argv[1], 0);
+    bitmap = load_bitmap(argv[1], 0, &dpi);
+
+    if (smooth)
+    {
+        if (verbose) printf(_("smoothing the bitmap\n"));
+        mdjvu_smooth(bitmap);
+    }
+
     save_bitmap(bitmap, argv[2]);
     mdjvu_bitmap_destroy(bitmap);
 }
@@ -423,24 +554,390 @@ static const char *strip_dir(const char *path)
 }
 
 
+/* page loader (for multipage encoding) {{{ */
+
+/* Pages are loaded and split by a pool of `jobs' threads
+ * while the main thread takes them in order and compresses them.
+ * At most `capacity' pages are loaded in advance,
+ * so that memory consumption does not depend on the number of pages.
+ */
+typedef struct
+{
+    int n;                  /* number of pages                           */
+    char **pages;
+    uint32 multipage_tiff;
+    int capacity;
+    mdjvu_image_t *ready;   /* i-th page goes to ready[i % capacity]     */
+    int next_to_load;       /* the next page a worker will start loading */
+    int next_to_take;       /* the next page the encoder will take       */
+    int nthreads;           /* 0 means loading in the encoder thread     */
+#ifdef HAVE_LIBPTHREAD
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t page_loaded;
+    pthread_cond_t page_taken;
+#endif
+} PageLoader;
+
+static mdjvu_image_t load_page(PageLoader *l, int i)
+{
+    int32 page_dpi = dpi;
+
+    /* the pages themselves are split in parallel */
+    if (l->multipage_tiff)
+        return load_and_split(l->pages[0], i, &page_dpi, 1);
+    else
+        return load_and_split(l->pages[i], 0, &page_dpi, 1);
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *page_loader_thread(void *param)
+{
+    PageLoader *l = (PageLoader *) param;
+
+    pthread_mutex_lock(&l->mutex);
+    while (l->next_to_load < l->n)
+    {
+        int i = l->next_to_load;
+        mdjvu_image_t image;
+
+        if (i - l->next_to_take >= l->capacity)
+        {
+            /* the queue is full, wait for the encoder */
+            pthread_cond_wait(&l->page_taken, &l->mutex);
+            continue;
+        }
+        l->next_to_load++;
+        pthread_mutex_unlock(&l->mutex);
+
+        image = load_page(l, i);
+
+        pthread_mutex_lock(&l->mutex);
+        l->ready[i % l->capacity] = image;
+        pthread_cond_broadcast(&l->page_loaded);
+    }
+    pthread_mutex_unlock(&l->mutex);
+    return NULL;
+}
+#endif
+
+static void page_loader_start(PageLoader *l, int n, char **pages,
+                              uint32 multipage_tiff, int nthreads)
+{
+    l->n = n;
+    l->pages = pages;
+    l->multipage_tiff = multipage_tiff;
+    l->next_to_load = l->next_to_take = 0;
+    l->nthreads = 0;
+    l->capacity = 2 * nthreads;
+    l->ready = MDJVU_MALLOCV(mdjvu_image_t, l->capacity);
+    memset(l->ready, 0, l->capacity * sizeof(mdjvu_image_t));
+
+#ifdef HAVE_LIBPTHREAD
+    if (nthreads > n) nthreads = n;
+    if (nthreads <= 1) return;
+
+    pthread_mutex_init(&l->mutex, NULL);
+    pthread_cond_init(&l->page_loaded, NULL);
+    pthread_cond_init(&l->page_taken, NULL);
+    l->threads = MDJVU_MALLOCV(pthread_t, nthreads);
+    while (l->nthreads < nthreads)
+    {
+        if (pthread_create(&l->threads[l->nthreads], NULL,
+                           page_loader_thread, l))
+            break;
+        l->nthreads++;
+    }
+    if (verbose) printf(_("loading pages in %d threads\n"), l->nthreads);
+#endif
+}
+
+/* Returns pages in order, waiting for them to be loaded if needed. */
+static mdjvu_image_t page_loader_take(PageLoader *l)
+{
+#ifdef HAVE_LIBPTHREAD
+    if (l->nthreads)
+    {
+        mdjvu_image_t image;
+        int slot = l->next_to_take % l->capacity;
+
+        pthread_mutex_lock(&l->mutex);
+        while (!l->ready[slot])
+            pthread_cond_wait(&l->page_loaded, &l->mutex);
+        image = l->ready[slot];
+        l->ready[slot] = NULL;
+        l->next_to_take++;
+        pthread_cond_broadcast(&l->page_taken);
+        pthread_mutex_unlock(&l->mutex);
+        return image;
+    }
+#endif
+    return load_page(l, l->next_to_take++);
+}
+
+static void page_loader_finish(PageLoader *l)
+{
+#ifdef HAVE_LIBPTHREAD
+    if (l->nthreads)
+    {
+        int i;
+        for (i = 0; i < l->nthreads; i++)
+            pthread_join(l->threads[i], NULL);
+        MDJVU_FREEV(l->threads);
+        pthread_cond_destroy(&l->page_taken);
+        pthread_cond_destroy(&l->page_loaded);
+        pthread_mutex_destroy(&l->mutex);
+    }
+#endif
+    MDJVU_FREEV(l->ready);
+}
+
+/* page loader }}} */
+
+/* dictionary groups (for multipage encoding) {{{ */
+
+/* Every pages_per_dict pages are compressed with their own dictionary.
+ * The groups are independent, so with --jobs several of them are compressed
+ * at once. For a bundled document, each group is then saved into its own
+ * temporary file, and those are appended to the document in order.
+ */
+typedef struct
+{
+    int first_page;
+    int npages;
+    int first_element;  /* index of the group's dictionary in `elements' */
+    FILE *file;         /* where to save the group (NULL if indirect)    */
+    int done;
+} Group;
+
+typedef struct
+{
+    int npages;
+    char **elements;
+    int *sizes;
+    int ngroups;
+    Group *groups;
+    PageLoader *loader;
+    int threads_per_group;
+    int next_group;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t take_mutex; /* taking groups and their pages in order */
+    pthread_mutex_t done_mutex;
+    pthread_cond_t group_done;
+#endif
+} MultipageJob;
+
+static FILE *create_temporary_file(void)
+{
+    FILE *tf = tmpfile();
+    if (!tf)
+    {
+        fprintf(stderr, _("Could not create a temporary file\n"));
+        exit(1);
+    }
+    return tf;
+}
+
+static mdjvu_compression_options_t create_multipage_options(int n, int threads)
+{
+    mdjvu_compression_options_t options = mdjvu_compression_options_create();
+    mdjvu_set_matcher_options(options, get_matcher_options());
+
+    mdjvu_set_clean(options, clean);
+    mdjvu_set_verbose(options, verbose);
+    mdjvu_set_no_prototypes(options, no_prototypes);
+    mdjvu_set_report(options, report);
+    mdjvu_set_averaging(options, averaging);
+    mdjvu_set_report_total_pages(options, n);
+    mdjvu_set_threads(options, threads);
+    mdjvu_set_sharded_classification(options, sharded);
+    mdjvu_set_max_patterns_per_class(options, representatives);
+    mdjvu_set_classify_duplicates(options, duplicates);
+    return options;
+}
+
+/* Pages are given by the loader in order, so groups must take them in order */
+static void take_group_pages(MultipageJob *job, Group *g, mdjvu_image_t *images)
+{
+    int i;
+    for (i = 0; i < g->npages; i++)
+    {
+        images[i] = page_loader_take(job->loader);
+        if (report)
+            printf(_("Loading: %d of %d completed\n"), g->first_page + i + 1, job->npages);
+    }
+}
+
+static void encode_group(MultipageJob *job, Group *g, mdjvu_image_t *images)
+{
+    mdjvu_compression_options_t options = create_multipage_options(job->npages, job->threads_per_group);
+    mdjvu_image_t dict;
+    mdjvu_error_t error;
+    char *dict_name = job->elements[g->first_element];
+    int *sizes = job->sizes;
+    int i, el = g->first_element;
+
+    mdjvu_set_report_start_page(options, g->first_page + 1);
+    dict = mdjvu_compress_multipage(g->npages, images, options);
+    mdjvu_compression_options_destroy(options);
+
+    if (g->file)
+        sizes[el] = mdjvu_file_save_djvu_dictionary(dict, (mdjvu_file_t) g->file, 0, &error, erosion);
+    else
+        sizes[el] = mdjvu_save_djvu_dictionary(dict, dict_name, &error, erosion);
+
+    if (!sizes[el])
+    {
+        fprintf(stderr, "%s: %s\n", dict_name, mdjvu_get_error_message(error));
+        exit(1);
+    }
+    el++;
+
+    for (i = 0; i < g->npages; i++, el++)
+    {
+        char *path = job->elements[el];
+
+        if (verbose)
+            printf(_("saving page #%d into %s using dictionary %s\n"), g->first_page + i + 1, path, dict_name);
+
+        if (g->file)
+            sizes[el] = mdjvu_file_save_djvu_page(images[i], (mdjvu_file_t) g->file, strip_dir(dict_name), 0, &error, erosion);
+        else
+            sizes[el] = mdjvu_save_djvu_page(images[i], path, strip_dir(dict_name), &error, erosion);
+        if (!sizes[el])
+        {
+            fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+            exit(1);
+        }
+        mdjvu_image_destroy(images[i]);
+        if (report)
+            printf(_("Saving: %d of %d completed\n"), g->first_page + i + 1, job->npages);
+    }
+    mdjvu_image_destroy(dict);
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* Append a group's temporary file to the bundle, aligning it the same way
+ * as if the group was saved into the bundle directly.
+ */
+static void append_group_file(FILE *tf, FILE *group_file)
+{
+    char buf[4096];
+    size_t len;
+
+    if (ftell(tf) & 1) fputc('\0', tf);
+    rewind(group_file);
+    while ((len = fread(buf, 1, sizeof(buf), group_file)) > 0)
+        fwrite(buf, 1, len, tf);
+}
+
+static void *group_thread(void *param)
+{
+    MultipageJob *job = (MultipageJob *) param;
+    mdjvu_image_t *images = MDJVU_MALLOCV(mdjvu_image_t, pages_per_dict);
+
+    while (1)
+    {
+        Group *g;
+
+        pthread_mutex_lock(&job->take_mutex);
+        if (job->next_group == job->ngroups)
+        {
+            pthread_mutex_unlock(&job->take_mutex);
+            break;
+        }
+        g = &job->groups[job->next_group++];
+        take_group_pages(job, g, images);
+        pthread_mutex_unlock(&job->take_mutex);
+
+        if (!indirect)
+            g->file = create_temporary_file();
+        encode_group(job, g, images);
+
+        pthread_mutex_lock(&job->done_mutex);
+        g->done = 1;
+        pthread_cond_broadcast(&job->group_done);
+        pthread_mutex_unlock(&job->done_mutex);
+    }
+
+    MDJVU_FREEV(images);
+    return NULL;
+}
+
+/* Returns 0 if no threads could be started. */
+static int encode_groups_in_parallel(MultipageJob *job, FILE *tf)
+{
+    int nthreads = jobs < job->ngroups ? jobs : job->ngroups;
+    pthread_t *threads = MDJVU_MALLOCV(pthread_t, nthreads);
+    int i, started = 0;
+
+    pthread_mutex_init(&job->take_mutex, NULL);
+    pthread_mutex_init(&job->done_mutex, NULL);
+    pthread_cond_init(&job->group_done, NULL);
+
+    /* share the threads between the groups being compressed */
+    job->threads_per_group = jobs / nthreads;
+
+    while (started < nthreads)
+    {
+        if (pthread_create(&threads[started], NULL, group_thread, job))
+            break;
+        started++;
+    }
+
+    if (started)
+    {
+        if (verbose) printf(_("compressing %d dictionary groups at once\n"), started);
+
+        /* stitch the bundle together as the groups get ready */
+        for (i = 0; i < job->ngroups; i++)
+        {
+            Group *g = &job->groups[i];
+            pthread_mutex_lock(&job->done_mutex);
+            while (!g->done)
+                pthread_cond_wait(&job->group_done, &job->done_mutex);
+            pthread_mutex_unlock(&job->done_mutex);
+            if (tf)
+            {
+                append_group_file(tf, g->file);
+                fclose(g->file);
+            }
+        }
+
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    if (!started) job->threads_per_group = jobs;
+    pthread_cond_destroy(&job->group_done);
+    pthread_mutex_destroy(&job->done_mutex);
+    pthread_mutex_destroy(&job->take_mutex);
+    MDJVU_FREEV(threads);
+    return started;
+}
+#endif
+
+/* dictionary groups }}} */
+
 static void multipage_encode(int n, char **pages, char *outname, uint32 multipage_tiff)
 {
     mdjvu_image_t *images;
-    mdjvu_image_t dict;
-    int i, el = 0;
+    int i, g, el = 0;
     int ndicts = (pages_per_dict <= 0)? 1 : 
                                         (n % pages_per_dict > 0) ?  (int) fabs(n/pages_per_dict) + 1:
                                                                     (int) fabs(n/pages_per_dict);
     char *dict_name, *path;
     char **elements = MDJVU_MALLOCV(char *, n + ndicts);
     int  *sizes     = MDJVU_MALLOCV(int, n + ndicts);
-    mdjvu_compression_options_t options;
-    mdjvu_bitmap_t bitmap;
+    Group *groups   = MDJVU_MALLOCV(Group, ndicts);
+    PageLoader loader;
+    MultipageJob job;
     mdjvu_error_t error;
     int32 pages_compressed;
+    int encoded = 0;
     FILE *f, *tf=NULL;
 
-    match = 1;
+    if (!unify) match = 1;
 
     if (!decide_if_djvu(outname))
     {
@@ -448,98 +945,71 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
         exit(1);
     }
     if (!indirect)
-    {
-        tf = tmpfile();
-        if (!tf)
-        {
-            fprintf(stderr, _("Could not create a temporary file\n"));
-            exit(1);
-        }
-    }
+        tf = create_temporary_file();
 
     if (verbose) printf(_("\nMULTIPAGE ENCODING\n"));
     if (verbose) printf(_("__________________\n\n"));
     if (verbose) printf(_("%d pages total\n"), n);
 
-    options = mdjvu_compression_options_create();
-    mdjvu_set_matcher_options(options, get_matcher_options());
-
-    mdjvu_set_clean(options, clean);
-    mdjvu_set_verbose(options, verbose);
-    mdjvu_set_no_prototypes(options, no_prototypes);
-    mdjvu_set_report(options, report);
-    mdjvu_set_averaging(options, averaging);
-    mdjvu_set_report_total_pages(options, n);
-
-    /* compressing */
     if (pages_per_dict <= 0) pages_per_dict = n;
     if (pages_per_dict > n) pages_per_dict = n;
-    images = MDJVU_MALLOCV(mdjvu_image_t, pages_per_dict);
-    pages_compressed = 0;
 
-    while (n - pages_compressed)
+    /* splitting into groups and naming the document elements */
+    pages_compressed = 0;
+    for (g = 0; g < ndicts; g++)
     {
         int32 pages_to_compress = n - pages_compressed;
         if (pages_to_compress > pages_per_dict)
             pages_to_compress = pages_per_dict;
 
-        mdjvu_set_report_start_page(options, pages_compressed + 1);
-
-        for (i = 0; i < pages_to_compress; i++)
-        {
-            if (multipage_tiff)
-                bitmap = load_bitmap(pages[0], pages_compressed + i);
-            else
-                bitmap = load_bitmap(pages[pages_compressed + i], 0);
-            images[i] = split_and_destroy(bitmap);
-            if (report)
-                printf(_("Loading: %d of %d completed\n"), pages_compressed + i + 1, n);
-        }
-
-        dict = mdjvu_compress_multipage(pages_to_compress, images, options);
+        groups[g].first_page = pages_compressed;
+        groups[g].npages = pages_to_compress;
+        groups[g].first_element = el;
+        groups[g].file = tf;
+        groups[g].done = 0;
 
         path = get_page_or_dict_name(elements, el, strip_dir(pages[multipage_tiff ? 0 : pages_compressed]));
         dict_name = MDJVU_MALLOCV(char, strlen(path) + strlen(dict_suffix) - 2);
         strcpy(dict_name, path);
         replace_suffix(dict_name, dict_suffix);
-        
-        if (!indirect)
-            sizes[el] = mdjvu_file_save_djvu_dictionary(dict, (mdjvu_file_t) tf, 0, &error, erosion);
-        else
-            sizes[el] = mdjvu_save_djvu_dictionary(dict, dict_name, &error, erosion);
-        
-        if (!sizes[el])
-        {
-            fprintf(stderr, "%s: %s\n", dict_name, mdjvu_get_error_message(error));
-            exit(1);
-        }
         elements[el++] = dict_name;
 
         for (i = 0; i < pages_to_compress; i++)
         {
             if (i > 0)
                 path = get_page_or_dict_name(elements, el, strip_dir(pages[multipage_tiff ? 0 : pages_compressed + i]));
-
-            if (verbose)
-                printf(_("saving page #%d into %s using dictionary %s\n"), pages_compressed + i + 1, path, dict_name);
-            
-            if (!indirect)
-                sizes[el] = mdjvu_file_save_djvu_page(images[i], (mdjvu_file_t) tf, strip_dir(dict_name), 0, &error, erosion);
-            else
-                sizes[el] = mdjvu_save_djvu_page(images[i], path, strip_dir(dict_name), &error, erosion);
-            if (!sizes[el])
-            {
-                fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
-                exit(1);
-            }
             elements[el++] = path;
-            mdjvu_image_destroy(images[i]);
-            if (report)
-                printf(_("Saving: %d of %d completed\n"), pages_compressed + i + 1, n);
         }
-        mdjvu_image_destroy(dict);
         pages_compressed += pages_to_compress;
     }
+
+    job.npages = n;
+    job.elements = elements;
+    job.sizes = sizes;
+    job.ngroups = ndicts;
+    job.groups = groups;
+    job.loader = &loader;
+    job.threads_per_group = jobs;
+    job.next_group = 0;
+
+    /* compressing */
+    page_loader_start(&loader, n, pages, multipage_tiff, jobs);
+#ifdef HAVE_LIBPTHREAD
+    if (jobs > 1 && ndicts > 1)
+        encoded = encode_groups_in_parallel(&job, tf);
+#endif
+    if (!encoded)
+    {
+        images = MDJVU_MALLOCV(mdjvu_image_t, pages_per_dict);
+        for (g = 0; g < ndicts; g++)
+        {
+            take_group_pages(&job, &groups[g], images);
+            encode_group(&job, &groups[g], images);
+        }
+        MDJVU_FREEV(images);
+    }
+    page_loader_finish(&loader);
+
     if (!indirect)
     {
         f = fopen(outname, "wb");
@@ -558,11 +1028,7 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
     for (i=0; i<el; i++) MDJVU_FREEV(elements[i]);
     MDJVU_FREEV(elements);
     MDJVU_FREEV(sizes);
-
-    /* destroying */
-    mdjvu_compression_options_destroy(options);
-
-    MDJVU_FREEV(images);
+    MDJVU_FREEV(groups);
 }
 
 /* same_option(foo, "opt") returns 1 in three cases:
@@ -587,12 +1053,18 @@ static int process_options(int argc, char **argv)
         char *option = argv[i] + 1;
         if (same_option(option, "verbose"))
             verbose = 1;
+        else if (same_option(option, "Sharded"))
+            sharded = 1;
         else if (same_option(option, "smooth"))
             smooth = 1;
         else if (same_option(option, "match"))
             match = 1;
         else if (same_option(option, "Match"))
             Match = 1;
+        else if (same_option(option, "unify"))
+            unify = 1;
+        else if (same_option(option, "Duplicates"))
+            duplicates = 1;
         else if (same_option(option, "no-prototypes"))
             no_prototypes = 1;
         else if (same_option(option, "erosion"))
@@ -632,6 +1104,39 @@ static int process_options(int argc, char **argv)
                 exit(2);
             }
         }
+        else if (same_option(option, "jobs"))
+        {
+            i++;
+            if (i == argc) show_usage_and_exit();
+            jobs = atoi(argv[i]);
+            if (jobs < 1)
+            {
+                fprintf(stderr, _("bad --jobs value\n"));
+                exit(2);
+            }
+        }
+        else if (same_option(option, "Representatives"))
+        {
+            i++;
+            if (i == argc) show_usage_and_exit();
+            representatives = atoi(argv[i]);
+            if (representatives < 1)
+            {
+                fprintf(stderr, _("bad --Representatives value\n"));
+                exit(2);
+            }
+        }
+        else if (same_option(option, "Cache"))
+        {
+            i++;
+            if (i == argc) show_usage_and_exit();
+            cache_megabytes = atoi(argv[i]);
+            if (cache_megabytes < 1)
+            {
+                fprintf(stderr, _("bad --Cache value\n"));
+                exit(2);
+            }
+        }
         else if (same_option(option, "dpi"))
         {
             i++;
@@ -684,6 +1189,9 @@ int main(int argc, char **argv)
 
     arg_start = process_options(argc, argv);
     if ( dict_suffix == NULL ) dict_suffix = "iff";
+    if (!warnings) mdjvu_disable_tiff_warnings();
+    if (cache_megabytes)
+        pattern_cache = mdjvu_pattern_cache_create(cache_megabytes * 1048576.);
 
     argc -= arg_start - 1;
     argv += arg_start - 1;
@@ -713,6 +1221,18 @@ int main(int argc, char **argv)
             filter(argc, argv);
     }
 
+    if (pattern_cache)
+    {
+        if (verbose)
+        {
+            int32 hits, misses;
+            mdjvu_pattern_cache_get_statistics(pattern_cache, &hits, &misses);
+            printf(_("pattern cache: %d patterns reused, %d prepared\n"),
+                   (int) hits, (int) misses);
+        }
+        mdjvu_pattern_cache_destroy(pattern_cache);
+    }
+
     if (verbose) printf("\n");
     #ifndef NDEBUG 
         if (alive_bitmap_counter)